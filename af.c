@@ -1,92 +1,44 @@
 // PWM example, based on code from http://elinux.org/RPi_Low-level_peripherals for the mmap part
 // and http://www.raspberrypi.org/phpBB3/viewtopic.php?t=8467&p=124620 for PWM initialization
 //
-// compile with "gcc pwm.c -o pwm", test with "./pwm" (needs to be root for /dev/mem access)
+// compile with "gcc af.c periph.c reglock.c -o af -lpthread -lrt", test with "./af" (needs to be root for /dev/mem access)
+//
+// "./af 18=5 19=5 4=o" or "./af -f pinmap" sets any number of pins at once,
+// with one read and one write per GPFSEL bank; "./af 18 5" still works.
+//
+// The listing decodes every pin from one read of the six GPFSEL banks, so
+// it is a consistent snapshot; -j prints it as JSON and -c as CSV.
 //
 // Frank Buss, 2012
 
-#define BCM2708_PERI_BASE	0x20000000
-#define GPIO_BASE		(BCM2708_PERI_BASE + 0x200000) /* GPIO controller */
-
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <dirent.h>
-#include <fcntl.h>
-#include <assert.h>
-#include <sys/mman.h>
-#include <sys/types.h>
-#include <sys/stat.h>
 
 #include <unistd.h>
 
-#define PAGE_SIZE (4*1024)
-#define BLOCK_SIZE (4*1024)
+#include "periph.h"
+#include "reglock.h"
 
 // I/O access
-volatile unsigned *gpio;
+volatile uint32_t *gpio;
 
 // GPIO setup macros. Always use INP_GPIO(x) before using OUT_GPIO(x) or SET_GPIO_ALT(x,y)
-#define INP_GPIO(g) *(gpio+((g)/10)) &= ~(7<<(((g)%10)*3))
-#define OUT_GPIO(g) *(gpio+((g)/10)) |=  (1<<(((g)%10)*3))
+// The read-modify-writes lock the GPFSEL bank, see reglock.h
+#define INP_GPIO(g) reglock_rmw(gpio, (g)/10, 7<<(((g)%10)*3), 0)
+#define OUT_GPIO(g) reglock_rmw(gpio, (g)/10, 0, 1<<(((g)%10)*3))
 
 #define GPIO_BANK(g) (*(gpio+(((g)/10))))
-#define GPIO_FSET(g,a) (GPIO_BANK(g) =  \
-    (GPIO_BANK(g) & (~(7<<(((g)%10)*3)))) | ((a)<<(((g)%10)*3)))
+#define GPIO_FSET(g,a) reglock_rmw(gpio, (g)/10, 7<<(((g)%10)*3), (a)<<(((g)%10)*3))
 #define GPIO_FGET(g) (GPIO_BANK(g) >> ((((g)%10)*3)) & 7)
 
 #define GPIO_SET *(gpio+7)  // sets   bits which are 1 ignores bits which are 0
 #define GPIO_CLR *(gpio+10) // clears bits which are 1 ignores bits which are 0
 
-// map 4k register memory for direct access from user space and return a user space pointer to it
-static volatile unsigned *mapRegisterMemory(int base)
-{
-	static int mem_fd = 0;
-	char *mem, *map;
-	
-	/* open /dev/mem */
-	if (!mem_fd) {
-		if ((mem_fd = open("/dev/mem", O_RDWR|O_SYNC) ) < 0) {
-			printf("can't open /dev/mem \n");
-			exit (-1);
-		}
-	}
-	
-	/* mmap register */
-	
-	// Allocate MAP block
-	if ((mem = malloc(BLOCK_SIZE + (PAGE_SIZE-1))) == NULL) {
-		printf("allocation error \n");
-		exit (-1);
-	}
-	
-	// Make sure pointer is on 4K boundary
-	if ((unsigned long)mem % PAGE_SIZE)
-		mem += PAGE_SIZE - ((unsigned long)mem % PAGE_SIZE);
-	
-	// Now map it
-	map = (char *)mmap(
-		(caddr_t)mem,
-		BLOCK_SIZE,
-		PROT_READ|PROT_WRITE,
-		MAP_SHARED|MAP_FIXED,
-		mem_fd,
-		base
-	);
-	
-	if ((long)map < 0) {
-		printf("mmap error %d\n", (int)map);
-		exit (-1);
-	}
-	
-	// Always use volatile pointer!
-	return (volatile unsigned *)map;
-}
-
 // set up a memory regions to access GPIO, PWM and the clock manager
 static void setupRegisterMemoryMappings()
 {
-	gpio = mapRegisterMemory(GPIO_BASE);
+	gpio = periph_map(GPIO_OFFSET);
 }
 
 
@@ -101,49 +53,204 @@ static const char *mapping[] = {
     "AF3",
 };
 
+#define NUM_PINS 54
+#define NUM_BANKS 6
+
+enum { LIST_TEXT, LIST_JSON, LIST_CSV };
+static int listFormat = LIST_TEXT;
+
+// pending function changes, one mask/value pair per GPFSEL bank
+static uint32_t bankMask[NUM_BANKS];
+static uint32_t bankValue[NUM_BANKS];
+
+static int parseFunction(const char *name)
+{
+    if (name[0] == 'I' || name[0] == 'i')
+        return 0;
+    else if (name[0] == 'O' || name[0] == 'o')
+        return 1;
+    else if (name[0] == '5')
+        return 2;
+    else if (name[0] == '4')
+        return 3;
+    else if (name[0] == '0')
+        return 4;
+    else if (name[0] == '1')
+        return 5;
+    else if (name[0] == '2')
+        return 6;
+    else if (name[0] == '3')
+        return 7;
+    fprintf(stderr, "Unrecognized function: %c.  Must be one of {io012345}\n",
+            name[0]);
+    return -1;
+}
+
+// queue pin to be set to function af; a later setting of the same pin wins
+static int queuePin(int pin, const char *func)
+{
+    int af;
+
+    if (pin < 0 || pin >= NUM_PINS) {
+        fprintf(stderr, "Pin %d out of range!  Only 54 pins present.\n", pin);
+        return -1;
+    }
+    if ((af = parseFunction(func)) < 0)
+        return -1;
+
+    // keep machine-readable output clean
+    if (listFormat == LIST_TEXT)
+        printf("Setting GPIO%d to %s...\n", pin, mapping[af]);
+    bankMask[pin / 10] |= 7 << ((pin % 10) * 3);
+    bankValue[pin / 10] = (bankValue[pin / 10] & ~(7 << ((pin % 10) * 3))) |
+        (af << ((pin % 10) * 3));
+    return 0;
+}
+
+// parse "pin=func"
+static int queueAssignment(const char *arg)
+{
+    char *end;
+    int pin = strtol(arg, &end, 0);
+
+    if (end == arg || *end != '=') {
+        fprintf(stderr, "Expected pin=function, got \"%s\"\n", arg);
+        return -1;
+    }
+    return queuePin(pin, end + 1);
+}
+
+// read a pin map: "pin=func" or "pin func" per line, # starts a comment
+static int queueFile(const char *path)
+{
+    FILE *f = strcmp(path, "-") ? fopen(path, "r") : stdin;
+    char line[256];
+    int lineno = 0, err = 0;
+
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        char *p = line, *end;
+        int pin;
+
+        lineno++;
+        if ((end = strchr(p, '#')) != NULL)
+            *end = '\0';
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == '\n' || !*p)
+            continue;
+
+        pin = strtol(p, &end, 0);
+        while (*end == ' ' || *end == '\t' || *end == '=')
+            end++;
+        if (end == p || !*end || *end == '\n' || queuePin(pin, end)) {
+            fprintf(stderr, "%s:%d: bad pin assignment\n", path, lineno);
+            err = -1;
+        }
+    }
+    if (f != stdin)
+        fclose(f);
+    return err;
+}
+
+// one locked read and write per GPFSEL bank that has changes
+static int commitPins(void)
+{
+    int bank;
+
+    for (bank = 0; bank < NUM_BANKS; bank++) {
+        if (!bankMask[bank])
+            continue;
+        if (reglock_rmw(gpio, bank, bankMask[bank], bankValue[bank]))
+            return -1;
+    }
+    return 0;
+}
+
+
+// read the six banks once and print every pin from that copy
+static void listPins(int format)
+{
+    uint32_t banks[NUM_BANKS];
+    int i;
+
+    for (i = 0; i < NUM_BANKS; i++)
+        banks[i] = periph_rd(gpio, i);
+
+    if (format == LIST_JSON) {
+        printf("{\"gpfsel\": [");
+        for (i = 0; i < NUM_BANKS; i++)
+            printf("%s%u", i ? ", " : "", banks[i]);
+        printf("], \"pins\": [");
+    }
+    else if (format == LIST_CSV)
+        printf("gpio,function\n");
+
+    for (i = 0; i < NUM_PINS; i++) {
+        const char *name = mapping[(banks[i / 10] >> ((i % 10) * 3)) & 7];
+
+        if (format == LIST_JSON)
+            printf("%s{\"gpio\": %d, \"function\": \"%s\"}", i ? ", " : "", i, name);
+        else if (format == LIST_CSV)
+            printf("%d,%s\n", i, name);
+        else
+            printf("GPIO%d: %s\n", i, name);
+    }
+
+    if (format == LIST_JSON)
+        printf("]}\n");
+}
+
 int main(int argc, char **argv)
 { 
-    int i;
-	// init PWM module for GPIO pin 18 with 50 Hz frequency
-	setupRegisterMemoryMappings();
+    const char *pinmap = NULL;
+    int ch, i;
 
-    if (argc == 3) {
-        int pin = strtoul(argv[1], NULL, 0);
-        int af;
-        if (argv[2][0] == 'I' || argv[2][0] == 'i')
-            af = 0;
-        else if (argv[2][0] == 'O' || argv[2][0] == 'o')
-            af = 1;
-        else if (argv[2][0] == '5')
-            af = 2;
-        else if (argv[2][0] == '4')
-            af = 3;
-        else if (argv[2][0] == '0')
-            af = 4;
-        else if (argv[2][0] == '1')
-            af = 5;
-        else if (argv[2][0] == '2')
-            af = 6;
-        else if (argv[2][0] == '3')
-            af = 7;
-        else {
-            fprintf(stderr, "Unrecognized function: %c.  Must be one of {io012345}",
-                    argv[2][0]);
-            return 1;
-        }
+    while ((ch = getopt(argc, argv, "f:jc")) != -1) {
+        switch (ch) {
+        case 'f':
+            pinmap = optarg;
+            break;
+
+        case 'j':
+            listFormat = LIST_JSON;
+            break;
+
+        case 'c':
+            listFormat = LIST_CSV;
+            break;
 
-        if (pin < 0 || pin > 54) {
-            fprintf(stderr, "Pin %d out of range!  Only 54 pins present.\n", pin);
+        default:
+            printf("Usage: %s [-j|-c] [-f pinmap] [pin=func...]\n", argv[0]);
+            printf("       %s pin func\n", argv[0]);
+            printf("\tfunc is one of i(nput), o(utput), 0-5 (alternate function)\n");
             return 1;
         }
-
-        printf("Setting GPIO%d to %s...\n", pin, mapping[af]);
-        GPIO_FSET(pin, af);
     }
 
-    for (i=0; i<54; i++) {
-        printf("GPIO%d: %s\n", i, mapping[GPIO_FGET(i)]);
+	// init PWM module for GPIO pin 18 with 50 Hz frequency
+	setupRegisterMemoryMappings();
+
+    if (pinmap && queueFile(pinmap))
+        return 1;
+    if (argc - optind == 2 && !strchr(argv[optind], '=')) {
+        if (queuePin(strtoul(argv[optind], NULL, 0), argv[optind + 1]))
+            return 1;
+    }
+    else {
+        for (i = optind; i < argc; i++)
+            if (queueAssignment(argv[i]))
+                return 1;
     }
+    if (commitPins()) {
+        perror("Unable to set pin functions");
+        return 1;
+    }
+
+    listPins(listFormat);
 
 	
 	return 0;
@@ -0,0 +1,293 @@
+// BCM2835 clock manager, see clkman.h
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <math.h>
+
+#include "periph.h"
+#include "reglock.h"
+#include "clkman.h"
+
+#define CLK_PASSWD	0x5A000000
+
+/* Control register bits */
+#define CNTL_SRC_MASK	0xf
+#define CNTL_ENAB	(1 << 4)
+#define CNTL_KILL	(1 << 5)
+#define CNTL_BUSY	(1 << 7)
+#define CNTL_MASH_SHIFT	9
+#define CNTL_MASH_MASK	(3 << CNTL_MASH_SHIFT)
+
+#define DIVI_SHIFT	12
+#define DIVI_MAX	0xfff
+#define DIVF_ONE	4096
+
+static const struct {
+    const char *name;
+    unsigned int cntl;          /* word index in the clock manager block */
+} clocks[CLK_COUNT] = {
+    [CLK_GP0] = { "gp0", 0x70 / 4 },
+    [CLK_GP1] = { "gp1", 0x78 / 4 },
+    [CLK_GP2] = { "gp2", 0x80 / 4 },
+    [CLK_PCM] = { "pcm", 0x98 / 4 },
+    [CLK_PWM] = { "pwm", 0xa0 / 4 },
+};
+
+/* The divisor register follows the control register */
+#define CLK_DIV(clock) (clocks[clock].cntl + 1)
+
+static const struct {
+    int src;
+    const char *name;
+    double hz;
+    int stable;
+} sources[] = {
+    { CLK_SRC_OSC,  "osc",  19200000.0,   1 },
+    { CLK_SRC_PLLC, "pllc", 1000000000.0, 0 },
+    { CLK_SRC_PLLD, "plld", 500000000.0,  1 },
+    { CLK_SRC_HDMI, "hdmi", 216000000.0,  1 },
+};
+
+#define NUM_SOURCES (sizeof(sources) / sizeof(*sources))
+
+// smallest DIVI each MASH level allows, and how far the divisor it
+// actually uses swings below and above DIVI
+static const struct {
+    int min_divi;
+    int below, above;
+} mash_limits[4] = {
+    { 1, 0, 0 },
+    { 2, 0, 1 },
+    { 3, 1, 2 },
+    { 5, 3, 4 },
+};
+
+const char *clk_name(enum clk_id clock)
+{
+    return clocks[clock].name;
+}
+
+int clk_lookup(const char *name)
+{
+    int i;
+    for (i = 0; i < CLK_COUNT; i++)
+        if (!strcasecmp(name, clocks[i].name))
+            return i;
+    return -1;
+}
+
+const char *clk_source_name(int src)
+{
+    unsigned int i;
+
+    if (src == CLK_SRC_GND)
+        return "gnd";
+    if (src == CLK_SRC_PLLA)
+        return "plla";
+    for (i = 0; i < NUM_SOURCES; i++)
+        if (sources[i].src == src)
+            return sources[i].name;
+    return "?";
+}
+
+double clk_source_hz(int src)
+{
+    unsigned int i;
+    for (i = 0; i < NUM_SOURCES; i++)
+        if (sources[i].src == src)
+            return sources[i].hz;
+    return 0;
+}
+
+static int setting_valid(const struct clk_setting *s)
+{
+    return s->mash >= 0 && s->mash <= 3 && s->src >= 0 && s->src <= CNTL_SRC_MASK &&
+        s->divi >= mash_limits[s->mash].min_divi && s->divi <= DIVI_MAX &&
+        s->divf >= 0 && s->divf < DIVF_ONE;
+}
+
+int clk_evaluate(struct clk_setting *s, double target)
+{
+    double src_hz = clk_source_hz(s->src);
+    double min_hz, max_hz;
+
+    if (!setting_valid(s) || !src_hz)
+        return -1;
+
+    /* MASH 0 ignores DIVF */
+    s->hz = src_hz / (s->divi + (s->mash ? (double)s->divf / DIVF_ONE : 0));
+    s->error = target ? (s->hz - target) / target : 0;
+    if (!s->mash || !s->divf) {
+        s->jitter_ns = 0;
+    } else {
+        max_hz = src_hz / (s->divi - mash_limits[s->mash].below);
+        min_hz = src_hz / (s->divi + mash_limits[s->mash].above);
+        s->jitter_ns = 1e9 / min_hz - 1e9 / max_hz;
+    }
+    return 0;
+}
+
+// closest divisor from one source at one MASH level
+static int candidate(int src, int mash, double target, struct clk_setting *s)
+{
+    double div = clk_source_hz(src) / target;
+
+    s->src = src;
+    s->mash = mash;
+    if (mash == 0) {
+        s->divi = (int)(div + 0.5);
+        s->divf = 0;
+    } else {
+        s->divi = (int)div;
+        s->divf = (int)((div - s->divi) * DIVF_ONE + 0.5);
+        if (s->divf == DIVF_ONE) {
+            s->divi++;
+            s->divf = 0;
+        }
+    }
+    return clk_evaluate(s, target);
+}
+
+int clk_solve(double hz, unsigned int flags, struct clk_setting *best, FILE *report)
+{
+    struct clk_setting s;
+    unsigned int i;
+    int mash, found = 0;
+
+    if (hz <= 0)
+        return -1;
+
+    if (report)
+        fprintf(report, "source  MASH  DIVI  DIVF  frequency         error       jitter\n");
+    for (i = 0; i < NUM_SOURCES; i++) {
+        if (!sources[i].stable && !(flags & CLK_ALLOW_UNSTABLE))
+            continue;
+        for (mash = 0; mash < 4; mash++) {
+            if (candidate(sources[i].src, mash, hz, &s))
+                continue;
+            /* with a zero DIVF every MASH level gives the same clock */
+            if (mash > 1 && !s.divf)
+                continue;
+            if (report)
+                fprintf(report, "%-6s  %4d  %4d  %4d  %16.3f  %+10.3g  %8.1f ns\n",
+                        sources[i].name, s.mash, s.divi, s.divf, s.hz, s.error, s.jitter_ns);
+            if ((flags & CLK_ZERO_JITTER) && s.jitter_ns)
+                continue;
+            if (!found || fabs(s.error) < fabs(best->error) ||
+                    (fabs(s.error) == fabs(best->error) && s.jitter_ns < best->jitter_ns)) {
+                *best = s;
+                found = 1;
+            }
+        }
+    }
+    return found ? 0 : -1;
+}
+
+static uint32_t cntl_value(const struct clk_setting *s)
+{
+    return (s->mash << CNTL_MASH_SHIFT) | s->src;
+}
+
+static uint32_t div_value(const struct clk_setting *s)
+{
+    return (s->divi << DIVI_SHIFT) | s->divf;
+}
+
+int clk_set(const struct clk_request *reqs, int n)
+{
+    volatile uint32_t *clk;
+    uint32_t cntl[CLK_COUNT];
+    unsigned int slots[2 * CLK_COUNT];
+    int change[CLK_COUNT] = { 0 }, busy[CLK_COUNT] = { 0 }, locked[CLK_COUNT] = { 0 };
+    int i, c, nslots = 0, err = 0;
+
+    for (i = 0; i < n; i++)
+        if (reqs[i].clock < 0 || reqs[i].clock >= CLK_COUNT || !setting_valid(&reqs[i].setting)) {
+            errno = EINVAL;
+            return -1;
+        }
+
+    clk = periph_map(CLOCK_OFFSET);
+
+    /* Nobody else may touch these clocks from the first read to the enable */
+    for (i = 0; i < n; i++) {
+        c = reqs[i].clock;
+        if (locked[c]++)
+            continue;
+        slots[nslots++] = reglock_slot(clk, clocks[c].cntl);
+        slots[nslots++] = reglock_slot(clk, CLK_DIV(c));
+    }
+    if ((nslots = reglock_acquire_all(slots, nslots)) < 0)
+        return -1;
+
+    /* Stop every running clock that changes, all at once */
+    for (i = 0; i < n; i++) {
+        const struct clk_request *req = &reqs[i];
+        uint32_t div;
+
+        c = req->clock;
+        cntl[c] = periph_rd(clk, clocks[c].cntl);
+        div = periph_rd(clk, CLK_DIV(c));
+        if ((div & 0xffffff) == div_value(&req->setting) &&
+                (cntl[c] & (CNTL_SRC_MASK | CNTL_MASH_MASK)) == cntl_value(&req->setting) &&
+                !(cntl[c] & CNTL_ENAB) == !req->enable)
+            continue;
+        change[c] = i + 1;
+        if (cntl[c] & (CNTL_ENAB | CNTL_BUSY)) {
+            periph_wr(clk, clocks[c].cntl, CLK_PASSWD | (cntl[c] & 0xffffff & ~CNTL_ENAB));
+            busy[c] = 1;
+        }
+    }
+
+    /* They stop at the end of their current cycle; kill the stragglers */
+    for (c = 0; c < CLK_COUNT; c++) {
+        if (!busy[c])
+            continue;
+        if (periph_wait(clk, clocks[c].cntl, CNTL_BUSY, 0, PERIPH_SETTLE_NS)) {
+            periph_wr(clk, clocks[c].cntl, CLK_PASSWD | CNTL_KILL |
+                    (cntl[c] & (CNTL_SRC_MASK | CNTL_MASH_MASK)));
+            if (periph_wait(clk, clocks[c].cntl, CNTL_BUSY, 0, PERIPH_SETTLE_NS)) {
+                change[c] = 0;
+                err = EBUSY;
+            }
+        }
+    }
+
+    /* Divisors, then sources and MASH with the clock still off, then enables */
+    for (c = 0; c < CLK_COUNT; c++)
+        if (change[c])
+            periph_wr(clk, CLK_DIV(c), CLK_PASSWD | div_value(&reqs[change[c] - 1].setting));
+    for (c = 0; c < CLK_COUNT; c++)
+        if (change[c])
+            periph_wr(clk, clocks[c].cntl, CLK_PASSWD | cntl_value(&reqs[change[c] - 1].setting));
+    for (c = 0; c < CLK_COUNT; c++)
+        if (change[c] && reqs[change[c] - 1].enable)
+            periph_wr(clk, clocks[c].cntl, CLK_PASSWD | CNTL_ENAB |
+                    cntl_value(&reqs[change[c] - 1].setting));
+    reglock_release_all(slots, nslots);
+
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+void clk_get(enum clk_id clock, struct clk_setting *s, int *enabled)
+{
+    volatile uint32_t *clk = periph_map(CLOCK_OFFSET);
+    uint32_t cntl = periph_rd(clk, clocks[clock].cntl);
+    uint32_t div = periph_rd(clk, CLK_DIV(clock));
+
+    memset(s, 0, sizeof(*s));
+    s->src = cntl & CNTL_SRC_MASK;
+    s->mash = (cntl & CNTL_MASH_MASK) >> CNTL_MASH_SHIFT;
+    s->divi = (div >> DIVI_SHIFT) & DIVI_MAX;
+    s->divf = div & (DIVF_ONE - 1);
+    clk_evaluate(s, 0);
+    if (enabled)
+        *enabled = !!(cntl & CNTL_ENAB);
+}
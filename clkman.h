@@ -0,0 +1,85 @@
+// BCM2835 clock manager: the GP0-2, PCM and PWM clock generators
+//
+// Every generator has a control register (source, MASH, ENAB, BUSY) and a
+// divisor register (DIVI.DIVF), both guarded by the 0x5A password.  The
+// divisor and source must only change while the generator is stopped, so
+// clk_set() reprograms a batch of clocks in phases: clear ENAB on every
+// running clock that changes, which lets it finish its current cycle
+// instead of cutting a pulse short; wait for all their BUSY flags at once;
+// KILL only a clock that doesn't stop in time; then write all divisors, all
+// sources and finally all enables.  Clocks whose setting is unchanged are
+// left running untouched.  The registers of the requested clocks stay
+// locked against other processes for the whole sequence, see reglock.h.
+//
+// clk_solve() finds a setting for a frequency: it tries every stable
+// source, every MASH level and the closest integer and fractional divisors,
+// and picks the smallest error (or the smallest without MASH jitter).
+
+#ifndef CLKMAN_H
+#define CLKMAN_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+enum clk_id {
+    CLK_GP0,
+    CLK_GP1,
+    CLK_GP2,
+    CLK_PCM,
+    CLK_PWM,
+    CLK_COUNT,
+};
+
+/* Clock sources */
+#define CLK_SRC_GND	0
+#define CLK_SRC_OSC	1
+#define CLK_SRC_PLLA	4
+#define CLK_SRC_PLLC	5
+#define CLK_SRC_PLLD	6
+#define CLK_SRC_HDMI	7
+
+/* clk_solve() flags */
+#define CLK_ZERO_JITTER		(1 << 0)    /* only settings without DIVF */
+#define CLK_ALLOW_UNSTABLE	(1 << 1)    /* also PLLC, which follows the core clock */
+
+struct clk_setting {
+    int src;
+    int mash;
+    int divi, divf;
+    double hz;                  /* average output frequency */
+    double error;               /* relative to the request */
+    double jitter_ns;           /* peak-to-peak period variation from MASH */
+};
+
+struct clk_request {
+    enum clk_id clock;
+    struct clk_setting setting;
+    int enable;                 /* 0 leaves the clock stopped */
+};
+
+const char *clk_name(enum clk_id clock);
+
+// Find a clock by name ("gp0", "PWM", ...), -1 if there is none
+int clk_lookup(const char *name);
+
+// Name and frequency of a source, 0 Hz when not fixed or unknown
+const char *clk_source_name(int src);
+double clk_source_hz(int src);
+
+// Fill in hz, error and jitter_ns for src, mash, divi and divf.  Returns -1
+// when the divisor isn't valid for that MASH level.
+int clk_evaluate(struct clk_setting *s, double target);
+
+// Find the best setting for hz.  Every candidate is printed to report
+// unless it is NULL.  Returns -1 if nothing can produce hz.
+int clk_solve(double hz, unsigned int flags, struct clk_setting *best, FILE *report);
+
+// Program n clocks at once, see above.  Returns 0, or -1 with errno set if
+// a setting is invalid (EINVAL, nothing written) or a clock refused to stop
+// (EBUSY, that clock is left stopped and the others are programmed).
+int clk_set(const struct clk_request *reqs, int n);
+
+// Read a clock's current setting, and whether it is enabled
+void clk_get(enum clk_id clock, struct clk_setting *s, int *enabled);
+
+#endif /* CLKMAN_H */
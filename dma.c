@@ -0,0 +1,299 @@
+// BCM2835 DMA engine, see dma.h
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include <unistd.h>
+
+#include "periph.h"
+#include "dma.h"
+
+#define PAGE_SIZE (4*1024)
+
+/* VideoCore mailbox property interface */
+#define IOCTL_MBOX_PROPERTY	_IOWR(100, 0, char *)
+#define MBOX_MEM_ALLOC		0x3000c
+#define MBOX_MEM_LOCK		0x3000d
+#define MBOX_MEM_UNLOCK		0x3000e
+#define MBOX_MEM_RELEASE	0x3000f
+
+/* Allocation flags: uncached on a Pi 2/3, L1 non-allocating on a Pi 1 */
+#define MEM_FLAG_DIRECT		0x04
+#define MEM_FLAG_L1_NONALLOC	0x0c
+
+/* Made-up bus addresses handed out by the simulated engine */
+#define SIM_BUS_BASE		0xC0000000
+
+#define MAX_SIM_ALLOCS	32
+#define MAX_SIM_SINKS	4
+
+/* Give up on chains that loop without ever waiting for a DREQ */
+#define SIM_MAX_UNPACED	(1 << 20)
+
+static int mbox_fd = -1;
+
+static struct {
+    uint32_t bus;
+    void *virt;
+    size_t size;
+} sim_allocs[MAX_SIM_ALLOCS];
+static uint32_t sim_next_bus = SIM_BUS_BASE;
+
+static struct {
+    uint32_t addr;
+    void (*fn)(void *arg, uint32_t word);
+    void *arg;
+} sim_sinks[MAX_SIM_SINKS];
+
+int dma_simulated(void)
+{
+    return periph_backend() != PERIPH_DEVMEM;
+}
+
+static uint32_t mbox_call(uint32_t tag, int nargs, uint32_t a0, uint32_t a1, uint32_t a2)
+{
+    uint32_t msg[9];
+    int i = 0;
+
+    msg[i++] = 0;               /* size, filled in below */
+    msg[i++] = 0;               /* process request */
+    msg[i++] = tag;
+    msg[i++] = nargs * 4;       /* request buffer size */
+    msg[i++] = nargs * 4;       /* response size */
+    msg[i++] = a0;
+    msg[i++] = a1;
+    msg[i++] = a2;
+    msg[5 + nargs] = 0;         /* end tag */
+    msg[0] = (6 + nargs) * sizeof(*msg);
+
+    if (ioctl(mbox_fd, IOCTL_MBOX_PROPERTY, msg) < 0)
+        return 0;
+    return msg[5];
+}
+
+int dma_mem_alloc(struct dma_mem *mem, size_t size)
+{
+    size = (size + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+    memset(mem, 0, sizeof(*mem));
+    mem->size = size;
+
+    if (dma_simulated()) {
+        int i;
+        for (i = 0; i < MAX_SIM_ALLOCS && sim_allocs[i].virt; i++)
+            ;
+        if (i == MAX_SIM_ALLOCS || posix_memalign(&mem->virt, PAGE_SIZE, size)) {
+            errno = ENOMEM;
+            return -1;
+        }
+        memset(mem->virt, 0, size);
+        mem->bus = sim_next_bus;
+        sim_next_bus += size;
+        sim_allocs[i].bus = mem->bus;
+        sim_allocs[i].virt = mem->virt;
+        sim_allocs[i].size = size;
+        return 0;
+    }
+
+    if (mbox_fd < 0 && (mbox_fd = open("/dev/vcio", O_RDWR|O_CLOEXEC)) < 0)
+        return -1;
+
+    mem->handle = mbox_call(MBOX_MEM_ALLOC, 3, size, PAGE_SIZE,
+            periph_phys_base() == BCM2708_PERI_BASE ?
+            MEM_FLAG_L1_NONALLOC : MEM_FLAG_DIRECT);
+    if (!mem->handle)
+        goto fail;
+    mem->bus = mbox_call(MBOX_MEM_LOCK, 1, mem->handle, 0, 0);
+    if (!mem->bus)
+        goto fail;
+    mem->virt = periph_map_phys(mem->bus & ~0xC0000000, size);
+    if (!mem->virt)
+        goto fail;
+    memset(mem->virt, 0, size);
+    return 0;
+
+fail:
+    dma_mem_free(mem);
+    errno = ENOMEM;
+    return -1;
+}
+
+void dma_mem_free(struct dma_mem *mem)
+{
+    int i;
+
+    if (mem->handle) {
+        if (mem->virt)
+            munmap(mem->virt, mem->size);
+        if (mem->bus)
+            mbox_call(MBOX_MEM_UNLOCK, 1, mem->handle, 0, 0);
+        mbox_call(MBOX_MEM_RELEASE, 1, mem->handle, 0, 0);
+    }
+    else if (mem->virt) {
+        for (i = 0; i < MAX_SIM_ALLOCS; i++)
+            if (sim_allocs[i].virt == mem->virt)
+                sim_allocs[i].virt = NULL;
+        free(mem->virt);
+    }
+    memset(mem, 0, sizeof(*mem));
+}
+
+int dma_channel_open(struct dma_channel *chan, int num)
+{
+    if (num < 0 || num > 14) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(chan, 0, sizeof(*chan));
+    chan->num = num;
+    chan->simulated = dma_simulated();
+    chan->regs = periph_map(DMA_OFFSET) + num * DMA_CHANNEL_SIZE / 4;
+    return 0;
+}
+
+void dma_start(struct dma_channel *chan, uint32_t cb_bus)
+{
+    if (!chan->simulated) {
+        periph_wr(chan->regs, DMA_CS, DMA_CS_RESET);
+        periph_wait(chan->regs, DMA_CS, DMA_CS_RESET | DMA_CS_ACTIVE, 0, PERIPH_SETTLE_NS);
+        periph_wr(chan->regs, DMA_CS, DMA_CS_INT | DMA_CS_END);
+        periph_wr(chan->regs, DMA_DEBUG, 7);   /* clear error flags */
+    }
+    else {
+        /* Makes dma_sim_run() load cb_bus as if it followed a chain */
+        periph_wr(chan->regs, DMA_TXFR_LEN, 0);
+        periph_wr(chan->regs, DMA_NEXTCONBK, cb_bus);
+    }
+    periph_wr(chan->regs, DMA_CONBLK_AD, cb_bus);
+    periph_wr(chan->regs, DMA_CS, DMA_CS_WAIT_WRITES | DMA_CS_PRIORITY(8) |
+            DMA_CS_PANIC_PRIORITY(8) | DMA_CS_ACTIVE);
+}
+
+void dma_stop(struct dma_channel *chan)
+{
+    if (!chan->simulated) {
+        periph_wr(chan->regs, DMA_CS, DMA_CS_RESET);
+        periph_wait(chan->regs, DMA_CS, DMA_CS_RESET | DMA_CS_ACTIVE, 0, PERIPH_SETTLE_NS);
+        return;
+    }
+    periph_wr(chan->regs, DMA_CS, 0);
+    periph_wr(chan->regs, DMA_CONBLK_AD, DMA_CB_END);
+}
+
+uint32_t dma_current_cb(struct dma_channel *chan)
+{
+    return periph_rd(chan->regs, DMA_CONBLK_AD);
+}
+
+void dma_sim_sink(uint32_t addr, void (*fn)(void *arg, uint32_t word), void *arg)
+{
+    int i;
+    for (i = 0; i < MAX_SIM_SINKS; i++) {
+        if (!sim_sinks[i].fn || sim_sinks[i].addr == addr) {
+            sim_sinks[i].addr = addr;
+            sim_sinks[i].fn = fn;
+            sim_sinks[i].arg = arg;
+            return;
+        }
+    }
+    fprintf(stderr, "too many simulated DMA sinks\n");
+    exit(-1);
+}
+
+// translate a bus address to memory the simulator can touch
+static volatile uint32_t *sim_addr(uint32_t bus)
+{
+    int i;
+
+    if (bus >= PERIPH_BUS_BASE && bus < PERIPH_BUS_BASE + PERIPH_WINDOW_SIZE) {
+        uint32_t offset = bus - PERIPH_BUS_BASE;
+        return periph_map(offset & ~(PERIPH_BLOCK_SIZE - 1)) +
+            (offset & (PERIPH_BLOCK_SIZE - 1)) / 4;
+    }
+
+    for (i = 0; i < MAX_SIM_ALLOCS; i++)
+        if (sim_allocs[i].virt && bus >= sim_allocs[i].bus &&
+                bus < sim_allocs[i].bus + sim_allocs[i].size)
+            return (volatile uint32_t *)((char *)sim_allocs[i].virt +
+                    (bus - sim_allocs[i].bus));
+
+    fprintf(stderr, "simulated DMA: bad bus address 0x%08x\n", bus);
+    exit(-1);
+}
+
+static void sim_write(uint32_t bus, uint32_t word)
+{
+    int i;
+    for (i = 0; i < MAX_SIM_SINKS && sim_sinks[i].fn; i++) {
+        if (sim_sinks[i].addr == bus) {
+            sim_sinks[i].fn(sim_sinks[i].arg, word);
+            return;
+        }
+    }
+    *sim_addr(bus) = word;
+}
+
+// load the control block at CONBLK_AD into the channel registers
+static void sim_load_cb(volatile uint32_t *regs)
+{
+    volatile uint32_t *cb = sim_addr(regs[DMA_CONBLK_AD]);
+
+    regs[DMA_TI] = cb[0];
+    regs[DMA_SOURCE_AD] = cb[1];
+    regs[DMA_DEST_AD] = cb[2];
+    regs[DMA_TXFR_LEN] = cb[3];
+    regs[DMA_STRIDE] = cb[4];
+    regs[DMA_NEXTCONBK] = cb[5];
+}
+
+unsigned int dma_sim_run(struct dma_channel *chan, unsigned int beats)
+{
+    volatile uint32_t *regs = chan->regs;
+    unsigned int moved = 0, unpaced = 0;
+
+    if (!chan->simulated || !(regs[DMA_CS] & DMA_CS_ACTIVE))
+        return 0;
+
+    while (moved < beats) {
+        uint32_t ti;
+        int paced;
+
+        /* Current block finished: follow the chain */
+        if (!regs[DMA_TXFR_LEN]) {
+            regs[DMA_CONBLK_AD] = regs[DMA_NEXTCONBK];
+            if (regs[DMA_CONBLK_AD] == DMA_CB_END) {
+                regs[DMA_CS] = (regs[DMA_CS] & ~DMA_CS_ACTIVE) | DMA_CS_END;
+                break;
+            }
+            sim_load_cb(regs);
+            if (++unpaced > SIM_MAX_UNPACED) {
+                fprintf(stderr, "simulated DMA: chain never waits for a DREQ\n");
+                regs[DMA_CS] |= DMA_CS_ERROR;
+                break;
+            }
+            continue;
+        }
+
+        ti = regs[DMA_TI];
+        paced = ti & (DMA_TI_DEST_DREQ | DMA_TI_SRC_DREQ);
+
+        sim_write(regs[DMA_DEST_AD], *sim_addr(regs[DMA_SOURCE_AD]));
+        if (ti & DMA_TI_SRC_INC)
+            regs[DMA_SOURCE_AD] += 4;
+        if (ti & DMA_TI_DEST_INC)
+            regs[DMA_DEST_AD] += 4;
+        regs[DMA_TXFR_LEN] = regs[DMA_TXFR_LEN] < 4 ? 0 : regs[DMA_TXFR_LEN] - 4;
+
+        if (paced) {
+            moved++;
+            unpaced = 0;
+        }
+    }
+
+    chan->sim_beats += moved;
+    return moved;
+}
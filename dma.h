@@ -0,0 +1,113 @@
+// BCM2835 DMA engine: control blocks, bus-addressable memory, channels
+//
+// With the /dev/mem backend, buffers come from the VideoCore mailbox
+// (/dev/vcio) so the DMA engine can reach them, and channels are the real
+// DMA registers.  With any other backend (RPI_PERIPH=anon or file:...) the
+// engine is simulated: buffers are ordinary memory with made-up bus
+// addresses, and dma_sim_run() walks the control-block chain, moving data
+// between those buffers and the stand-in peripheral registers.  DREQ-paced
+// control blocks advance one word per "beat", so a test can run exactly as
+// many peripheral requests as it wants to check.
+
+#ifndef DMA_H
+#define DMA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Channel registers, as word indexes from the channel base */
+#define DMA_CS		0
+#define DMA_CONBLK_AD	1
+#define DMA_TI		2
+#define DMA_SOURCE_AD	3
+#define DMA_DEST_AD	4
+#define DMA_TXFR_LEN	5
+#define DMA_STRIDE	6
+#define DMA_NEXTCONBK	7
+#define DMA_DEBUG	8
+
+#define DMA_CHANNEL_SIZE	0x100
+
+/* CS bits */
+#define DMA_CS_ACTIVE		(1 << 0)
+#define DMA_CS_END		(1 << 1)
+#define DMA_CS_INT		(1 << 2)
+#define DMA_CS_ERROR		(1 << 8)
+#define DMA_CS_PRIORITY(x)	((x) << 16)
+#define DMA_CS_PANIC_PRIORITY(x) ((x) << 20)
+#define DMA_CS_WAIT_WRITES	(1 << 28)
+#define DMA_CS_ABORT		(1 << 30)
+#define DMA_CS_RESET		(1U << 31)
+
+/* TI bits */
+#define DMA_TI_INTEN		(1 << 0)
+#define DMA_TI_WAIT_RESP	(1 << 3)
+#define DMA_TI_DEST_INC		(1 << 4)
+#define DMA_TI_DEST_DREQ	(1 << 6)
+#define DMA_TI_SRC_INC		(1 << 8)
+#define DMA_TI_SRC_DREQ		(1 << 10)
+#define DMA_TI_PERMAP(x)	((x) << 16)
+#define DMA_TI_NO_WIDE_BURSTS	(1 << 26)
+
+/* Peripheral DREQ numbers for PERMAP */
+#define DMA_DREQ_PWM		5
+
+/* End of a control-block chain */
+#define DMA_CB_END		0
+
+struct dma_cb {
+    uint32_t ti;
+    uint32_t source_ad;
+    uint32_t dest_ad;
+    uint32_t txfr_len;
+    uint32_t stride;
+    uint32_t nextconbk;
+    uint32_t pad[2];
+} __attribute__((aligned(32)));
+
+/* A buffer the DMA engine can reach */
+struct dma_mem {
+    void *virt;
+    uint32_t bus;
+    size_t size;
+    uint32_t handle;            /* mailbox handle, 0 when simulated */
+};
+
+struct dma_channel {
+    int num;
+    volatile uint32_t *regs;
+    int simulated;
+    uint64_t sim_beats;         /* DREQ-paced words moved so far */
+};
+
+// Nonzero when the DMA engine is simulated
+int dma_simulated(void);
+
+// Allocate zeroed memory the DMA engine can read and write.  0 on success.
+int dma_mem_alloc(struct dma_mem *mem, size_t size);
+void dma_mem_free(struct dma_mem *mem);
+
+static inline uint32_t dma_bus_addr(const struct dma_mem *mem, const void *ptr)
+{
+    return mem->bus + (uint32_t)((const char *)ptr - (const char *)mem->virt);
+}
+
+int dma_channel_open(struct dma_channel *chan, int num);
+
+// Reset the channel and start it on the control block at cb_bus
+void dma_start(struct dma_channel *chan, uint32_t cb_bus);
+void dma_stop(struct dma_channel *chan);
+
+// Bus address of the control block being worked on, DMA_CB_END when idle
+uint32_t dma_current_cb(struct dma_channel *chan);
+
+// Simulated engine only: let the channel run until it has moved beats
+// DREQ-paced words or reached the end of its chain.  Unpaced control blocks
+// complete immediately.  Returns the number of paced words moved.
+unsigned int dma_sim_run(struct dma_channel *chan, unsigned int beats);
+
+// Simulated engine only: call fn for every word written to bus address addr
+// (for example PWM FIF), instead of just storing it.
+void dma_sim_sink(uint32_t addr, void (*fn)(void *arg, uint32_t word), void *arg);
+
+#endif /* DMA_H */
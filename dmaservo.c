@@ -0,0 +1,203 @@
+// DMA-to-GPIO servo pulse generator, see dmaservo.h
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include "periph.h"
+#include "reglock.h"
+#include "dma.h"
+#include "dmaservo.h"
+#include "clkman.h"
+
+#define	PWM_CTL  0
+#define	PWM_STA  1
+#define	PWM_DMAC 2
+#define	PWM_RNG1 4
+#define	PWM_FIF  6
+
+#define GPIO_SET0 7
+#define GPIO_CLR0 10
+
+// PLLD (500 MHz) / 50 = 10 MHz PWM clock, so RNG1 = 10 cycles per microsecond
+#define PWM_CLOCK_DIV	50
+#define PWM_CLOCK_MHZ	10
+
+#define TI_MEM	(DMA_TI_NO_WIDE_BURSTS | DMA_TI_WAIT_RESP)
+#define TI_PWM	(DMA_TI_NO_WIDE_BURSTS | DMA_TI_WAIT_RESP | DMA_TI_DEST_DREQ | \
+        DMA_TI_PERMAP(DMA_DREQ_PWM))
+
+static void init_pwm(unsigned int tick_us)
+{
+    volatile uint32_t *pwm = periph_map(PWM_OFFSET);
+    struct clk_request clock = {
+        .clock = CLK_PWM,
+        .setting = { .src = CLK_SRC_PLLD, .divi = PWM_CLOCK_DIV },
+        .enable = 1,
+    };
+
+    // disable PWM and wait for STA1/STA2 to show both channels stopped
+    periph_wr(pwm, PWM_CTL, 0);
+    periph_wait(pwm, PWM_STA, 3 << 9, 0, PERIPH_SETTLE_NS);
+
+    if (clk_set(&clock, 1))
+        perror("Unable to set the PWM clock");
+
+    // one FIFO word per tick
+    periph_wr(pwm, PWM_RNG1, tick_us * PWM_CLOCK_MHZ);
+    periph_wr(pwm, PWM_CTL, 1 << 6);   /* clear FIFO, takes effect at once */
+    periph_wr(pwm, PWM_DMAC, (1U << 31) | (15 << 8) | 15);
+
+    // channel 1 in serializer mode from the FIFO; the output pin isn't used
+    periph_wr(pwm, PWM_CTL, (1 << 5) | 3);
+}
+
+int dmaservo_init(struct dmaservo *ds, int channel, unsigned int tick_us, uint32_t pins)
+{
+    size_t cb_bytes, mask_bytes;
+    unsigned int tick;
+    int pin;
+
+    if (!tick_us || DMASERVO_FRAME_US % tick_us) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(ds, 0, sizeof(*ds));
+    ds->tick_us = tick_us;
+    ds->nticks = DMASERVO_FRAME_US / tick_us;
+    ds->pins = pins;
+
+    cb_bytes = 2 * ds->nticks * sizeof(struct dma_cb);
+    mask_bytes = (ds->nticks + 1) * sizeof(uint32_t);
+    if (dma_mem_alloc(&ds->mem, cb_bytes + mask_bytes))
+        return -1;
+    if (dma_channel_open(&ds->chan, channel)) {
+        dma_mem_free(&ds->mem);
+        return -1;
+    }
+    ds->cbs = ds->mem.virt;
+    ds->masks = (volatile uint32_t *)((char *)ds->mem.virt + cb_bytes);
+    /* masks[nticks] is the dummy word fed to the FIFO */
+
+    /* The last tick clears every pin, so none can stay high into the next
+       frame whatever happens to the other clear words */
+    ds->masks[ds->nticks - 1] = pins;
+
+    for (tick = 0; tick < ds->nticks; tick++) {
+        struct dma_cb *gpio_cb = &ds->cbs[2 * tick];
+        struct dma_cb *pace_cb = &ds->cbs[2 * tick + 1];
+
+        gpio_cb->ti = TI_MEM;
+        gpio_cb->source_ad = dma_bus_addr(&ds->mem, (void *)&ds->masks[tick]);
+        gpio_cb->dest_ad = PERIPH_BUS_ADDR(GPIO_OFFSET, tick ? GPIO_CLR0 : GPIO_SET0);
+        gpio_cb->txfr_len = sizeof(uint32_t);
+        gpio_cb->nextconbk = dma_bus_addr(&ds->mem, pace_cb);
+
+        pace_cb->ti = TI_PWM;
+        pace_cb->source_ad = dma_bus_addr(&ds->mem, (void *)&ds->masks[ds->nticks]);
+        pace_cb->dest_ad = PERIPH_BUS_ADDR(PWM_OFFSET, PWM_FIF);
+        pace_cb->txfr_len = sizeof(uint32_t);
+        pace_cb->nextconbk = dma_bus_addr(&ds->mem,
+                &ds->cbs[2 * ((tick + 1) % ds->nticks)]);
+    }
+
+    /* All pins low outputs */
+    ds->gpio = periph_map(GPIO_OFFSET);
+    periph_wr(ds->gpio, GPIO_CLR0, pins);
+    for (pin = 0; pin < DMASERVO_MAX_PINS; pin++) {
+        if (!(pins & (1U << pin)))
+            continue;
+        if (reglock_rmw(ds->gpio, pin / 10, 7 << ((pin % 10) * 3), 1 << ((pin % 10) * 3))) {
+            dma_mem_free(&ds->mem);
+            return -1;
+        }
+    }
+
+    init_pwm(tick_us);
+    dma_start(&ds->chan, dma_bus_addr(&ds->mem, &ds->cbs[0]));
+    return 0;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// tick the engine is on, from the control block it is working on
+static unsigned int engine_tick(struct dmaservo *ds)
+{
+    uint32_t cb = dma_current_cb(&ds->chan);
+    uint32_t first = dma_bus_addr(&ds->mem, ds->cbs);
+
+    if (cb < first || cb >= first + 2 * ds->nticks * sizeof(struct dma_cb))
+        return ds->nticks;
+    return (cb - first) / sizeof(struct dma_cb) / 2;
+}
+
+// wait, at most a frame, until the engine isn't between ticks from and to:
+// a pulse it already let run past from must still end at to
+static void wait_outside(struct dmaservo *ds, unsigned int from, unsigned int to)
+{
+    uint64_t start = now_ns();
+    unsigned int tick;
+
+    /* the simulated engine only moves when it is told to */
+    if (ds->chan.simulated)
+        return;
+    do {
+        tick = engine_tick(ds);
+        if (tick < from || tick > to)
+            return;
+    } while (now_ns() - start < DMASERVO_FRAME_US * 1000ULL);
+}
+
+int dmaservo_set_us(struct dmaservo *ds, int pin, unsigned int us)
+{
+    unsigned int ticks = (us + ds->tick_us / 2) / ds->tick_us;
+    unsigned int old;
+    uint32_t bit;
+
+    if (pin < 0 || pin >= DMASERVO_MAX_PINS || !(ds->pins & (1U << pin)) ||
+            ticks >= ds->nticks) {
+        errno = EINVAL;
+        return -1;
+    }
+    bit = 1U << pin;
+    old = ds->width[pin];
+    if (ticks == old)
+        return 0;
+
+    /* Add the new end of pulse before removing the old one.  A shorter
+       pulse (or none) keeps its old end until the engine isn't between the
+       two, or a pulse it already let past the new end would miss both; the
+       last tick clears it if the engine can't be seen to move. */
+    if (ticks) {
+        ds->masks[ticks] |= bit;
+        if (!old)
+            ds->masks[0] |= bit;
+    }
+    else
+        ds->masks[0] &= ~bit;
+    if (old && old != ds->nticks - 1) {
+        if (ticks < old)
+            wait_outside(ds, ticks, old);
+        ds->masks[old] &= ~bit;
+    }
+
+    ds->width[pin] = ticks;
+    return 0;
+}
+
+void dmaservo_stop(struct dmaservo *ds)
+{
+    dma_stop(&ds->chan);
+    periph_wr(ds->gpio, GPIO_CLR0, ds->pins);
+    dma_mem_free(&ds->mem);
+}
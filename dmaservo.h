@@ -0,0 +1,44 @@
+// DMA-to-GPIO servo pulse generator
+//
+// One DMA channel replays a cyclic list of control blocks covering a 20 ms
+// frame in fixed ticks.  Every tick has two blocks: the first writes that
+// tick's mask to GPCLR0 (tick 0 writes the mask of all active pins to
+// GPSET0), the second writes a dummy word to the PWM FIFO, which only
+// accepts it when the PWM asks for data, so the PWM clock paces the list.
+// A pin's pulse therefore starts at tick 0 and ends at the tick whose clear
+// mask has its bit, and moving a servo patches at most three mask words.
+// The last tick's clear mask has every pin, so no pulse outlives a frame.
+// Only GPIO0-31 (bank 0) can be driven.
+
+#ifndef DMASERVO_H
+#define DMASERVO_H
+
+#include <stdint.h>
+
+#include "dma.h"
+
+#define DMASERVO_FRAME_US	20000
+#define DMASERVO_MAX_PINS	32
+
+struct dmaservo {
+    unsigned int tick_us;
+    unsigned int nticks;
+    uint32_t pins;                  /* pins that may be driven */
+    uint16_t width[DMASERVO_MAX_PINS];  /* pulse width in ticks, 0 = off */
+
+    struct dma_mem mem;
+    struct dma_channel chan;
+    volatile uint32_t *masks;       /* [0] = set mask, [n] = clear mask of tick n */
+    struct dma_cb *cbs;
+    volatile uint32_t *gpio;
+};
+
+// Configure pins as outputs, build the control-block list and start it
+int dmaservo_init(struct dmaservo *ds, int channel, unsigned int tick_us, uint32_t pins);
+
+// Set a pin's pulse width in microseconds (0 turns the pulse off)
+int dmaservo_set_us(struct dmaservo *ds, int pin, unsigned int us);
+
+void dmaservo_stop(struct dmaservo *ds);
+
+#endif /* DMASERVO_H */
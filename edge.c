@@ -0,0 +1,162 @@
+// GPIO edge detection, see edge.h
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#include "periph.h"
+#include "reglock.h"
+#include "edge.h"
+
+#define GPIO_LEV0  13
+#define GPIO_EDS0  16
+#define GPIO_REN0  19
+#define GPIO_FEN0  22
+#define GPIO_AREN0 31
+#define GPIO_AFEN0 34
+
+static const struct {
+    unsigned int edge;
+    int reg;
+} detectors[] = {
+    { EDGE_RISING,        GPIO_REN0 },
+    { EDGE_FALLING,       GPIO_FEN0 },
+    { EDGE_ASYNC_RISING,  GPIO_AREN0 },
+    { EDGE_ASYNC_FALLING, GPIO_AFEN0 },
+};
+
+#define NUM_DETECTORS (sizeof(detectors) / sizeof(*detectors))
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int edge_init(struct edge_detector *ed, uint32_t queue_size)
+{
+    if (!queue_size || (queue_size & (queue_size - 1))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(ed, 0, sizeof(*ed));
+    ed->gpio = periph_map(GPIO_OFFSET);
+    ed->simulated = periph_backend() != PERIPH_DEVMEM &&
+        periph_backend() != PERIPH_GPIOMEM;
+
+    ed->queue = malloc(ring_bytes(queue_size, sizeof(struct edge_event)));
+    if (!ed->queue)
+        return -1;
+    ring_init(ed->queue, queue_size, sizeof(struct edge_event));
+    /* Fault the queue in now rather than while polling */
+    memset(ed->queue->slots, 0, (size_t)queue_size * sizeof(struct edge_event));
+    return 0;
+}
+
+int edge_enable(struct edge_detector *ed, int pin, unsigned int edges)
+{
+    uint32_t bit;
+    int word;
+    unsigned int i;
+
+    if (pin < 0 || pin >= EDGE_PINS) {
+        errno = EINVAL;
+        return -1;
+    }
+    word = pin / 32;
+    bit = 1U << (pin % 32);
+
+    /* Other processes may be setting up pins in the same registers */
+    for (i = 0; i < NUM_DETECTORS; i++)
+        if (reglock_rmw(ed->gpio, detectors[i].reg + word, bit,
+                    edges & detectors[i].edge ? bit : 0))
+            return -1;
+
+    if (edges)
+        ed->mask[word] |= bit;
+    else
+        ed->mask[word] &= ~bit;
+
+    /* Drop anything latched before we started listening */
+    if (ed->simulated)
+        __atomic_fetch_and((uint32_t *)&ed->gpio[GPIO_EDS0 + word], ~bit, __ATOMIC_RELAXED);
+    else
+        periph_wr(ed->gpio, GPIO_EDS0 + word, bit);
+    return 0;
+}
+
+void edge_close(struct edge_detector *ed)
+{
+    int pin;
+
+    for (pin = 0; pin < EDGE_PINS; pin++)
+        if (ed->mask[pin / 32] & (1U << (pin % 32)))
+            edge_enable(ed, pin, 0);
+    free(ed->queue);
+    ed->queue = NULL;
+}
+
+// clear the flags we're about to report: write 1s on hardware, atomically
+// AND them out of the plain memory of a simulated block
+static inline void clear_flags(struct edge_detector *ed, int word, uint32_t bits)
+{
+    if (ed->simulated)
+        __atomic_fetch_and((uint32_t *)&ed->gpio[GPIO_EDS0 + word], ~bits, __ATOMIC_RELAXED);
+    else
+        periph_wr(ed->gpio, GPIO_EDS0 + word, bits);
+}
+
+int edge_poll(struct edge_detector *ed)
+{
+    struct edge_event *ev;
+    uint32_t eds0, eds1 = 0;
+    uint64_t t;
+
+    ed->polls++;
+    eds0 = periph_rd(ed->gpio, GPIO_EDS0) & ed->mask[0];
+    if (ed->mask[1])
+        eds1 = periph_rd(ed->gpio, GPIO_EDS0 + 1) & ed->mask[1];
+    if (__builtin_expect(!eds0 && !eds1, 1))
+        return 0;
+
+    t = now_ns();
+    if (eds0)
+        clear_flags(ed, 0, eds0);
+    if (eds1)
+        clear_flags(ed, 1, eds1);
+
+    ev = ring_reserve(ed->queue);
+    if (!ev) {
+        ed->dropped++;
+        return 0;
+    }
+    ev->t_ns = t;
+    ev->pins[0] = eds0;
+    ev->pins[1] = eds1;
+    ev->lev[0] = periph_rd(ed->gpio, GPIO_LEV0);
+    ev->lev[1] = ed->mask[1] ? periph_rd(ed->gpio, GPIO_LEV0 + 1) : 0;
+    ring_commit(ed->queue);
+
+    ed->events++;
+    ed->pins_fired += __builtin_popcount(eds0) + __builtin_popcount(eds1);
+    ed->busy_ns += now_ns() - t;
+    return __builtin_popcount(eds0) + __builtin_popcount(eds1);
+}
+
+void edge_sim_fire(struct edge_detector *ed, int pin, int level)
+{
+    uint32_t bit = 1U << (pin % 32);
+    int word = pin / 32;
+
+    if (!ed->simulated)
+        return;
+    if (level)
+        __atomic_fetch_or((uint32_t *)&ed->gpio[GPIO_LEV0 + word], bit, __ATOMIC_RELAXED);
+    else
+        __atomic_fetch_and((uint32_t *)&ed->gpio[GPIO_LEV0 + word], ~bit, __ATOMIC_RELAXED);
+    __atomic_fetch_or((uint32_t *)&ed->gpio[GPIO_EDS0 + word], bit, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,80 @@
+// GPIO edge detection
+//
+// Enables the BCM2835's edge detectors (GPREN/GPFEN, or the asynchronous
+// GPAREN/GPAFEN that also catch pulses shorter than a clock cycle) on
+// selected pins, so a pulse is latched in GPEDS however short it is.  A
+// poll reads both GPEDS words, clears every flagged bit with one write per
+// word and queues a single timestamped event holding all of them (plus
+// GPLEV, to tell rising from falling), so a burst costs one queue slot.
+// Events go through a ring.h SPSC queue to a consumer thread.
+//
+// GPEDS is write-1-to-clear.  The stand-in register of a simulated backend
+// is plain memory, so there the poll clears with an atomic AND instead and
+// a simulated pin can raise its flag with edge_sim_fire().
+
+#ifndef EDGE_H
+#define EDGE_H
+
+#include <stdint.h>
+
+#include "ring.h"
+
+#define EDGE_RISING		(1 << 0)
+#define EDGE_FALLING		(1 << 1)
+#define EDGE_ASYNC_RISING	(1 << 2)
+#define EDGE_ASYNC_FALLING	(1 << 3)
+
+#define EDGE_PINS 54
+
+struct edge_event {
+    uint64_t t_ns;              /* CLOCK_MONOTONIC when the poll saw it */
+    uint32_t pins[2];           /* GPEDS0/1 bits that were set */
+    uint32_t lev[2];            /* GPLEV0/1 right after */
+};
+
+struct edge_detector {
+    volatile uint32_t *gpio;
+    uint32_t mask[2];           /* pins with any detector enabled */
+    int simulated;
+    struct ring *queue;
+
+    /* poller's counters */
+    uint64_t polls;
+    uint64_t events;            /* queued events */
+    uint64_t pins_fired;        /* pin edges in those events */
+    uint64_t dropped;           /* events lost to a full queue */
+    uint64_t busy_ns;           /* spent in polls that found something */
+};
+
+// Map GPIO and allocate a queue of queue_size (a power of two) events
+int edge_init(struct edge_detector *ed, uint32_t queue_size);
+
+// Enable the EDGE_* detectors in edges on pin, disable the others
+int edge_enable(struct edge_detector *ed, int pin, unsigned int edges);
+
+// Disable every detector edge_enable() turned on and free the queue
+void edge_close(struct edge_detector *ed);
+
+// Poll GPEDS once.  Returns the number of pins that fired.
+int edge_poll(struct edge_detector *ed);
+
+// Simulated backend only: latch an edge on pin as the hardware would
+void edge_sim_fire(struct edge_detector *ed, int pin, int level);
+
+// Call fn for every pin in an event
+static inline void edge_for_each(const struct edge_event *ev,
+        void (*fn)(void *arg, const struct edge_event *ev, int pin, int level), void *arg)
+{
+    int word;
+
+    for (word = 0; word < 2; word++) {
+        uint32_t pins = ev->pins[word];
+        while (pins) {
+            int bit = __builtin_ctz(pins);
+            pins &= pins - 1;
+            fn(arg, ev, word * 32 + bit, (ev->lev[word] >> bit) & 1);
+        }
+    }
+}
+
+#endif /* EDGE_H */
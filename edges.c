@@ -0,0 +1,347 @@
+// GPIO edge event monitor
+//
+// Enables edge detection on the selected pins (see edge.h), polls GPEDS
+// from one thread and handles the events in another, then reports the
+// event-to-handler latency and the poller's cost per event and per empty
+// poll.  With a simulated backend (RPI_PERIPH=anon) "-s rate" starts a
+// thread that fires edges on the pins at that rate, and the latency from
+// the edge itself to the handler is reported too.
+//
+// compile with "gcc -O2 edges.c edge.c periph.c reglock.c -o edges -lpthread -lrt",
+// test with "./edges -g 17 -e rf -v" (needs to be root for /dev/mem access)
+// or "RPI_PERIPH=anon ./edges -g 4,17 -s 10000 -p 1 -P 2"
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <unistd.h>
+
+#include "periph.h"
+#include "edge.h"
+
+#define QUEUE_SIZE 4096
+
+/* Check the clock for the end of the run every this many polls */
+#define CHECK_INTERVAL 1024
+
+/* Latency histogram: 50 ns buckets up to 200 us, the last one open */
+#define LAT_BUCKET_NS 50
+#define LAT_BUCKETS 4000
+
+struct latency {
+    uint64_t count, sum_ns, max_ns;
+    uint32_t hist[LAT_BUCKETS];
+};
+
+struct monitor {
+    struct edge_detector ed;
+    int pins[EDGE_PINS], npins;
+    int verbose;
+    int consumer_cpu;
+    volatile int done;
+
+    /* simulation */
+    double sim_rate;
+    volatile uint64_t sim_fired, sim_inject_ns;
+
+    /* consumer's results */
+    volatile uint64_t handled;  /* pin edges */
+    struct latency poll_lat;    /* poll to handler */
+    struct latency edge_lat;    /* simulated edge to handler */
+};
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void pin_cpu(int cpu, const char *what)
+{
+    cpu_set_t set;
+
+    if (cpu < 0)
+        return;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set))
+        fprintf(stderr, "Unable to pin %s: %s\n", what, strerror(errno));
+}
+
+static void latency_add(struct latency *l, uint64_t ns)
+{
+    uint64_t bucket = ns / LAT_BUCKET_NS;
+
+    l->hist[bucket < LAT_BUCKETS ? bucket : LAT_BUCKETS - 1]++;
+    l->sum_ns += ns;
+    if (ns > l->max_ns)
+        l->max_ns = ns;
+    l->count++;
+}
+
+static uint64_t latency_percentile(const struct latency *l, double p)
+{
+    uint64_t want = (uint64_t)(l->count * p), seen = 0;
+    int i;
+
+    for (i = 0; i < LAT_BUCKETS; i++) {
+        seen += l->hist[i];
+        if (seen > want)
+            return i < LAT_BUCKETS - 1 ? (uint64_t)(i + 1) * LAT_BUCKET_NS : l->max_ns;
+    }
+    return l->max_ns;
+}
+
+static void latency_print(const char *what, const struct latency *l)
+{
+    if (!l->count)
+        return;
+    printf("%s: mean %.0f ns, median %llu ns, p99 %llu ns, max %llu ns\n", what,
+            (double)l->sum_ns / l->count,
+            (unsigned long long)latency_percentile(l, 0.5),
+            (unsigned long long)latency_percentile(l, 0.99),
+            (unsigned long long)l->max_ns);
+}
+
+static void handle_pin(void *arg, const struct edge_event *ev, int pin, int level)
+{
+    struct monitor *m = arg;
+
+    if (m->verbose)
+        printf("%llu.%09llu GPIO%d %s\n",
+                (unsigned long long)(ev->t_ns / 1000000000ULL),
+                (unsigned long long)(ev->t_ns % 1000000000ULL),
+                pin, level ? "rising" : "falling");
+    m->handled++;
+}
+
+static void *consumer_thread(void *arg)
+{
+    struct monitor *m = arg;
+    const struct edge_event *ev;
+    unsigned int idle = 0;
+    uint64_t t;
+
+    pin_cpu(m->consumer_cpu, "consumer");
+    for (;;) {
+        if ((ev = ring_peek(m->ed.queue)) == NULL) {
+            if (m->done && !ring_count(m->ed.queue))
+                break;
+            /* Spin for latency, but let the poller run if we share a CPU */
+            if (++idle % 1024 == 0)
+                sched_yield();
+            continue;
+        }
+        t = now_ns();
+        latency_add(&m->poll_lat, t - ev->t_ns);
+        if (m->sim_rate > 0)
+            latency_add(&m->edge_lat, t - m->sim_inject_ns);
+        edge_for_each(ev, handle_pin, m);
+        ring_release(m->ed.queue);
+    }
+    return NULL;
+}
+
+// simulation: fire one edge at a time, at sim_rate per second
+static void *sim_thread(void *arg)
+{
+    struct monitor *m = arg;
+    uint64_t period = (uint64_t)(1e9 / m->sim_rate);
+    struct timespec next;
+    uint64_t n;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (n = 0; !m->done; n++) {
+        int pin = m->pins[n % m->npins];
+
+        m->sim_inject_ns = now_ns();
+        edge_sim_fire(&m->ed, pin, (n / m->npins) & 1);
+        m->sim_fired++;
+
+        /* One edge in flight, so each latency is measured on its own */
+        while (m->handled < m->sim_fired && !m->done)
+            sched_yield();
+
+        next.tv_nsec += period;
+        while (next.tv_nsec >= 1000000000) {
+            next.tv_nsec -= 1000000000;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+    return NULL;
+}
+
+static unsigned int parse_edges(const char *arg)
+{
+    unsigned int edges = 0;
+
+    for (; *arg; arg++) {
+        switch (*arg) {
+        case 'r': edges |= EDGE_RISING; break;
+        case 'f': edges |= EDGE_FALLING; break;
+        case 'R': edges |= EDGE_ASYNC_RISING; break;
+        case 'F': edges |= EDGE_ASYNC_FALLING; break;
+        default:
+            return 0;
+        }
+    }
+    return edges;
+}
+
+// parse "4,17,22-25"
+static int parse_pins(struct monitor *m, const char *arg)
+{
+    const char *p = arg;
+    char *end;
+
+    while (*p) {
+        int first = strtol(p, &end, 0), last = first, pin;
+        if (end == p)
+            return -1;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 0);
+            if (end == p)
+                return -1;
+        }
+        if (first < 0 || last >= EDGE_PINS || first > last)
+            return -1;
+        for (pin = first; pin <= last && m->npins < EDGE_PINS; pin++)
+            m->pins[m->npins++] = pin;
+        p = end;
+        if (*p == ',')
+            p++;
+        else if (*p)
+            return -1;
+    }
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s -g pins [-e rfRF] [-t seconds] [-p cpu] [-P cpu] [-s rate] [-v]\n", prog);
+    printf("\t-g  pins to watch, like 4,17,22-25\n");
+    printf("\t-e  edges: r/f rising/falling, R/F asynchronous (default rf)\n");
+    printf("\t-t  stop after this many seconds (default 1)\n");
+    printf("\t-p  pin the poller to this CPU\n");
+    printf("\t-P  pin the event handler to this CPU\n");
+    printf("\t-s  simulated backend: fire this many edges per second\n");
+    printf("\t-v  print every event\n");
+}
+
+int main(int argc, char **argv)
+{
+    static struct monitor m;
+    pthread_t consumer, sim;
+    unsigned int edges = EDGE_RISING | EDGE_FALLING;
+    double seconds = 1.0;
+    uint64_t start, end, elapsed, empty;
+    int cpu = -1;
+    int ch, i;
+
+    m.consumer_cpu = -1;
+    while ((ch = getopt(argc, argv, "g:e:t:p:P:s:v")) != -1) {
+        switch (ch) {
+        case 'g':
+            if (parse_pins(&m, optarg)) {
+                fprintf(stderr, "Bad pin list \"%s\"\n", optarg);
+                return 1;
+            }
+            break;
+
+        case 'e':
+            if (!(edges = parse_edges(optarg))) {
+                fprintf(stderr, "Bad edge list \"%s\"\n", optarg);
+                return 1;
+            }
+            break;
+
+        case 't':
+            seconds = strtod(optarg, NULL);
+            break;
+
+        case 'p':
+            cpu = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'P':
+            m.consumer_cpu = strtoul(optarg, NULL, 0);
+            break;
+
+        case 's':
+            m.sim_rate = strtod(optarg, NULL);
+            break;
+
+        case 'v':
+            m.verbose = 1;
+            break;
+
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!m.npins) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (edge_init(&m.ed, QUEUE_SIZE)) {
+        perror("Unable to set up edge detection");
+        return 1;
+    }
+    if (m.sim_rate > 0 && !m.ed.simulated) {
+        fprintf(stderr, "-s needs a simulated backend, like RPI_PERIPH=anon\n");
+        return 1;
+    }
+    for (i = 0; i < m.npins; i++)
+        if (edge_enable(&m.ed, m.pins[i], edges)) {
+            perror("Unable to enable edge detection");
+            return 1;
+        }
+    mlockall(MCL_CURRENT|MCL_FUTURE);
+
+    if (pthread_create(&consumer, NULL, consumer_thread, &m) ||
+            (m.sim_rate > 0 && pthread_create(&sim, NULL, sim_thread, &m))) {
+        perror("Unable to start threads");
+        return 1;
+    }
+
+    pin_cpu(cpu, "poller");
+    start = now_ns();
+    end = start + (uint64_t)(seconds * 1e9);
+    for (;;) {
+        edge_poll(&m.ed);
+        if (!(m.ed.polls % CHECK_INTERVAL) && now_ns() >= end)
+            break;
+    }
+    elapsed = now_ns() - start;
+
+    m.done = 1;
+    pthread_join(consumer, NULL);
+    if (m.sim_rate > 0)
+        pthread_join(sim, NULL);
+    edge_close(&m.ed);
+
+    empty = m.ed.polls - m.ed.events - m.ed.dropped;
+    printf("%llu polls in %.3f s, %llu events with %llu pin edges, %llu handled, %llu dropped\n",
+            (unsigned long long)m.ed.polls, elapsed / 1e9,
+            (unsigned long long)m.ed.events, (unsigned long long)m.ed.pins_fired,
+            (unsigned long long)m.handled, (unsigned long long)m.ed.dropped);
+    if (m.ed.events)
+        printf("poller cost: %.0f ns per event, %.1f ns per empty poll\n",
+                (double)m.ed.busy_ns / m.ed.events,
+                empty ? (double)(elapsed - m.ed.busy_ns) / empty : 0.0);
+    latency_print("poll to handler", &m.poll_lat);
+    latency_print("edge to handler", &m.edge_lat);
+    return 0;
+}
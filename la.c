@@ -0,0 +1,273 @@
+// GPIO logic analyzer
+//
+// Samples GPLEV0/GPLEV1 in a tight loop and stores only transitions: each
+// record holds the time since the previous one and the new levels, in a
+// buffer allocated and faulted in before the capture starts.  The loop
+// doesn't allocate or make system calls (the clock is read through the
+// vDSO, and only when a level changed or every few thousand samples to
+// check for the end), so it keeps up several million samples a second.
+// The capture is written as a VCD file for waveform viewers like GTKWave.
+//
+// compile with "gcc -O2 la.c periph.c -o la",
+// test with "./la -g 17,18 -t 1 -o capture.vcd" (needs to be root for /dev/mem access)
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include <unistd.h>
+
+#include "periph.h"
+
+#define GPIO_LEV0 13
+#define GPIO_LEV1 14
+
+#define NUM_PINS 54
+#define LEV1_MASK ((1U << (NUM_PINS - 32)) - 1)
+
+/* How many samples between checks of the clock for the end of capture */
+#define CHECK_INTERVAL 4096
+
+#define MAX_DELTA_NS UINT32_MAX
+
+struct transition {
+    uint32_t delta_ns;          /* since the previous record */
+    uint32_t lev[2];            /* masked GPLEV0, GPLEV1 */
+};
+
+struct capture {
+    uint32_t mask[2];
+    struct transition *buf;
+    uint32_t size, count;
+    uint32_t first[2];          /* levels at the start */
+    uint64_t start_ns;
+    uint64_t samples;
+    int full;
+};
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// the capture loop: no allocation, no system calls
+static void capture_loop(struct capture *c, volatile uint32_t *gpio, uint64_t end_ns)
+{
+    uint32_t m0 = c->mask[0], m1 = c->mask[1];
+    uint32_t l0, l1, p0, p1;
+    uint64_t last, t, samples = 0;
+    struct transition *rec = c->buf, *end = c->buf + c->size;
+
+    p0 = periph_rd(gpio, GPIO_LEV0) & m0;
+    p1 = m1 ? periph_rd(gpio, GPIO_LEV1) & m1 : 0;
+    c->first[0] = p0;
+    c->first[1] = p1;
+    last = c->start_ns = now_ns();
+
+    for (;;) {
+        l0 = periph_rd(gpio, GPIO_LEV0) & m0;
+        l1 = m1 ? periph_rd(gpio, GPIO_LEV1) & m1 : 0;
+        samples++;
+
+        if (__builtin_expect(l0 != p0 || l1 != p1, 0)) {
+            t = now_ns();
+            /* Pad long idle stretches with records that change nothing */
+            while (t - last > MAX_DELTA_NS && rec < end) {
+                rec->delta_ns = MAX_DELTA_NS;
+                rec->lev[0] = p0;
+                rec->lev[1] = p1;
+                last += MAX_DELTA_NS;
+                rec++;
+            }
+            if (rec == end) {
+                c->full = 1;
+                break;
+            }
+            rec->delta_ns = t - last;
+            rec->lev[0] = p0 = l0;
+            rec->lev[1] = p1 = l1;
+            last = t;
+            rec++;
+        }
+        else if (!(samples % CHECK_INTERVAL) && now_ns() >= end_ns)
+            break;
+    }
+
+    c->count = rec - c->buf;
+    c->samples = samples;
+}
+
+// VCD identifier for a pin: one printable character from '!'
+static char vcd_id(int pin)
+{
+    return '!' + pin;
+}
+
+static int write_vcd(const struct capture *c, FILE *f)
+{
+    uint32_t lev[2];
+    uint64_t t = 0;
+    uint32_t i;
+    int pin;
+
+    fprintf(f, "$comment rpi-tools la, GPLEV0/GPLEV1 transitions $end\n");
+    fprintf(f, "$timescale 1ns $end\n");
+    fprintf(f, "$scope module gpio $end\n");
+    for (pin = 0; pin < NUM_PINS; pin++)
+        if (c->mask[pin / 32] & (1U << (pin % 32)))
+            fprintf(f, "$var wire 1 %c gpio%d $end\n", vcd_id(pin), pin);
+    fprintf(f, "$upscope $end\n$enddefinitions $end\n");
+
+    fprintf(f, "#0\n$dumpvars\n");
+    for (pin = 0; pin < NUM_PINS; pin++)
+        if (c->mask[pin / 32] & (1U << (pin % 32)))
+            fprintf(f, "%d%c\n", !!(c->first[pin / 32] & (1U << (pin % 32))), vcd_id(pin));
+    fprintf(f, "$end\n");
+
+    lev[0] = c->first[0];
+    lev[1] = c->first[1];
+    for (i = 0; i < c->count; i++) {
+        const struct transition *rec = &c->buf[i];
+        uint32_t diff[2] = { rec->lev[0] ^ lev[0], rec->lev[1] ^ lev[1] };
+
+        t += rec->delta_ns;
+        if (!diff[0] && !diff[1])
+            continue;
+        fprintf(f, "#%llu\n", (unsigned long long)t);
+        for (pin = 0; pin < NUM_PINS; pin++)
+            if (diff[pin / 32] & (1U << (pin % 32)))
+                fprintf(f, "%d%c\n", !!(rec->lev[pin / 32] & (1U << (pin % 32))),
+                        vcd_id(pin));
+        lev[0] = rec->lev[0];
+        lev[1] = rec->lev[1];
+    }
+    return ferror(f) ? -1 : 0;
+}
+
+// parse "4,17,22-25" into the two masks
+static int parse_pins(const char *arg, uint32_t mask[2])
+{
+    const char *p = arg;
+    char *end;
+
+    mask[0] = mask[1] = 0;
+    while (*p) {
+        int first = strtol(p, &end, 0), last = first, pin;
+        if (end == p)
+            return -1;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 0);
+            if (end == p)
+                return -1;
+        }
+        if (first < 0 || last >= NUM_PINS || first > last)
+            return -1;
+        for (pin = first; pin <= last; pin++)
+            mask[pin / 32] |= 1U << (pin % 32);
+        p = end;
+        if (*p == ',')
+            p++;
+        else if (*p)
+            return -1;
+    }
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [-g pins] [-n transitions] [-t seconds] [-o file.vcd] [-p cpu]\n", prog);
+    printf("\t-g  pins to capture, like 4,17,22-25 (default all)\n");
+    printf("\t-n  transition buffer size (default 1M)\n");
+    printf("\t-t  stop after this many seconds (default 1)\n");
+    printf("\t-o  write the capture as VCD to this file (default stdout)\n");
+    printf("\t-p  pin the capture loop to this CPU\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct capture c;
+    volatile uint32_t *gpio;
+    const char *out = NULL;
+    double seconds = 1.0;
+    uint64_t elapsed;
+    int cpu = -1;
+    FILE *f;
+    int ch;
+
+    memset(&c, 0, sizeof(c));
+    c.mask[0] = ~0U;
+    c.mask[1] = LEV1_MASK;
+    c.size = 1 << 20;
+
+    while ((ch = getopt(argc, argv, "g:n:t:o:p:")) != -1) {
+        switch (ch) {
+        case 'g':
+            if (parse_pins(optarg, c.mask) || (!c.mask[0] && !c.mask[1])) {
+                fprintf(stderr, "Bad pin list \"%s\"\n", optarg);
+                return 1;
+            }
+            break;
+
+        case 'n':
+            c.size = strtoul(optarg, NULL, 0);
+            break;
+
+        case 't':
+            seconds = strtod(optarg, NULL);
+            break;
+
+        case 'o':
+            out = optarg;
+            break;
+
+        case 'p':
+            cpu = strtoul(optarg, NULL, 0);
+            break;
+
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    c.buf = malloc((size_t)c.size * sizeof(*c.buf));
+    if (!c.size || !c.buf) {
+        perror("Unable to allocate transition buffer");
+        return 1;
+    }
+    /* Fault the buffer in now rather than in the capture loop */
+    memset(c.buf, 0, (size_t)c.size * sizeof(*c.buf));
+    mlockall(MCL_CURRENT|MCL_FUTURE);
+
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set))
+            perror("Unable to pin capture");
+    }
+
+    gpio = periph_map(GPIO_OFFSET);
+    capture_loop(&c, gpio, now_ns() + (uint64_t)(seconds * 1e9));
+    elapsed = now_ns() - c.start_ns;
+
+    fprintf(stderr, "%llu samples in %.3f s: %.3f MS/s, %u transitions%s\n",
+            (unsigned long long)c.samples, elapsed / 1e9,
+            elapsed ? c.samples * 1e3 / elapsed : 0.0, c.count,
+            c.full ? " (buffer full)" : "");
+
+    f = out ? fopen(out, "w") : stdout;
+    if (!f || write_vcd(&c, f) || (out && fclose(f))) {
+        perror("Unable to write VCD");
+        return 1;
+    }
+    return 0;
+}
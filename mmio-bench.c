@@ -0,0 +1,325 @@
+// Register access microbenchmark
+//
+// Measures what the register layer costs: a read, a write, a
+// read-modify-write like GPIO_FSET, the same under its cross-process lock
+// (see reglock.h), a set_reg style field write (name lookup, read, insert,
+// write) and a burst of back-to-back writes.  Every
+// operation is timed on its own, minus the cost of reading the clock, and
+// the distribution is reported as min, median, p99 and max, followed by the
+// throughput of an untimed loop of the same operation.  A burst is timed as
+// a whole, and its throughput is in writes per second.
+//
+// compile with "gcc -O2 mmio-bench.c periph.c regs.c reglock.c -o mmio-bench -lpthread -lrt",
+// test with "./mmio-bench -p 1" (needs to be root for /dev/mem access)
+// or "./mmio-bench -b mem,file:/tmp/periph,anon" to compare backends
+//
+// All accesses are harmless on a real Pi: reads of GPLEV0, writes of 0 to
+// GPSET0, and read-modify-writes that put GPFSEL5 back as it was.  Writes
+// are posted, so a write's latency is only what it costs the CPU to issue
+// it; "burst64" shows what a stream of them sustains.  Each backend runs in
+// its own process, so the reports are independent of each other.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <unistd.h>
+
+#include "periph.h"
+#include "regs.h"
+#include "reglock.h"
+
+#define GPIO_FSEL5 5
+#define GPIO_SET0  7
+#define GPIO_LEV0  13
+
+#define FSEL53_SHIFT 9
+#define FSEL53_FIELD "GPIO.GPFSEL5.FSEL53"
+
+#define BURST_WRITES 64
+#define WARMUP_OPS 1000
+
+enum bench_op {
+    OP_READ,
+    OP_WRITE,
+    OP_RMW,
+    OP_LOCKED,
+    OP_FIELD,
+    OP_BURST,
+    OP_COUNT,
+};
+
+static const char *op_names[OP_COUNT] = {
+    [OP_READ]  = "read",
+    [OP_WRITE] = "write",
+    [OP_RMW]   = "rmw",
+    [OP_LOCKED] = "locked",
+    [OP_FIELD] = "field",
+    [OP_BURST] = "burst64",
+};
+
+struct bench {
+    const char *backend;
+    unsigned int samples;
+    int csv;
+    int cpu;
+
+    volatile uint32_t *gpio;
+    const struct reg_map *map;  /* NULL skips the field test */
+    uint32_t *ns;               /* one entry per sample */
+};
+
+struct result {
+    uint32_t min_ns, median_ns, p99_ns, max_ns;
+    double ops_per_sec;
+};
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// GPIO_FSET: read, replace FSEL53 with what it already was, write back
+static inline void rmw(volatile uint32_t *gpio)
+{
+    uint32_t v = periph_rd(gpio, GPIO_FSEL5);
+    uint32_t fsel = (v >> FSEL53_SHIFT) & 7;
+    periph_wr(gpio, GPIO_FSEL5, (v & ~(7U << FSEL53_SHIFT)) | (fsel << FSEL53_SHIFT));
+}
+
+// the same under the bank's lock: an empty mask writes GPFSEL5 back as it was
+static inline void locked_rmw(volatile uint32_t *gpio)
+{
+    reglock_rmw(gpio, GPIO_FSEL5, 0, 0);
+}
+
+// set_reg: look the field up by name, then read-modify-write it
+static inline void field_write(struct bench *b)
+{
+    const struct reg_field *field;
+    struct reg_ref ref;
+    uint32_t v;
+
+    if (reg_lookup(b->map, FSEL53_FIELD, sizeof(FSEL53_FIELD) - 1, &ref))
+        return;
+    field = &b->map->fields[ref.field];
+    v = periph_rd(b->gpio, b->map->regs[ref.reg].offset / 4);
+    periph_wr(b->gpio, b->map->regs[ref.reg].offset / 4,
+            reg_field_put(field, v, reg_field_get(field, v)));
+}
+
+static inline void burst(volatile uint32_t *gpio)
+{
+    int i;
+    for (i = 0; i < BURST_WRITES; i++)
+        periph_wr(gpio, GPIO_SET0, 0);
+}
+
+static inline void run_op(struct bench *b, enum bench_op op)
+{
+    switch (op) {
+    case OP_READ:
+        (void)periph_rd(b->gpio, GPIO_LEV0);
+        break;
+    case OP_WRITE:
+        periph_wr(b->gpio, GPIO_SET0, 0);
+        break;
+    case OP_RMW:
+        rmw(b->gpio);
+        break;
+    case OP_LOCKED:
+        locked_rmw(b->gpio);
+        break;
+    case OP_FIELD:
+        field_write(b);
+        break;
+    case OP_BURST:
+        burst(b->gpio);
+        break;
+    default:
+        break;
+    }
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// median cost of reading the clock twice with nothing in between
+static uint64_t timer_overhead(struct bench *b)
+{
+    unsigned int i;
+
+    for (i = 0; i < b->samples; i++) {
+        uint64_t start = now_ns();
+        b->ns[i] = now_ns() - start;
+    }
+    qsort(b->ns, b->samples, sizeof(*b->ns), cmp_u32);
+    return b->ns[b->samples / 2];
+}
+
+static void measure(struct bench *b, enum bench_op op, uint64_t overhead, struct result *r)
+{
+    unsigned int i, per_op = op == OP_BURST ? BURST_WRITES : 1;
+    uint64_t start, elapsed;
+
+    for (i = 0; i < WARMUP_OPS; i++)
+        run_op(b, op);
+
+    for (i = 0; i < b->samples; i++) {
+        uint64_t t;
+
+        start = now_ns();
+        run_op(b, op);
+        t = now_ns() - start;
+        b->ns[i] = t > overhead ? t - overhead : 0;
+    }
+    qsort(b->ns, b->samples, sizeof(*b->ns), cmp_u32);
+    r->min_ns = b->ns[0];
+    r->median_ns = b->ns[b->samples / 2];
+    r->p99_ns = b->ns[(uint64_t)b->samples * 99 / 100];
+    r->max_ns = b->ns[b->samples - 1];
+
+    start = now_ns();
+    for (i = 0; i < b->samples; i++)
+        run_op(b, op);
+    elapsed = now_ns() - start;
+    r->ops_per_sec = elapsed ? (double)b->samples * per_op * 1e9 / elapsed : 0;
+}
+
+static void print_header(int csv)
+{
+    if (csv)
+        printf("backend,test,samples,min_ns,median_ns,p99_ns,max_ns,ops_per_sec\n");
+    else
+        printf("%-20s %-7s %8s %8s %8s %8s %12s\n",
+                "backend", "test", "min", "median", "p99", "max", "ops/s");
+}
+
+static void print_result(const struct bench *b, enum bench_op op, const struct result *r)
+{
+    if (b->csv)
+        printf("%s,%s,%u,%u,%u,%u,%u,%.0f\n", b->backend, op_names[op], b->samples,
+                r->min_ns, r->median_ns, r->p99_ns, r->max_ns, r->ops_per_sec);
+    else
+        printf("%-20s %-7s %5u ns %5u ns %5u ns %5u ns %12.0f\n", b->backend, op_names[op],
+                r->min_ns, r->median_ns, r->p99_ns, r->max_ns, r->ops_per_sec);
+}
+
+// one backend, in a process of its own
+static int run_backend(struct bench *b)
+{
+    struct result r;
+    uint64_t overhead;
+    int op;
+
+    if (setenv("RPI_PERIPH", b->backend, 1))
+        return 1;
+    if (b->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(b->cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set))
+            perror("Unable to pin the benchmark");
+    }
+    mlockall(MCL_CURRENT|MCL_FUTURE);
+
+    b->gpio = periph_map(GPIO_OFFSET);
+    overhead = timer_overhead(b);
+    for (op = 0; op < OP_COUNT; op++) {
+        if (op == OP_FIELD && !b->map)
+            continue;
+        measure(b, op, overhead, &r);
+        print_result(b, op, &r);
+    }
+    if (!b->csv)
+        printf("%-20s (clock read overhead %llu ns subtracted)\n", b->backend,
+                (unsigned long long)overhead);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct bench b;
+    char *backends = NULL, *backend, *save;
+    const char *env;
+    int ch, status, failed = 0;
+
+    memset(&b, 0, sizeof(b));
+    b.samples = 100000;
+    b.cpu = -1;
+
+    while ((ch = getopt(argc, argv, "b:n:p:c")) != -1) {
+        switch (ch) {
+        case 'b':
+            backends = optarg;
+            break;
+
+        case 'n':
+            b.samples = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'p':
+            b.cpu = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'c':
+            b.csv = 1;
+            break;
+
+        default:
+            printf("Usage: %s [-b backend,...] [-n samples] [-p cpu] [-c]\n", argv[0]);
+            printf("\t-b  backends to compare, as for RPI_PERIPH (default $RPI_PERIPH or mem)\n");
+            printf("\t-n  samples per test (default 100000)\n");
+            printf("\t-p  pin the benchmark to this CPU\n");
+            printf("\t-c  CSV output\n");
+            return 1;
+        }
+    }
+    if (!b.samples) {
+        fprintf(stderr, "Need at least one sample\n");
+        return 1;
+    }
+    if (!backends) {
+        env = getenv("RPI_PERIPH");
+        backends = strdup(env && *env ? env : "mem");
+    }
+
+    b.ns = malloc(b.samples * sizeof(*b.ns));
+    if (!b.ns) {
+        perror("Unable to allocate samples");
+        return 1;
+    }
+    /* Without a register description the field test is skipped */
+    b.map = reg_map_load(NULL);
+
+    print_header(b.csv);
+    for (backend = strtok_r(backends, ",", &save); backend;
+            backend = strtok_r(NULL, ",", &save)) {
+        pid_t pid;
+
+        fflush(stdout);
+        b.backend = backend;
+        if ((pid = fork()) < 0) {
+            perror("Unable to start a benchmark");
+            return 1;
+        }
+        if (pid == 0)
+            exit(run_backend(&b));
+        if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+            fprintf(stderr, "%s: benchmark failed\n", backend);
+            failed = 1;
+        }
+    }
+    return failed;
+}
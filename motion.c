@@ -0,0 +1,152 @@
+// Servo motion planner and frame-aligned scheduling, see motion.h
+
+#include <math.h>
+#include <errno.h>
+#include <time.h>
+
+#include "motion.h"
+
+static uint64_t ts_ns(const struct timespec *ts)
+{
+    return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts_ns(&ts);
+}
+
+// ramp time per unit of velocity, relative to a linear ramp: the cosine
+// ramp needs pi/2 as long to keep its peak acceleration at amax
+static double ramp_factor(const struct motion *m)
+{
+    return m->profile == MOTION_SCURVE ? M_PI / 2 : 1.0;
+}
+
+void motion_init(struct motion *m, enum motion_profile profile, double vmax,
+        double amax, double dt, double pos)
+{
+    m->profile = profile;
+    m->vmax = vmax;
+    m->amax = amax;
+    m->dt = dt;
+    m->pos = m->start = pos;
+    m->dist = 0;
+    m->vpeak = m->t_ramp = m->t_cruise = 0;
+    m->frame = m->frames = 0;
+}
+
+void motion_move(struct motion *m, double target)
+{
+    double k = ramp_factor(m);
+    double d;
+
+    m->start = m->pos;
+    m->dist = target - m->pos;
+    m->frame = 0;
+    d = fabs(m->dist);
+
+    if (d == 0) {
+        m->frames = 0;
+        return;
+    }
+    if (m->vmax <= 0 || m->amax <= 0) {
+        /* no limits: jump in one frame */
+        m->vpeak = m->t_ramp = m->t_cruise = 0;
+        m->frames = 1;
+        return;
+    }
+
+    /* both ramps together cover vpeak * t_ramp */
+    m->vpeak = m->vmax;
+    m->t_ramp = k * m->vpeak / m->amax;
+    if (m->vpeak * m->t_ramp > d) {
+        /* never reaches vmax */
+        m->vpeak = sqrt(d * m->amax / k);
+        m->t_ramp = k * m->vpeak / m->amax;
+    }
+    m->t_cruise = (d - m->vpeak * m->t_ramp) / m->vpeak;
+    if (m->t_cruise < 0)
+        m->t_cruise = 0;
+    m->frames = (uint32_t)ceil((2 * m->t_ramp + m->t_cruise) / m->dt);
+    if (!m->frames)
+        m->frames = 1;
+}
+
+// distance covered t seconds into the acceleration ramp
+static double ramp_dist(const struct motion *m, double t)
+{
+    if (m->profile == MOTION_SCURVE)
+        return m->vpeak / 2 * (t - m->t_ramp / M_PI * sin(M_PI * t / m->t_ramp));
+    return m->vpeak * t * t / (2 * m->t_ramp);
+}
+
+double motion_step(struct motion *m)
+{
+    double t, total, s;
+
+    if (motion_done(m))
+        return m->pos;
+
+    m->frame++;
+    t = m->frame * m->dt;
+    total = 2 * m->t_ramp + m->t_cruise;
+
+    if (m->frame >= m->frames || t >= total)
+        s = fabs(m->dist);
+    else if (t < m->t_ramp)
+        s = ramp_dist(m, t);
+    else if (t < m->t_ramp + m->t_cruise)
+        s = m->vpeak * m->t_ramp / 2 + m->vpeak * (t - m->t_ramp);
+    else
+        s = fabs(m->dist) - ramp_dist(m, total - t);
+
+    if (m->frame >= m->frames)
+        m->pos = m->start + m->dist;   /* land exactly on the target */
+    else
+        m->pos = m->start + (m->dist < 0 ? -s : s);
+    return m->pos;
+}
+
+static void ts_add(struct timespec *ts, uint64_t ns)
+{
+    ns += ts->tv_nsec;
+    ts->tv_sec += ns / 1000000000ULL;
+    ts->tv_nsec = ns % 1000000000ULL;
+}
+
+void frame_clock_start(struct frame_clock *fc, uint64_t period_ns)
+{
+    clock_gettime(CLOCK_MONOTONIC, &fc->next);
+    fc->period_ns = period_ns;
+    fc->frames = fc->misses = fc->worst_late_ns = 0;
+}
+
+unsigned int frame_clock_wait(struct frame_clock *fc)
+{
+    unsigned int missed = 0;
+    uint64_t now, deadline;
+
+    ts_add(&fc->next, fc->period_ns);
+
+    /* Deadlines that already went by are lost, don't try to catch up */
+    now = now_ns();
+    while (ts_ns(&fc->next) < now) {
+        ts_add(&fc->next, fc->period_ns);
+        missed++;
+    }
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &fc->next, NULL) == EINTR)
+        ;
+
+    deadline = ts_ns(&fc->next);
+    now = now_ns();
+    if (now > deadline && now - deadline > fc->worst_late_ns)
+        fc->worst_late_ns = now - deadline;
+
+    fc->frames += missed + 1;
+    fc->misses += missed;
+    return missed;
+}
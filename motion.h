@@ -0,0 +1,71 @@
+// Servo motion planner and frame-aligned scheduling
+//
+// A move goes from rest at the current position to rest at the target,
+// limited to a maximum velocity and acceleration.  The trapezoidal profile
+// ramps velocity linearly; the S-curve profile ramps it along half a cosine,
+// so acceleration (and jerk) stays bounded and the peak acceleration is
+// still amax.  Both are evaluated in closed form at each frame time, so
+// sampling at the PWM frame rate doesn't accumulate any error.
+//
+// frame_clock sleeps to absolute deadlines one period apart with
+// clock_nanosleep(TIMER_ABSTIME), so time spent between frames never adds
+// up to drift.  A frame whose deadline already passed counts as a miss, and
+// the clock skips ahead to the next deadline still in the future.
+//
+// Units are whatever the caller uses for position (percent, microseconds,
+// ...), per second.
+
+#ifndef MOTION_H
+#define MOTION_H
+
+#include <stdint.h>
+#include <time.h>
+
+enum motion_profile {
+    MOTION_TRAPEZOID,
+    MOTION_SCURVE,
+};
+
+struct motion {
+    enum motion_profile profile;
+    double vmax;                /* units/s */
+    double amax;                /* units/s^2 */
+    double dt;                  /* frame period, s */
+
+    double pos;                 /* position at the current frame */
+    double start, dist;         /* current move, dist signed */
+    double vpeak;               /* reached velocity, may be below vmax */
+    double t_ramp, t_cruise;    /* duration of each ramp and of the cruise */
+    uint32_t frame, frames;     /* frames into the move, frames it takes */
+};
+
+void motion_init(struct motion *m, enum motion_profile profile, double vmax,
+        double amax, double dt, double pos);
+
+// Plan a move from the current position to target.  Starts from rest, so
+// call it once motion_done() or accept an abrupt change of velocity.
+void motion_move(struct motion *m, double target);
+
+// Advance one frame and return the position for it
+double motion_step(struct motion *m);
+
+static inline int motion_done(const struct motion *m)
+{
+    return m->frame >= m->frames;
+}
+
+struct frame_clock {
+    struct timespec next;       /* next deadline, CLOCK_MONOTONIC */
+    uint64_t period_ns;
+    uint64_t frames;            /* deadlines met or missed */
+    uint64_t misses;
+    uint64_t worst_late_ns;     /* latest wakeup after a deadline */
+};
+
+void frame_clock_start(struct frame_clock *fc, uint64_t period_ns);
+
+// Sleep until the next deadline.  Returns the number of deadlines missed
+// since the previous call, 0 when on time.
+unsigned int frame_clock_wait(struct frame_clock *fc);
+
+#endif /* MOTION_H */
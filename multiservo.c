@@ -0,0 +1,170 @@
+// Drive servos on any number of GPIO0-31 pins from one DMA channel
+//
+// compile with "gcc multiservo.c dmaservo.c clkman.c dma.c periph.c reglock.c -o multiservo -lpthread -lrt -lm",
+// test with "./multiservo 4=1500 17=1000" (needs to be root for /dev/mem access)
+//
+// Pulses are hardware timed by the DMA engine, paced by the PWM (see
+// dmaservo.h), so the CPU is idle once the list runs.  After the initial
+// positions, further "pin=microseconds" lines are read from stdin and only
+// patch the affected mask words.  With RPI_PERIPH=anon the DMA engine is
+// simulated and every update prints the pulse widths the pins would see.
+// End of input, SIGINT or SIGTERM stops the pulses and frees the DMA memory.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+
+#include <unistd.h>
+
+#include "periph.h"
+#include "dma.h"
+#include "dmaservo.h"
+
+#define GPIO_SET0 7
+#define GPIO_CLR0 10
+#define PWM_FIF   6
+
+static struct dmaservo ds;
+static volatile sig_atomic_t running = 1;
+
+static void stop(int sig)
+{
+    running = 0;
+}
+
+/* Simulated run: when each pin went high, and the widths measured */
+static uint64_t sim_beat;
+static uint64_t sim_rise[DMASERVO_MAX_PINS];
+static uint32_t sim_high;
+static unsigned int sim_width[DMASERVO_MAX_PINS];
+
+static void sim_set(void *arg, uint32_t mask)
+{
+    int pin;
+    for (pin = 0; pin < DMASERVO_MAX_PINS; pin++)
+        if (mask & (1U << pin))
+            sim_rise[pin] = sim_beat;
+    sim_high |= mask;
+}
+
+// only the first clear of a pulse ends it, the last tick clears every pin
+static void sim_clr(void *arg, uint32_t mask)
+{
+    int pin;
+
+    mask &= sim_high;
+    for (pin = 0; pin < DMASERVO_MAX_PINS; pin++)
+        if (mask & (1U << pin))
+            sim_width[pin] = sim_beat - sim_rise[pin];
+    sim_high &= ~mask;
+}
+
+static void sim_fifo(void *arg, uint32_t word)
+{
+    sim_beat++;
+}
+
+// run the simulated DMA for one frame and print what each pin produced
+static void sim_frame(void)
+{
+    int pin;
+
+    memset(sim_width, 0, sizeof(sim_width));
+    /* Realign to the start of the frame, then run a whole one */
+    dma_sim_run(&ds.chan, ds.nticks - sim_beat % ds.nticks);
+    dma_sim_run(&ds.chan, ds.nticks);
+    for (pin = 0; pin < DMASERVO_MAX_PINS; pin++)
+        if (ds.pins & (1U << pin))
+            printf("GPIO%d: %u us\n", pin, sim_width[pin] * ds.tick_us);
+}
+
+// parse "pin=us" and apply it
+static int set_position(const char *arg)
+{
+    char *end;
+    int pin = strtol(arg, &end, 0);
+    unsigned int us;
+
+    if (*end != '=') {
+        fprintf(stderr, "Expected pin=microseconds, got \"%s\"\n", arg);
+        return -1;
+    }
+    us = strtoul(end + 1, NULL, 0);
+    if (dmaservo_set_us(&ds, pin, us)) {
+        fprintf(stderr, "Can't set GPIO%d to %u us\n", pin, us);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int tick_us = 10;
+    int channel = 14;
+    uint32_t pins = 0;
+    char line[64];
+    struct sigaction sa;
+    int ch, i;
+
+    while ((ch = getopt(argc, argv, "t:c:")) != -1) {
+        switch (ch) {
+        case 't':
+            tick_us = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'c':
+            channel = strtoul(optarg, NULL, 0);
+            break;
+
+        default:
+            printf("Usage: %s [-t tick_us] [-c dma_channel] pin=us...\n", argv[0]);
+            return 1;
+        }
+    }
+
+    for (i = optind; i < argc; i++) {
+        int pin = strtol(argv[i], NULL, 0);
+        if (pin < 0 || pin >= DMASERVO_MAX_PINS) {
+            fprintf(stderr, "Pin %d out of range, only GPIO0-31 can be driven\n", pin);
+            return 1;
+        }
+        pins |= 1U << pin;
+    }
+    if (!pins) {
+        fprintf(stderr, "No pins given\n");
+        return 1;
+    }
+
+    if (dmaservo_init(&ds, channel, tick_us, pins)) {
+        perror("Unable to start DMA");
+        return 1;
+    }
+    if (ds.chan.simulated) {
+        dma_sim_sink(PERIPH_BUS_ADDR(GPIO_OFFSET, GPIO_SET0), sim_set, NULL);
+        dma_sim_sink(PERIPH_BUS_ADDR(GPIO_OFFSET, GPIO_CLR0), sim_clr, NULL);
+        dma_sim_sink(PERIPH_BUS_ADDR(PWM_OFFSET, PWM_FIF), sim_fifo, NULL);
+    }
+
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;            /* no SA_RESTART: interrupt the read of stdin */
+    sa.sa_handler = stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    for (i = optind; i < argc; i++)
+        set_position(argv[i]);
+    if (ds.chan.simulated)
+        sim_frame();
+
+    while (running && fgets(line, sizeof(line), stdin)) {
+        if (set_position(line))
+            continue;
+        if (ds.chan.simulated)
+            sim_frame();
+    }
+
+    dmaservo_stop(&ds);
+    return 0;
+}
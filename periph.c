@@ -0,0 +1,307 @@
+// Shared access to the BCM2835 peripheral window, see periph.h
+//
+// Replaces the per-tool mapRegisterMemory() copies, which opened /dev/mem
+// for every tool, malloc'd a throwaway buffer to MAP_FIXED over, and never
+// shared a mapping between blocks.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <unistd.h>
+
+#include "periph.h"
+
+#define MAX_BLOCKS 16
+
+/* periph_wait() phases: spin, then yield, then sleep from the first step up */
+#define WAIT_SPIN_NS		2000
+#define WAIT_YIELD_NS		20000
+#define WAIT_SLEEP_MIN_NS	5000
+#define WAIT_SLEEP_MAX_NS	1000000
+
+#ifdef PERIPH_COUNT
+uint64_t periph_reads, periph_writes;
+#endif
+
+static struct {
+    int opened;
+    enum periph_backend backend;
+    int fd;
+    uint32_t base;
+    unsigned int nblocks;
+    struct {
+        uint32_t offset;
+        volatile uint32_t *mem;
+    } blocks[MAX_BLOCKS];
+    struct periph_stats stats;
+} periph = { .fd = -1 };
+
+static const char *backend_names[] = {
+    [PERIPH_DEVMEM]  = "mem",
+    [PERIPH_GPIOMEM] = "gpiomem",
+    [PERIPH_FILE]    = "file",
+    [PERIPH_ANON]    = "anon",
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void print_stats(void)
+{
+    struct periph_stats stats;
+
+    periph_get_stats(&stats);
+    fprintf(stderr, "periph: backend %s, %u blocks, open %.1f us, map %.1f us",
+            backend_names[stats.backend], stats.maps,
+            stats.open_ns / 1000.0, stats.map_ns / 1000.0);
+#ifdef PERIPH_COUNT
+    fprintf(stderr, ", %llu reads, %llu writes",
+            (unsigned long long)stats.reads, (unsigned long long)stats.writes);
+#endif
+    if (stats.waits)
+        fprintf(stderr, ", %llu waits, %.1f us total, %.1f us max, %llu timeouts",
+                (unsigned long long)stats.waits, stats.wait_ns / 1000.0,
+                stats.wait_max_ns / 1000.0, (unsigned long long)stats.wait_timeouts);
+    fprintf(stderr, "\n");
+}
+
+int periph_open(enum periph_backend backend, const char *path)
+{
+    uint64_t start = now_ns();
+    const char *env;
+
+    if (periph.opened)
+        return 0;
+
+    periph.base = BCM2708_PERI_BASE;
+    if ((env = getenv("RPI_PERIPH_BASE")) != NULL)
+        periph.base = strtoul(env, NULL, 0);
+
+    switch (backend) {
+    case PERIPH_DEVMEM:
+        periph.fd = open("/dev/mem", O_RDWR|O_SYNC|O_CLOEXEC);
+        break;
+
+    case PERIPH_GPIOMEM:
+        periph.fd = open("/dev/gpiomem", O_RDWR|O_SYNC|O_CLOEXEC);
+        break;
+
+    case PERIPH_FILE: {
+        struct stat st;
+        if (!path || !*path) {
+            errno = EINVAL;
+            return -1;
+        }
+        periph.fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+        if (periph.fd < 0)
+            break;
+        /* Sparse, so only blocks that get touched take up disk space */
+        if (fstat(periph.fd, &st) || (st.st_size < PERIPH_WINDOW_SIZE &&
+                    ftruncate(periph.fd, PERIPH_WINDOW_SIZE))) {
+            close(periph.fd);
+            periph.fd = -1;
+        }
+        break;
+    }
+
+    case PERIPH_ANON:
+        break;
+
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (backend != PERIPH_ANON && periph.fd < 0)
+        return -1;
+
+    periph.backend = backend;
+    periph.opened = 1;
+    periph.stats.backend = backend;
+    periph.stats.open_ns = now_ns() - start;
+
+    if ((env = getenv("RPI_PERIPH_STATS")) != NULL && *env && *env != '0')
+        atexit(print_stats);
+    return 0;
+}
+
+static void open_from_env(void)
+{
+    const char *env = getenv("RPI_PERIPH");
+    enum periph_backend backend = PERIPH_DEVMEM;
+    const char *path = NULL;
+
+    if (!env || !*env || !strcmp(env, "mem"))
+        backend = PERIPH_DEVMEM;
+    else if (!strcmp(env, "gpiomem"))
+        backend = PERIPH_GPIOMEM;
+    else if (!strcmp(env, "anon"))
+        backend = PERIPH_ANON;
+    else if (!strncmp(env, "file:", 5)) {
+        backend = PERIPH_FILE;
+        path = env + 5;
+    }
+    else {
+        fprintf(stderr, "Unknown RPI_PERIPH backend \"%s\"\n", env);
+        exit(-1);
+    }
+
+    if (periph_open(backend, path)) {
+        fprintf(stderr, "can't open %s peripheral backend: %s\n",
+                backend_names[backend], strerror(errno));
+        exit(-1);
+    }
+}
+
+volatile uint32_t *periph_map(uint32_t offset)
+{
+    unsigned int i;
+    uint64_t start;
+    void *map;
+
+    if (!periph.opened)
+        open_from_env();
+
+    offset &= ~(PERIPH_BLOCK_SIZE - 1);
+    for (i = 0; i < periph.nblocks; i++)
+        if (periph.blocks[i].offset == offset)
+            return periph.blocks[i].mem;
+
+    if (periph.nblocks >= MAX_BLOCKS) {
+        fprintf(stderr, "too many peripheral blocks mapped\n");
+        exit(-1);
+    }
+
+    start = now_ns();
+    switch (periph.backend) {
+    case PERIPH_DEVMEM:
+        map = mmap(NULL, PERIPH_BLOCK_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED,
+                periph.fd, periph.base + offset);
+        break;
+
+    case PERIPH_GPIOMEM:
+        /* /dev/gpiomem exposes only the GPIO block, at offset 0 */
+        if (offset != GPIO_OFFSET) {
+            fprintf(stderr, "block 0x%06x is not available through /dev/gpiomem\n",
+                    offset);
+            exit(-1);
+        }
+        map = mmap(NULL, PERIPH_BLOCK_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED,
+                periph.fd, 0);
+        break;
+
+    case PERIPH_FILE:
+        map = mmap(NULL, PERIPH_BLOCK_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED,
+                periph.fd, offset);
+        break;
+
+    default:
+        map = mmap(NULL, PERIPH_BLOCK_SIZE, PROT_READ|PROT_WRITE,
+                MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+        break;
+    }
+
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "mmap error for block 0x%06x: %s\n", offset, strerror(errno));
+        exit(-1);
+    }
+
+    periph.stats.map_ns += now_ns() - start;
+    periph.stats.maps++;
+    periph.blocks[periph.nblocks].offset = offset;
+    periph.blocks[periph.nblocks].mem = map;
+    periph.nblocks++;
+
+    // Always use volatile pointer!
+    return (volatile uint32_t *)map;
+}
+
+uint32_t periph_offset(volatile uint32_t *blk)
+{
+    unsigned int i;
+
+    for (i = 0; i < periph.nblocks; i++)
+        if (periph.blocks[i].mem == blk)
+            return periph.blocks[i].offset;
+    fprintf(stderr, "%p is not a mapped peripheral block\n", (void *)blk);
+    exit(-1);
+}
+
+void *periph_map_phys(uint32_t phys, size_t size)
+{
+    void *map;
+
+    if (!periph.opened)
+        open_from_env();
+    if (periph.backend != PERIPH_DEVMEM)
+        return NULL;
+
+    map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, periph.fd, phys);
+    return map == MAP_FAILED ? NULL : map;
+}
+
+enum periph_backend periph_backend(void)
+{
+    if (!periph.opened)
+        open_from_env();
+    return periph.backend;
+}
+
+uint32_t periph_phys_base(void)
+{
+    if (!periph.opened)
+        open_from_env();
+    return periph.base;
+}
+
+void periph_get_stats(struct periph_stats *stats)
+{
+    *stats = periph.stats;
+#ifdef PERIPH_COUNT
+    stats->reads = periph_reads;
+    stats->writes = periph_writes;
+#endif
+}
+
+int periph_wait(volatile uint32_t *blk, unsigned int reg, uint32_t mask,
+        uint32_t value, uint64_t timeout_ns)
+{
+    uint64_t start = now_ns(), elapsed = 0, step = WAIT_SLEEP_MIN_NS;
+    int ready;
+
+    while (!(ready = (periph_rd(blk, reg) & mask) == value) && elapsed < timeout_ns) {
+        if (elapsed >= WAIT_YIELD_NS) {
+            struct timespec ts = { 0, step < timeout_ns - elapsed ? step : timeout_ns - elapsed };
+            nanosleep(&ts, NULL);
+            if (step < WAIT_SLEEP_MAX_NS)
+                step *= 2;
+        }
+        else if (elapsed >= WAIT_SPIN_NS)
+            sched_yield();
+        elapsed = now_ns() - start;
+    }
+
+    periph.stats.waits++;
+    periph.stats.wait_ns += elapsed;
+    if (elapsed > periph.stats.wait_max_ns)
+        periph.stats.wait_max_ns = elapsed;
+    if (!ready) {
+        periph.stats.wait_timeouts++;
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return 0;
+}
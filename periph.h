@@ -0,0 +1,117 @@
+// Shared access to the BCM2835 peripheral window
+//
+// Every tool maps its register blocks through here.  The backing device is
+// opened once, and each 4k block is mapped the first time it is asked for;
+// later calls for the same block return the cached mapping.
+//
+// The backend is picked with the RPI_PERIPH environment variable:
+//
+//   mem         /dev/mem at the physical peripheral base (default, needs root)
+//   gpiomem     /dev/gpiomem, only the GPIO block is available (no root needed)
+//   file:PATH   a regular file standing in for the whole peripheral window,
+//               shared between processes, handy for tests without a Pi
+//   anon        anonymous memory, each block starts out zeroed
+//
+// RPI_PERIPH_BASE overrides the physical base (0x3F000000 on a Pi 2/3), and
+// RPI_PERIPH_STATS=1 prints open/map timings and register wait times to
+// stderr when the tool exits.
+
+#ifndef PERIPH_H
+#define PERIPH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BCM2708_PERI_BASE	0x20000000
+
+/* Block offsets inside the peripheral window */
+#define DMA_OFFSET		0x007000	/* DMA channels 0-14 */
+#define CLOCK_OFFSET		0x101000	/* clock manager */
+#define GPIO_OFFSET		0x200000	/* GPIO controller */
+#define PWM_OFFSET		0x20C000	/* PWM controller */
+
+#define PERIPH_BLOCK_SIZE	(4*1024)
+#define PERIPH_WINDOW_SIZE	0x1000000
+
+/* Peripherals as seen by the DMA engine and the VideoCore */
+#define PERIPH_BUS_BASE		0x7E000000
+#define PERIPH_BUS_ADDR(offset, reg)	(PERIPH_BUS_BASE + (offset) + (reg)*4)
+
+/* Deadline for a peripheral to settle after a stop or reset */
+#define PERIPH_SETTLE_NS	1000000
+
+enum periph_backend {
+    PERIPH_DEVMEM,
+    PERIPH_GPIOMEM,
+    PERIPH_FILE,
+    PERIPH_ANON,
+};
+
+struct periph_stats {
+    enum periph_backend backend;
+    unsigned int maps;          /* blocks mapped so far */
+    uint64_t open_ns;           /* time spent opening the backend */
+    uint64_t map_ns;            /* total time spent in mmap() */
+    uint64_t reads;             /* only counted with -DPERIPH_COUNT */
+    uint64_t writes;
+    uint64_t waits;             /* periph_wait() calls */
+    uint64_t wait_ns;           /* total and longest time spent waiting */
+    uint64_t wait_max_ns;
+    uint64_t wait_timeouts;
+};
+
+// Select a backend explicitly.  Optional: the first periph_map() call picks
+// one from the environment if this was never called.  Returns 0 on success.
+int periph_open(enum periph_backend backend, const char *path);
+
+// Return a pointer to the 4k register block at the given window offset,
+// mapping it on first use.  Exits with a message if the block can't be mapped.
+volatile uint32_t *periph_map(uint32_t offset);
+
+// Window offset of a block returned by periph_map(), so registers can be
+// named the same way in every process.  Exits if blk isn't one.
+uint32_t periph_offset(volatile uint32_t *blk);
+
+// Map physical memory outside the peripheral window, e.g. DMA buffers.
+// Only possible with the /dev/mem backend; returns NULL otherwise.
+void *periph_map_phys(uint32_t phys, size_t size);
+
+// The backend in use, opening one from the environment if needed
+enum periph_backend periph_backend(void);
+
+// Physical address of the peripheral window (tells a Pi 1 from a Pi 2/3)
+uint32_t periph_phys_base(void);
+
+void periph_get_stats(struct periph_stats *stats);
+
+// Wait until (blk[reg] & mask) == value, giving up after timeout_ns.  Spins
+// for the first couple of microseconds, then yields the CPU, then sleeps
+// in growing steps, so hardware that is ready at once costs no system call.
+// Returns 0 when the condition held, -1 with errno ETIMEDOUT otherwise.
+// The time every wait took is added to the stats.
+int periph_wait(volatile uint32_t *blk, unsigned int reg, uint32_t mask,
+        uint32_t value, uint64_t timeout_ns);
+
+#ifdef PERIPH_COUNT
+extern uint64_t periph_reads, periph_writes;
+#define PERIPH_COUNT_RD()	(periph_reads++)
+#define PERIPH_COUNT_WR()	(periph_writes++)
+#else
+#define PERIPH_COUNT_RD()	do { } while (0)
+#define PERIPH_COUNT_WR()	do { } while (0)
+#endif
+
+// Typed 32-bit register accessors.  reg is a word index, not a byte offset.
+static inline uint32_t periph_rd(volatile uint32_t *blk, unsigned int reg)
+{
+    PERIPH_COUNT_RD();
+    return blk[reg];
+}
+
+static inline void periph_wr(volatile uint32_t *blk, unsigned int reg, uint32_t val)
+{
+    PERIPH_COUNT_WR();
+    blk[reg] = val;
+}
+
+#endif /* PERIPH_H */
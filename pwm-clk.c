@@ -1,101 +1,49 @@
 // PWM example, based on code from http://elinux.org/RPi_Low-level_peripherals for the mmap part
 // and http://www.raspberrypi.org/phpBB3/viewtopic.php?t=8467&p=124620 for PWM initialization
 //
-// compile with "gcc pwm.c -o pwm", test with "./pwm" (needs to be root for /dev/mem access)
+// compile with "gcc pwm-clk.c clkman.c periph.c reglock.c -o pwm-clk -lpthread -lrt -lm", test with "./pwm-clk" (needs to be root for /dev/mem access)
+//
+// "./pwm-clk 1000000" searches every clock source, MASH level and integer
+// plus fractional divisor, prints the frequency, error and jitter of each,
+// and programs the one closest to the request; "-z" only considers
+// settings without fractional jitter.  Other generators are named before
+// the frequency and set together: "./pwm-clk -o gp0=10000000 gp2=32768"
+// starts two reference clocks on GPIO4 and GPIO6.
 //
 // Frank Buss, 2012
 
-#define BCM2708_PERI_BASE	0x20000000
-#define GPIO_BASE		(BCM2708_PERI_BASE + 0x200000) /* GPIO controller */
-#define PWM_BASE		(BCM2708_PERI_BASE + 0x20C000) /* PWM controller */
-#define CLOCK_BASE		(BCM2708_PERI_BASE + 0x101000)
-
 #define	PWM_CTL  0
 #define	PWM_RNG1 4
 #define	PWM_DAT1 5
 
-#define	PWMCLK_CNTL 40
-#define	PWMCLK_DIV  41
-
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <dirent.h>
-#include <fcntl.h>
-#include <assert.h>
-#include <sys/mman.h>
-#include <sys/types.h>
-#include <sys/stat.h>
 
 #include <unistd.h>
 
-#define PAGE_SIZE (4*1024)
-#define BLOCK_SIZE (4*1024)
+#include "periph.h"
+#include "reglock.h"
+#include "clkman.h"
 
 // I/O access
-volatile unsigned *gpio;
-volatile unsigned *pwm;
-volatile unsigned *clk;
+volatile uint32_t *gpio;
+volatile uint32_t *pwm;
 
 // GPIO setup macros. Always use INP_GPIO(x) before using OUT_GPIO(x) or SET_GPIO_ALT(x,y)
-#define INP_GPIO(g) *(gpio+((g)/10)) &= ~(7<<(((g)%10)*3))
-#define OUT_GPIO(g) *(gpio+((g)/10)) |=  (1<<(((g)%10)*3))
-#define SET_GPIO_ALT(g,a) *(gpio+(((g)/10))) |= (((a)<=3?(a)+4:(a)==4?3:2)<<(((g)%10)*3))
+// The read-modify-writes lock the GPFSEL bank, see reglock.h
+#define INP_GPIO(g) reglock_rmw(gpio, (g)/10, 7<<(((g)%10)*3), 0)
+#define OUT_GPIO(g) reglock_rmw(gpio, (g)/10, 0, 1<<(((g)%10)*3))
+#define SET_GPIO_ALT(g,a) reglock_rmw(gpio, (g)/10, 0, ((a)<=3?(a)+4:(a)==4?3:2)<<(((g)%10)*3))
 
 #define GPIO_SET *(gpio+7)  // sets   bits which are 1 ignores bits which are 0
 #define GPIO_CLR *(gpio+10) // clears bits which are 1 ignores bits which are 0
 
-// map 4k register memory for direct access from user space and return a user space pointer to it
-volatile unsigned *mapRegisterMemory(int base)
-{
-	static int mem_fd = 0;
-	char *mem, *map;
-	
-	/* open /dev/mem */
-	if (!mem_fd) {
-		if ((mem_fd = open("/dev/mem", O_RDWR|O_SYNC) ) < 0) {
-			printf("can't open /dev/mem \n");
-			exit (-1);
-		}
-	}
-	
-	/* mmap register */
-	
-	// Allocate MAP block
-	if ((mem = malloc(BLOCK_SIZE + (PAGE_SIZE-1))) == NULL) {
-		printf("allocation error \n");
-		exit (-1);
-	}
-	
-	// Make sure pointer is on 4K boundary
-	if ((unsigned long)mem % PAGE_SIZE)
-		mem += PAGE_SIZE - ((unsigned long)mem % PAGE_SIZE);
-	
-	// Now map it
-	map = (char *)mmap(
-		(caddr_t)mem,
-		BLOCK_SIZE,
-		PROT_READ|PROT_WRITE,
-		MAP_SHARED|MAP_FIXED,
-		mem_fd,
-		base
-	);
-	
-	if ((long)map < 0) {
-		printf("mmap error %d\n", (int)map);
-		exit (-1);
-	}
-	
-	// Always use volatile pointer!
-	return (volatile unsigned *)map;
-}
-
-// set up a memory regions to access GPIO, PWM and the clock manager
+// set up a memory regions to access GPIO and PWM
 void setupRegisterMemoryMappings()
 {
-	gpio = mapRegisterMemory(GPIO_BASE);
-	pwm = mapRegisterMemory(PWM_BASE);
-	clk = mapRegisterMemory(CLOCK_BASE);
+	gpio = periph_map(GPIO_OFFSET);
+	pwm = periph_map(PWM_OFFSET);
 }
 
 void setServo(int percent)
@@ -113,45 +61,113 @@ void setServo(int percent)
 		bits |= 1;
 		bitCount--;
 	}
-	*(pwm + PWM_DAT1) = bits;
+	periph_wr(pwm, PWM_DAT1, bits);
 }
 
-// init hardware
-void initHardware(unsigned long freq) {
-	// set frequency
-	// DIVI is the integer part of the divisor
-	// the fractional part (DIVF) drops clock cycles to get the output frequency, bad for servo motors
-	// 320 bits for one cycle of 20 milliseconds = 62.5 us per bit = 16 kHz
-	int idiv = (int) (19200000.0f / freq);
-	if (idiv < 1 || idiv > 0x1000) {
-		printf("idiv out of range: 1 < 0x%x < 0x1000\n", idiv);
-		exit(-1);
-	}
-    printf("Clock set to %d Hz\n", 19200000/idiv);
-
+// GPCLK0-2 are ALT0 on GPIO4-6
+static const int gpclkPins[CLK_COUNT] = { [CLK_GP0] = 4, [CLK_GP1] = 5, [CLK_GP2] = 6,
+	[CLK_PCM] = -1, [CLK_PWM] = -1 };
 
-	// mmap register space
-	setupRegisterMemoryMappings();
-	
-	// stop clock and waiting for busy flag doesn't work, so kill clock
-	*(clk + PWMCLK_CNTL) = 0x5A000000 | (1 << 5);
-	usleep(10);  
-
-	*(clk + PWMCLK_DIV)  = 0x5A000000 | (idiv<<12);
-	
-	// source=osc and enable clock
-	*(clk + PWMCLK_CNTL) = 0x5A000011;
+// parse "[clock=]frequency", the clock defaulting to pwm
+static int parseRequest(const char *arg, int *clock, double *freq)
+{
+	const char *eq = strchr(arg, '=');
+	char name[8], *end;
+
+	*clock = CLK_PWM;
+	if (eq) {
+		if (eq - arg >= (int) sizeof(name))
+			return -1;
+		memcpy(name, arg, eq - arg);
+		name[eq - arg] = '\0';
+		if ((*clock = clk_lookup(name)) < 0)
+			return -1;
+		arg = eq + 1;
+	}
+	*freq = strtod(arg, &end);
+	return end == arg || *end || *freq <= 0 ? -1 : 0;
 }
 
 int main(int argc, char **argv)
 { 
-    unsigned long freq;
-    if (argc != 2) {
-        printf("Usage: %s [frequency]\n", argv[0]);
-        return 1;
-    }
-
-	// init PWM module for GPIO pin 18 with 50 Hz frequency
-    freq = strtoul(argv[1], NULL, 0);
-	initHardware(freq);
+	struct clk_request reqs[CLK_COUNT];
+	struct clk_setting *best;
+	unsigned int flags = 0;
+	int route = 0, dryRun = 0;
+	int ch, i, clock, n = 0;
+	double freq;
+
+	while ((ch = getopt(argc, argv, "zano")) != -1) {
+		switch (ch) {
+		case 'z':
+			flags |= CLK_ZERO_JITTER;
+			break;
+
+		case 'a':
+			flags |= CLK_ALLOW_UNSTABLE;
+			break;
+
+		case 'n':
+			dryRun = 1;
+			break;
+
+		case 'o':
+			route = 1;
+			break;
+
+		default:
+			optind = argc;
+			break;
+		}
+	}
+	if (optind >= argc || argc - optind > CLK_COUNT) {
+		printf("Usage: %s [-z] [-a] [-n] [-o] [clock=]frequency...\n", argv[0]);
+		printf("\tclock is gp0, gp1, gp2, pcm or pwm (the default)\n");
+		printf("\t-z  zero jitter: integer divisors only\n");
+		printf("\t-a  also use PLLC, which changes with the core clock\n");
+		printf("\t-n  only show the options, don't program the clocks\n");
+		printf("\t-o  route GPCLK0-2 to GPIO4-6\n");
+		return 1;
+	}
+
+	for (; optind < argc; optind++) {
+		memset(&reqs[n], 0, sizeof(reqs[n]));
+		if (parseRequest(argv[optind], &clock, &freq)) {
+			printf("Bad clock request \"%s\"\n", argv[optind]);
+			return 1;
+		}
+		reqs[n].clock = clock;
+		for (i = 0; i < n; i++)
+			if (reqs[i].clock == reqs[n].clock) {
+				printf("%s requested twice\n", clk_name(reqs[n].clock));
+				return 1;
+			}
+
+		best = &reqs[n].setting;
+		printf("%s:\n", clk_name(reqs[n].clock));
+		if (clk_solve(freq, flags, best, stdout)) {
+			printf("No divisor gives %g Hz\n", freq);
+			return 1;
+		}
+		printf("%s set to %.3f Hz from %s, MASH %d, DIVI %d, DIVF %d (error %+.3g, jitter %.1f ns)\n",
+			clk_name(reqs[n].clock), best->hz, clk_source_name(best->src), best->mash,
+			best->divi, best->divf, best->error, best->jitter_ns);
+		reqs[n++].enable = 1;
+	}
+	if (dryRun)
+		return 0;
+
+	// all clocks are stopped, reprogrammed and restarted together
+	setupRegisterMemoryMappings();
+	if (clk_set(reqs, n)) {
+		perror("Unable to program the clocks");
+		return 1;
+	}
+	if (route)
+		for (i = 0; i < n; i++)
+			if (gpclkPins[reqs[i].clock] >= 0) {
+				INP_GPIO(gpclkPins[reqs[i].clock]);
+				SET_GPIO_ALT(gpclkPins[reqs[i].clock], 0);
+			}
+	return 0;
 }
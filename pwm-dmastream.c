@@ -0,0 +1,578 @@
+// Stream a sample file to PWM channel 1 by DMA
+//
+// The input file is memory-mapped, so samples go from the page cache
+// straight into the DMA buffers in one pass: copied as they are (serializer
+// words), or converted from 8 or 16-bit audio samples into M/S pulse
+// widths.  The DMA buffers form a ring, each with its own control block
+// chained to the next, and the DMA engine feeds PWM FIF through DREQ.  The
+// CPU only wakes to refill the buffers the engine has finished with, which
+// it tells from the control block the channel is on.
+//
+// compile with "gcc -O2 pwm-dmastream.c pwmsim.c dma.c clkman.c periph.c reglock.c -o pwm-dmastream -lpthread -lrt -lm",
+// test with "./pwm-dmastream -F s16 -f 44100 audio.raw" (needs to be root for
+// /dev/mem access) or "RPI_PERIPH=anon ./pwm-dmastream samples.bin"
+//
+// Input formats:
+//   raw   32-bit serializer words, host byte order, -f is the bit rate
+//   u8    unsigned 8-bit samples, M/S mode, -f is the sample rate
+//   s16   signed 16-bit samples, host byte order, M/S mode
+//
+// For audio the PWM clock is the sample rate times the range (-R), and each
+// sample becomes a pulse that many clocks wide, on GPIO18.
+//
+// If the CPU falls behind, the engine goes round the ring again and plays a
+// buffer that wasn't refilled; that is counted as an underrun.  The CPU
+// looks twice per buffer, and when it was held up for longer than a lap of
+// the ring, the time it was away says how many laps it missed.
+// At the end the report shows how full the ring was each time the CPU
+// looked, and what the refills cost.
+//
+// On a simulated backend (RPI_PERIPH=anon or file:PATH) the DMA engine is
+// simulated by dma.c and paced by the PWM model in pwmsim.c, and the waits
+// advance simulated time, so the ring logic can be checked and benchmarked
+// without a Pi.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include <unistd.h>
+
+#include "periph.h"
+#include "reglock.h"
+#include "dma.h"
+#include "clkman.h"
+#include "pwmsim.h"
+
+#define PWM_CTL  0
+#define PWM_STA  1
+#define PWM_DMAC 2
+#define PWM_RNG1 4
+#define PWM_FIF  6
+
+#define CTL_PWEN1 (1 << 0)
+#define CTL_MODE1 (1 << 1)
+#define CTL_USEF1 (1 << 5)
+#define CTL_CLRF1 (1 << 6)
+#define CTL_MSEN1 (1 << 7)
+
+#define STA_EMPT1 (1 << 1)
+#define STA_GAPO1 (1 << 4)
+#define STA_STA1  (1 << 9)
+
+#define DMAC_ENAB (1U << 31)
+
+#define WORD_BITS 32
+#define MAX_BUFFERS 64
+/* Clear of the kernel's channels, the same default as multiservo and servod */
+#define DMA_CHANNEL 14
+
+/* The input is mapped this much at a time, so any file size works */
+#define MAP_WINDOW (64 << 20)
+
+// GPIO setup macros. Always use INP_GPIO(x) before using OUT_GPIO(x) or SET_GPIO_ALT(x,y)
+// The read-modify-writes lock the GPFSEL bank, see reglock.h
+#define INP_GPIO(g) reglock_rmw(gpio, (g)/10, 7<<(((g)%10)*3), 0)
+#define SET_GPIO_ALT(g,a) reglock_rmw(gpio, (g)/10, 0, ((a)<=3?(a)+4:(a)==4?3:2)<<(((g)%10)*3))
+
+enum format {
+    FMT_RAW,
+    FMT_U8,
+    FMT_S16,
+};
+
+static const struct {
+    const char *name;
+    unsigned int bytes;         /* input bytes per DMA word */
+} formats[] = {
+    [FMT_RAW] = { "raw", 4 },
+    [FMT_U8]  = { "u8",  1 },
+    [FMT_S16] = { "s16", 2 },
+};
+
+struct input {
+    int fd;
+    off_t size;
+    off_t pos;                  /* next byte to stream */
+    off_t map_off;              /* file offset of the mapping */
+    uint8_t *map;
+    size_t map_len;
+};
+
+struct ring {
+    struct dma_mem mem;
+    struct dma_cb *cbs;
+    uint32_t *bufs;
+    unsigned int count;         /* buffers */
+    unsigned int words;         /* words per buffer */
+    uint64_t filled;            /* buffers handed to the engine so far */
+    uint64_t consumed;          /* buffers the engine has finished */
+    unsigned int active;        /* buffer the engine was last seen on */
+    uint64_t seen_ns;           /* and when */
+    uint64_t buffer_ns;         /* how long one buffer plays */
+    int last;                   /* the end of the input is in the ring */
+};
+
+struct stream {
+    enum format format;
+    uint32_t range;             /* M/S range, audio formats */
+    volatile uint32_t *pwm;
+    struct dma_channel chan;
+    struct pwmsim sim;
+    int simulated;
+
+    /* statistics */
+    uint64_t words;
+    uint64_t buffers;
+    uint64_t checks;
+    uint64_t occupancy[MAX_BUFFERS + 1];   /* buffers queued, per check */
+    uint64_t underruns;
+    uint64_t gaps;
+    uint64_t fill_ns;           /* wall time spent copying and converting */
+};
+
+static volatile sig_atomic_t running = 1;
+
+static void stop(int sig)
+{
+    running = 0;
+}
+
+static uint64_t wall_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t now_ns(struct stream *s)
+{
+    return s->simulated ? pwmsim_now_ns(&s->sim) : wall_ns();
+}
+
+static uint32_t pwm_rd(struct stream *s, unsigned int reg)
+{
+    return s->simulated ? pwmsim_read(&s->sim, reg) : periph_rd(s->pwm, reg);
+}
+
+static void pwm_wr(struct stream *s, unsigned int reg, uint32_t val)
+{
+    if (s->simulated)
+        pwmsim_write(&s->sim, reg, val);
+    else
+        periph_wr(s->pwm, reg, val);
+}
+
+// let the engine run for ns: sleep, or run the model
+static void stream_wait(struct stream *s, uint64_t ns)
+{
+    struct timespec ts;
+
+    if (s->simulated) {
+        pwmsim_run(&s->sim, ns);
+        return;
+    }
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    nanosleep(&ts, NULL);
+}
+
+// DREQ from the model: let the simulated channel move one word
+static int sim_dreq(void *arg)
+{
+    return dma_sim_run(arg, 1);
+}
+
+static int input_open(struct input *in, const char *path)
+{
+    struct stat st;
+
+    memset(in, 0, sizeof(*in));
+    in->fd = open(path, O_RDONLY);
+    if (in->fd < 0)
+        return -1;
+    if (fstat(in->fd, &st))
+        return -1;
+    in->size = st.st_size;
+    return 0;
+}
+
+// at least len bytes of the input from pos on, or what is left of it,
+// moving the mapping along as needed.  Returns the number of bytes.
+static size_t input_get(struct input *in, size_t len, const uint8_t **p)
+{
+    off_t left = in->size - in->pos;
+
+    if ((off_t)len > left)
+        len = left;
+    if (!len)
+        return 0;
+    if (!in->map || in->pos < in->map_off ||
+            in->pos + (off_t)len > in->map_off + (off_t)in->map_len) {
+        if (in->map)
+            munmap(in->map, in->map_len);
+        in->map_off = in->pos & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+        in->map_len = in->size - in->map_off < MAP_WINDOW ? in->size - in->map_off : MAP_WINDOW;
+        in->map = mmap(NULL, in->map_len, PROT_READ, MAP_PRIVATE, in->fd, in->map_off);
+        if (in->map == MAP_FAILED) {
+            in->map = NULL;
+            return 0;
+        }
+        madvise(in->map, in->map_len, MADV_SEQUENTIAL);
+    }
+    if (in->pos + (off_t)len > in->map_off + (off_t)in->map_len)
+        len = in->map_off + in->map_len - in->pos;
+    *p = in->map + (in->pos - in->map_off);
+    return len;
+}
+
+// copy or convert the next samples into buf, returns the words written
+static unsigned int convert(struct stream *s, struct input *in, uint32_t *buf, unsigned int words)
+{
+    unsigned int bytes = formats[s->format].bytes, n = 0, i;
+    const uint8_t *p = NULL;
+    size_t len;
+
+    while (n < words) {
+        len = input_get(in, (size_t)(words - n) * bytes, &p) / bytes;
+        if (!len)
+            break;
+        switch (s->format) {
+        case FMT_RAW:
+            memcpy(buf + n, p, len * 4);
+            break;
+
+        case FMT_U8:
+            for (i = 0; i < len; i++)
+                buf[n + i] = (uint32_t)p[i] * s->range >> 8;
+            break;
+
+        case FMT_S16:
+            for (i = 0; i < len; i++) {
+                int16_t v;
+                memcpy(&v, p + 2 * i, 2);
+                buf[n + i] = (uint32_t)(v + 32768) * s->range >> 16;
+            }
+            break;
+        }
+        in->pos += len * bytes;
+        n += len;
+    }
+    return n;
+}
+
+static int ring_alloc(struct ring *r, unsigned int count, unsigned int words)
+{
+    memset(r, 0, sizeof(*r));
+    r->count = count;
+    r->words = words;
+    if (dma_mem_alloc(&r->mem, count * (sizeof(*r->cbs) + words * sizeof(uint32_t))))
+        return -1;
+    r->cbs = r->mem.virt;
+    r->bufs = (uint32_t *)(r->cbs + count);
+    return 0;
+}
+
+static uint32_t *ring_buf(struct ring *r, unsigned int i)
+{
+    return r->bufs + (size_t)i * r->words;
+}
+
+// fill buffer filled % count and point its control block at the next one,
+// or end the chain there if the input has run out
+static int ring_fill(struct stream *s, struct ring *r, struct input *in)
+{
+    unsigned int i = r->filled % r->count;
+    struct dma_cb *cb = &r->cbs[i];
+    uint64_t start = wall_ns();
+    unsigned int n;
+
+    n = convert(s, in, ring_buf(r, i), r->words);
+    s->fill_ns += wall_ns() - start;
+    if (!n)
+        return 0;
+
+    cb->ti = DMA_TI_DEST_DREQ | DMA_TI_PERMAP(DMA_DREQ_PWM) | DMA_TI_SRC_INC |
+        DMA_TI_WAIT_RESP | DMA_TI_NO_WIDE_BURSTS;
+    cb->source_ad = dma_bus_addr(&r->mem, ring_buf(r, i));
+    cb->dest_ad = PERIPH_BUS_ADDR(PWM_OFFSET, PWM_FIF);
+    cb->txfr_len = n * sizeof(uint32_t);
+    cb->stride = 0;
+    if (n == r->words && in->size - in->pos >= formats[s->format].bytes) {
+        cb->nextconbk = dma_bus_addr(&r->mem, &r->cbs[(i + 1) % r->count]);
+    } else {
+        cb->nextconbk = DMA_CB_END;
+        r->last = 1;
+    }
+    s->words += n;
+    s->buffers++;
+    r->filled++;
+    return 1;
+}
+
+// follow the engine round the ring; 1 once it has reached the end.  The
+// control block only says where in the ring the engine is, the time since
+// the last look says how many laps it went.
+static int ring_update(struct stream *s, struct ring *r)
+{
+    uint32_t cb = dma_current_cb(&s->chan);
+    uint64_t t = now_ns(s);
+    double laps;
+    unsigned int i, moved;
+
+    if (cb == DMA_CB_END) {
+        r->consumed = r->filled;
+        return 1;
+    }
+    i = (cb - dma_bus_addr(&r->mem, r->cbs)) / sizeof(*r->cbs);
+    moved = (i + r->count - r->active) % r->count;
+    laps = ((double)(t - r->seen_ns) / r->buffer_ns - moved) / r->count + 0.5;
+    if (laps >= 1)
+        moved += (unsigned int)laps * r->count;
+    r->consumed += moved;
+    r->active = i;
+    r->seen_ns = t;
+
+    /* The engine is on a buffer that was never refilled: it is replaying */
+    if (r->consumed >= r->filled && !r->last) {
+        s->underruns += r->consumed - r->filled + 1;
+        r->filled = r->consumed + 1;
+    }
+    return 0;
+}
+
+static void stream(struct stream *s, struct ring *r, struct input *in)
+{
+    uint64_t queued;
+
+    while (running) {
+        stream_wait(s, r->buffer_ns / 2);
+        /* Past the end of the chain the FIFO running dry is no dropout */
+        if (ring_update(s, r))
+            return;
+        if (pwm_rd(s, PWM_STA) & STA_GAPO1) {
+            s->gaps++;
+            pwm_wr(s, PWM_STA, STA_GAPO1);
+        }
+
+        queued = r->filled - r->consumed;
+        s->occupancy[queued < r->count ? queued : r->count]++;
+        s->checks++;
+
+        /* Everything but the buffer the engine is on is ours to refill */
+        while (!r->last && r->filled < r->consumed + r->count)
+            if (!ring_fill(s, r, in))
+                break;
+    }
+}
+
+static void report(struct stream *s, struct ring *r, uint64_t elapsed_ns, uint64_t wall)
+{
+    struct rusage ru;
+    uint64_t total = 0, fills = s->buffers ? s->buffers : 1;
+    unsigned int i, min = r->count, max = 0;
+    double cpu;
+
+    getrusage(RUSAGE_SELF, &ru);
+    cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+        ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+
+    printf("%llu words in %.3f s%s, %llu buffers of %u words\n",
+            (unsigned long long)s->words, elapsed_ns / 1e9, s->simulated ? " simulated" : "",
+            (unsigned long long)s->buffers, r->words);
+    for (i = 0; i <= r->count; i++) {
+        if (!s->occupancy[i])
+            continue;
+        if (i < min)
+            min = i;
+        max = i;
+        total += (uint64_t)i * s->occupancy[i];
+    }
+    if (s->checks) {
+        printf("ring occupancy over %llu checks: min %u, mean %.2f, max %u of %u buffers\n",
+                (unsigned long long)s->checks, min, (double)total / s->checks, max, r->count);
+        for (i = min; i <= max; i++)
+            printf("  %2u queued: %5.1f%%\n", i, 100.0 * s->occupancy[i] / s->checks);
+    }
+    printf("%llu underruns (stale buffers played), %llu gaps (GAPO1)\n",
+            (unsigned long long)s->underruns, (unsigned long long)s->gaps);
+    printf("refill: %.1f us per buffer, %.1f MB/s of input\n",
+            s->fill_ns / 1e3 / fills,
+            s->fill_ns ? (double)s->words * formats[s->format].bytes * 1e3 / s->fill_ns : 0);
+    if (s->simulated)
+        printf("%.3f s of wall time\n", wall / 1e9);
+    else
+        printf("CPU time %.3f s, %.1f%% of one core\n", cpu,
+                elapsed_ns ? 100.0 * cpu * 1e9 / elapsed_ns : 0);
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [-F raw|u8|s16] [-f rate] [-R range] [-n buffers] [-w words] [-d channel] file\n", prog);
+    printf("\t-F  input format (default raw)\n");
+    printf("\t-f  bit rate for raw, sample rate for audio (default 1000000 or 44100)\n");
+    printf("\t-R  audio: pulse width range in PWM clocks (default 256)\n");
+    printf("\t-n  DMA buffers in the ring (default 8)\n");
+    printf("\t-w  words per buffer (default 4096)\n");
+    printf("\t-d  DMA channel (default %d)\n", DMA_CHANNEL);
+}
+
+int main(int argc, char **argv)
+{
+    struct clk_request clock = { .clock = CLK_PWM, .enable = 1 };
+    struct stream s;
+    struct ring r;
+    struct input in;
+    struct sigaction sa;
+    volatile uint32_t *gpio;
+    unsigned int count = 8, words = 4096, i;
+    uint64_t start, wall;
+    double rate = 0, word_hz;
+    int ch, dma_channel = DMA_CHANNEL, ret = 1;
+
+    memset(&s, 0, sizeof(s));
+    s.range = 256;
+
+    while ((ch = getopt(argc, argv, "F:f:R:n:w:d:")) != -1) {
+        switch (ch) {
+        case 'F':
+            for (i = 0; i < sizeof(formats) / sizeof(*formats); i++)
+                if (!strcmp(optarg, formats[i].name))
+                    break;
+            if (i == sizeof(formats) / sizeof(*formats)) {
+                fprintf(stderr, "Unknown format \"%s\"\n", optarg);
+                return 1;
+            }
+            s.format = i;
+            break;
+
+        case 'f':
+            rate = atof(optarg);
+            break;
+
+        case 'R':
+            s.range = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'n':
+            count = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'w':
+            words = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'd':
+            dma_channel = strtoul(optarg, NULL, 0);
+            break;
+
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (count < 2 || count > MAX_BUFFERS || !words || s.range < 2) {
+        fprintf(stderr, "Need 2 to %d buffers, a word per buffer and a range of 2 or more\n",
+                MAX_BUFFERS);
+        return 1;
+    }
+    if (!rate)
+        rate = s.format == FMT_RAW ? 1000000 : 44100;
+
+    if (input_open(&in, argv[optind])) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    /* Raw words take 32 clocks each, audio samples range clocks */
+    if (clk_solve(s.format == FMT_RAW ? rate : rate * s.range, 0, &clock.setting, NULL)) {
+        fprintf(stderr, "No PWM clock for %g Hz\n", rate);
+        return 1;
+    }
+    word_hz = clock.setting.hz / (s.format == FMT_RAW ? WORD_BITS : s.range);
+
+    s.pwm = periph_map(PWM_OFFSET);
+    s.simulated = !pwmsim_init(&s.sim);
+    gpio = periph_map(GPIO_OFFSET);
+    if (ring_alloc(&r, count, words)) {
+        perror("can't set up DMA");
+        return 1;
+    }
+    if (dma_channel_open(&s.chan, dma_channel)) {
+        perror("can't set up DMA");
+        goto out;
+    }
+    r.buffer_ns = words * 1e9 / word_hz;
+    if (s.simulated) {
+        dma_sim_sink(PERIPH_BUS_ADDR(PWM_OFFSET, PWM_FIF), pwmsim_fifo_sink, &s.sim);
+        s.sim.dreq = sim_dreq;
+        s.sim.dreq_arg = &s.chan;
+    }
+
+    // PWM1 on GPIO18
+    INP_GPIO(18);
+    SET_GPIO_ALT(18, 5);
+
+    // stop the channel before touching the clock
+    pwm_wr(&s, PWM_CTL, 0);
+    periph_wait(s.pwm, PWM_STA, STA_STA1, 0, PERIPH_SETTLE_NS);
+    if (clk_set(&clock, 1)) {
+        perror("Unable to set the PWM clock");
+        goto out;
+    }
+
+    // fill the whole ring before the engine starts
+    while (!r.last && r.filled < r.count)
+        if (!ring_fill(&s, &r, &in))
+            break;
+    if (!r.filled) {
+        fprintf(stderr, "%s: no samples\n", argv[optind]);
+        goto out;
+    }
+
+    // clear the FIFO, then let it request data via DREQ
+    pwm_wr(&s, PWM_RNG1, s.format == FMT_RAW ? WORD_BITS : s.range);
+    pwm_wr(&s, PWM_CTL, CTL_CLRF1);
+    pwm_wr(&s, PWM_DMAC, DMAC_ENAB | (7 << 8) | 7);
+    pwm_wr(&s, PWM_STA, ~0);
+    dma_start(&s.chan, dma_bus_addr(&r.mem, r.cbs));
+    pwm_wr(&s, PWM_CTL, CTL_PWEN1 | CTL_USEF1 | (s.format == FMT_RAW ? CTL_MODE1 : CTL_MSEN1));
+
+    sa.sa_handler = stop;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    wall = wall_ns();
+    start = now_ns(&s);
+    r.seen_ns = start;
+    stream(&s, &r, &in);
+
+    // let the FIFO run out, then stop
+    while (running && !(pwm_rd(&s, PWM_STA) & STA_EMPT1))
+        stream_wait(&s, 8 * 1e9 / word_hz);
+    stream_wait(&s, 1e9 / word_hz);
+    pwm_wr(&s, PWM_CTL, 0);
+    pwm_wr(&s, PWM_DMAC, 0);
+    dma_stop(&s.chan);
+
+    report(&s, &r, now_ns(&s) - start, wall_ns() - wall);
+    ret = 0;
+
+out:
+    // the VideoCore memory outlives the process unless it is given back
+    dma_mem_free(&r.mem);
+    return ret;
+}
@@ -0,0 +1,285 @@
+// High-rate PWM status sampler
+//
+// Polls PWM.STA (or any registers named with -r) in a tight loop and pushes
+// timestamped samples into a preallocated lock-free ring.  A writer thread
+// drains the ring to a file, so the sampling loop never blocks on I/O and
+// short FIFO underruns (EMPT1) and gaps (GAPO1-4) show up in the log.
+//
+// compile with "gcc -O2 pwm-sample.c periph.c regs.c -o pwm-sample -lpthread",
+// test with "./pwm-sample -t 1 -o sta.log" (needs to be root for /dev/mem access)
+//
+// The log is a header ("RPIW", register count, then the window offset of
+// each register as uint32) followed by records of a uint64 CLOCK_MONOTONIC
+// timestamp in ns and one uint32 per register, all in host byte order.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <unistd.h>
+
+#include "periph.h"
+#include "regs.h"
+#include "ring.h"
+
+#define MAX_SAMPLE_REGS 8
+#define RING_SLOTS (1 << 20)
+
+/* Sticky error flags of PWM.STA: BERR, GAPO1-4, RERR1, WERR1 */
+#define STA_ERROR_FLAGS 0x1fc
+
+struct sample {
+    uint64_t t_ns;
+    uint32_t values[MAX_SAMPLE_REGS];
+};
+
+struct sampler {
+    const struct reg_map *map;
+    int nregs;
+    volatile uint32_t *mem[MAX_SAMPLE_REGS];
+    unsigned int reg_index[MAX_SAMPLE_REGS];    /* word index inside mem */
+    uint32_t addr[MAX_SAMPLE_REGS];             /* window offset, for the log */
+    int clear_sta;                              /* which register is PWM.STA, or -1 */
+    int changes_only;
+
+    struct ring *ring;
+    FILE *out;
+    volatile int done;
+
+    uint64_t samples;
+    uint64_t stored;
+    uint64_t dropped;
+    uint64_t written;
+};
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int add_reg(struct sampler *s, const char *name)
+{
+    const struct reg_map *map = s->map;
+    const struct reg_block *block;
+    const struct reg_desc *reg;
+    struct reg_ref ref;
+
+    if (s->nregs >= MAX_SAMPLE_REGS) {
+        fprintf(stderr, "At most %d registers can be sampled\n", MAX_SAMPLE_REGS);
+        return -1;
+    }
+    if (reg_lookup(map, name, strlen(name), &ref) || ref.field >= 0) {
+        fprintf(stderr, "Unknown register %s, expected BLOCK.REG\n", name);
+        return -1;
+    }
+
+    block = &map->blocks[ref.block];
+    reg = &map->regs[ref.reg];
+    if (!strcmp(name, "PWM.STA"))
+        s->clear_sta = s->nregs;
+    s->mem[s->nregs] = periph_map(block->offset);
+    s->reg_index[s->nregs] = reg->offset / 4;
+    s->addr[s->nregs] = block->offset + reg->offset;
+    s->nregs++;
+    return 0;
+}
+
+static void *writer_thread(void *arg)
+{
+    struct sampler *s = arg;
+    size_t record = sizeof(uint64_t) + s->nregs * sizeof(uint32_t);
+    const struct sample *sample;
+
+    for (;;) {
+        while ((sample = ring_peek(s->ring)) != NULL) {
+            if (s->out && fwrite(sample, record, 1, s->out) == 1)
+                s->written++;
+            ring_release(s->ring);
+        }
+        if (s->done && !ring_count(s->ring))
+            break;
+        usleep(1000);
+    }
+    return NULL;
+}
+
+// the sampling loop: no allocation, no locks, no system calls
+static void sample_loop(struct sampler *s, uint64_t max_samples, uint64_t end_ns)
+{
+    uint32_t last[MAX_SAMPLE_REGS];
+    struct sample *slot;
+    uint64_t t;
+    int i, changed;
+
+    memset(last, 0xff, sizeof(last));
+    for (;;) {
+        t = now_ns();
+        if (t >= end_ns || s->samples >= max_samples)
+            break;
+        s->samples++;
+
+        slot = ring_reserve(s->ring);
+        if (!slot) {
+            s->dropped++;
+            continue;
+        }
+
+        changed = !s->changes_only;
+        for (i = 0; i < s->nregs; i++) {
+            slot->values[i] = periph_rd(s->mem[i], s->reg_index[i]);
+            changed |= slot->values[i] != last[i];
+            last[i] = slot->values[i];
+        }
+        if (s->clear_sta >= 0 && (slot->values[s->clear_sta] & STA_ERROR_FLAGS))
+            periph_wr(s->mem[s->clear_sta], s->reg_index[s->clear_sta],
+                    slot->values[s->clear_sta] & STA_ERROR_FLAGS);
+
+        if (changed) {
+            slot->t_ns = t;
+            ring_commit(s->ring);
+            s->stored++;
+        }
+    }
+}
+
+static int write_header(struct sampler *s)
+{
+    uint32_t count = s->nregs;
+
+    if (fwrite("RPIW", 4, 1, s->out) != 1 ||
+            fwrite(&count, sizeof(count), 1, s->out) != 1 ||
+            fwrite(s->addr, sizeof(*s->addr), s->nregs, s->out) != (size_t)s->nregs)
+        return -1;
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [-r BLOCK.REG]... [-n samples] [-t seconds] [-o file] [-c] [-x] [-p cpu]\n",
+            prog);
+    printf("\t-r  register to sample, may be repeated (default PWM.STA)\n");
+    printf("\t-n  stop after this many samples\n");
+    printf("\t-t  stop after this many seconds (default 1)\n");
+    printf("\t-o  write samples to this file\n");
+    printf("\t-c  only store samples where a register changed\n");
+    printf("\t-x  clear the sticky PWM.STA error flags after each sample\n");
+    printf("\t-p  pin the sampling loop to this CPU\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct sampler s;
+    pthread_t writer;
+    uint64_t max_samples = UINT64_MAX;
+    double seconds = 1.0;
+    uint64_t start, elapsed;
+    int clear = 0, cpu = -1;
+    int ch;
+
+    memset(&s, 0, sizeof(s));
+    s.map = reg_map_load(NULL);
+    if (!s.map) {
+        perror("Unable to load the register map");
+        return 1;
+    }
+    s.clear_sta = -1;
+
+    while ((ch = getopt(argc, argv, "r:n:t:o:cxp:")) != -1) {
+        switch (ch) {
+        case 'r':
+            if (add_reg(&s, optarg))
+                return 1;
+            break;
+
+        case 'n':
+            max_samples = strtoull(optarg, NULL, 0);
+            break;
+
+        case 't':
+            seconds = strtod(optarg, NULL);
+            break;
+
+        case 'o':
+            if ((s.out = fopen(optarg, "wb")) == NULL) {
+                perror("Unable to open output");
+                return 1;
+            }
+            break;
+
+        case 'c':
+            s.changes_only = 1;
+            break;
+
+        case 'x':
+            clear = 1;
+            break;
+
+        case 'p':
+            cpu = strtoul(optarg, NULL, 0);
+            break;
+
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!s.nregs && add_reg(&s, "PWM.STA"))
+        return 1;
+    if (!clear)
+        s.clear_sta = -1;
+
+    if (s.out) {
+        /* Large stdio buffer so the writer does few, big writes */
+        setvbuf(s.out, NULL, _IOFBF, 1 << 20);
+        if (write_header(&s)) {
+            perror("Unable to write output");
+            return 1;
+        }
+    }
+
+    s.ring = malloc(ring_bytes(RING_SLOTS, sizeof(struct sample)));
+    if (!s.ring) {
+        perror("Unable to allocate sample ring");
+        return 1;
+    }
+    ring_init(s.ring, RING_SLOTS, sizeof(struct sample));
+    /* Fault the ring in now rather than in the sampling loop */
+    memset(s.ring->slots, 0, (size_t)RING_SLOTS * sizeof(struct sample));
+
+    if (pthread_create(&writer, NULL, writer_thread, &s)) {
+        perror("Unable to start writer thread");
+        return 1;
+    }
+
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set))
+            perror("Unable to pin sampler");
+    }
+
+    start = now_ns();
+    sample_loop(&s, max_samples, start + (uint64_t)(seconds * 1e9));
+    elapsed = now_ns() - start;
+
+    s.done = 1;
+    pthread_join(writer, NULL);
+    if (s.out)
+        fclose(s.out);
+
+    printf("%llu samples in %.3f s: %.3f MS/s, %llu stored, %llu written, %llu dropped\n",
+            (unsigned long long)s.samples, elapsed / 1e9,
+            elapsed ? s.samples * 1e3 / elapsed : 0.0,
+            (unsigned long long)s.stored, (unsigned long long)s.written,
+            (unsigned long long)s.dropped);
+    return 0;
+}
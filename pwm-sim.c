@@ -0,0 +1,163 @@
+// Simulated PWM output
+//
+// Runs the PWM block as programmed on a simulated backend through the
+// software model in pwmsim.c, and reports what the pins would do: periods,
+// edges, duty cycle and FIFO gaps per channel.  The waveform can be written
+// as a VCD file for waveform viewers like GTKWave.
+//
+// compile with "gcc -O2 pwm-sim.c pwmsim.c clkman.c periph.c reglock.c -o pwm-sim -lpthread -lrt -lm",
+// test with
+//   export RPI_PERIPH=file:/tmp/periph
+//   ./pwm-clk pwm=16000
+//   ./pwm -w PWM.RNG1.RNG=320 -w PWM.DAT1.DAT=0xffff0000 -w PWM.CTL.MODE1=1 -w PWM.CTL.PWEN1=1
+//   ./pwm-sim -t 60 -o servo.vcd
+//
+// The file backend keeps the registers between runs, so any tool can
+// program the block and pwm-sim shows the result.  Simulated time runs as
+// fast as the model can go; the report says how much faster than real time.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include "periph.h"
+#include "clkman.h"
+#include "pwmsim.h"
+
+/* Simulate in slices, so a long run doesn't need to fit one call */
+#define SLICE_NS 100000000ULL
+
+struct vcd {
+    FILE *f;
+    uint64_t last_t;            /* time of the last timestamp written */
+};
+
+// VCD identifier for a channel: one printable character from '!'
+static char vcd_id(int channel)
+{
+    return '!' + channel;
+}
+
+static void vcd_header(struct vcd *v, const struct pwmsim *sim)
+{
+    int c;
+
+    fprintf(v->f, "$comment rpi-tools pwm-sim, simulated PWM output $end\n");
+    fprintf(v->f, "$timescale 1ns $end\n");
+    fprintf(v->f, "$scope module pwm $end\n");
+    for (c = 0; c < PWMSIM_CHANNELS; c++)
+        fprintf(v->f, "$var wire 1 %c pwm%d $end\n", vcd_id(c), c + 1);
+    fprintf(v->f, "$upscope $end\n$enddefinitions $end\n");
+
+    fprintf(v->f, "#0\n$dumpvars\n");
+    for (c = 0; c < PWMSIM_CHANNELS; c++)
+        fprintf(v->f, "%d%c\n", sim->ch[c].level, vcd_id(c));
+    fprintf(v->f, "$end\n");
+}
+
+static void vcd_edge(void *arg, int channel, uint64_t t_ns, int level)
+{
+    struct vcd *v = arg;
+
+    if (t_ns != v->last_t)
+        fprintf(v->f, "#%llu\n", (unsigned long long)t_ns);
+    fprintf(v->f, "%d%c\n", level, vcd_id(channel));
+    v->last_t = t_ns;
+}
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void report(const struct pwmsim *sim, uint64_t wall_ns)
+{
+    double sim_s = sim->t_ps / 1e12;
+    int c;
+
+    if (sim->clock_hz)
+        printf("PWM clock: %.3f Hz\n", sim->clock_hz);
+    else
+        printf("PWM clock: stopped\n");
+    for (c = 0; c < PWMSIM_CHANNELS; c++) {
+        const struct pwmsim_channel *ch = &sim->ch[c];
+
+        printf("channel %d: %llu periods, %llu edges, %.3f%% high, %llu gaps\n", c + 1,
+                (unsigned long long)ch->periods, (unsigned long long)ch->edges,
+                sim->t_ps ? 100.0 * ch->high_ps / sim->t_ps : 0,
+                (unsigned long long)ch->gaps);
+    }
+    printf("FIFO: %llu words, %llu overruns\n",
+            (unsigned long long)sim->fifo_words, (unsigned long long)sim->overruns);
+    printf("%.3f s simulated in %.3f s, %.0fx real time\n", sim_s, wall_ns / 1e9,
+            wall_ns ? sim_s * 1e9 / wall_ns : 0);
+}
+
+int main(int argc, char **argv)
+{
+    struct pwmsim sim;
+    struct vcd vcd = { 0 };
+    const char *out = NULL;
+    double seconds = 1;
+    uint64_t left, start;
+    int ch;
+
+    while ((ch = getopt(argc, argv, "t:o:")) != -1) {
+        switch (ch) {
+        case 't':
+            seconds = atof(optarg);
+            break;
+
+        case 'o':
+            out = optarg;
+            break;
+
+        default:
+            printf("Usage: %s [-t seconds] [-o file.vcd]\n", argv[0]);
+            printf("\t-t  simulated time to run (default 1)\n");
+            printf("\t-o  write the waveform as VCD to this file\n");
+            return 1;
+        }
+    }
+    if (seconds <= 0) {
+        fprintf(stderr, "Need a positive run time\n");
+        return 1;
+    }
+
+    if (pwmsim_init(&sim)) {
+        perror("The PWM model needs a simulated backend (RPI_PERIPH=anon or file:PATH)");
+        return 1;
+    }
+    if (out) {
+        vcd.f = fopen(out, "w");
+        if (!vcd.f) {
+            perror("Unable to open VCD file");
+            return 1;
+        }
+        vcd_header(&vcd, &sim);
+        sim.edge = vcd_edge;
+        sim.edge_arg = &vcd;
+    }
+
+    start = now_ns();
+    for (left = (uint64_t)(seconds * 1e9); left; ) {
+        uint64_t ns = left < SLICE_NS ? left : SLICE_NS;
+        pwmsim_run(&sim, ns);
+        left -= ns;
+    }
+    if (vcd.f) {
+        fprintf(vcd.f, "#%llu\n", (unsigned long long)pwmsim_now_ns(&sim));
+        if (ferror(vcd.f) | fclose(vcd.f)) {
+            perror("Unable to write VCD");
+            return 1;
+        }
+    }
+    report(&sim, now_ns() - start);
+    return 0;
+}
@@ -0,0 +1,421 @@
+// Stream serializer data to PWM channel 1 through the FIFO, fed by the CPU
+//
+// Reads 32-bit sample words (raw, host byte order) from a file or a pipe
+// through a large read buffer and keeps the 8-word PWM FIFO topped up.  The
+// channel runs in serializer mode, one FIFO word per 32 bit clocks, on
+// GPIO18.
+//
+// compile with "gcc -O2 pwm-stream.c pwmsim.c clkman.c periph.c reglock.c -o pwm-stream -lpthread -lrt -lm",
+// test with "./pwm-stream -f 1000000 samples.bin" (needs to be root for /dev/mem
+// access) or "head -c 4000000 /dev/urandom | RPI_PERIPH=anon ./pwm-stream -"
+//
+// The refill loop costs as little CPU as the drain rate allows.  It
+// measures how fast the FIFO drains (every refill tops the FIFO off until
+// STA.FULL1, so the words written are the words drained since the last
+// one), sleeps until the FIFO is predicted to be down to a low-water mark,
+// and then writes that many words as a blind burst with no STA reads in
+// between.  Only the last few words are written one at a time against
+// FULL1.  When the FIFO is found empty (STA.EMPT1) the low-water mark goes
+// up; the time the kernel oversleeps is measured and slept less.  Channel
+// gaps (STA.GAPO1) and lost writes (STA.WERR1) are counted from the sticky
+// flags.
+//
+// On a simulated backend (RPI_PERIPH=anon or file:PATH) the PWM model in
+// pwmsim.c drains the FIFO, and the waits advance simulated time instead
+// of sleeping, so a long stream is checked in a moment.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include <unistd.h>
+
+#include "periph.h"
+#include "reglock.h"
+#include "clkman.h"
+#include "pwmsim.h"
+
+#define PWM_CTL  0
+#define PWM_STA  1
+#define PWM_DMAC 2
+#define PWM_RNG1 4
+#define PWM_FIF  6
+
+#define CTL_PWEN1 (1 << 0)
+#define CTL_MODE1 (1 << 1)
+#define CTL_RPTL1 (1 << 2)
+#define CTL_USEF1 (1 << 5)
+#define CTL_CLRF1 (1 << 6)
+
+#define STA_FULL1 (1 << 0)
+#define STA_EMPT1 (1 << 1)
+#define STA_WERR1 (1 << 2)
+#define STA_GAPO1 (1 << 4)
+#define STA_STA1  (1 << 9)
+
+#define FIFO_DEPTH 8
+#define WORD_BITS 32
+
+/* Below this a sleep costs more than it saves: poll STA instead */
+#define MIN_SLEEP_NS 50000
+/* What one STA poll costs in simulated time */
+#define SIM_POLL_NS 1000
+
+// GPIO setup macros. Always use INP_GPIO(x) before using OUT_GPIO(x) or SET_GPIO_ALT(x,y)
+// The read-modify-writes lock the GPFSEL bank, see reglock.h
+#define INP_GPIO(g) reglock_rmw(gpio, (g)/10, 7<<(((g)%10)*3), 0)
+#define SET_GPIO_ALT(g,a) reglock_rmw(gpio, (g)/10, 0, ((a)<=3?(a)+4:(a)==4?3:2)<<(((g)%10)*3))
+
+struct input {
+    int fd;
+    uint8_t *buf;               /* byte ring, size a multiple of 4 */
+    size_t size, head, count;
+    int eof;
+    uint64_t reads;
+};
+
+struct stream {
+    volatile uint32_t *pwm;
+    struct pwmsim sim;
+    int simulated;
+
+    double rate;                /* observed drain rate, words per ns */
+    double win_words, win_ns;   /* decaying sums the rate comes from */
+    unsigned int low_water;     /* words left in the FIFO when we wake */
+    double late_ns;             /* how much longer sleeps take than asked */
+    uint64_t full_ns;           /* when the FIFO was last topped off */
+
+    /* statistics */
+    uint64_t words;
+    uint64_t refills;
+    uint64_t burst_words;       /* written blind, without checking FULL1 */
+    uint64_t sta_reads;
+    uint64_t sleeps;
+    uint64_t underruns;         /* FIFO found empty */
+    uint64_t gaps;              /* channel ran out of data */
+    uint64_t write_errors;      /* words written to a full FIFO */
+};
+
+static volatile sig_atomic_t running = 1;
+
+static void stop(int sig)
+{
+    running = 0;
+}
+
+static uint64_t now_ns(struct stream *s)
+{
+    struct timespec ts;
+
+    if (s->simulated)
+        return pwmsim_now_ns(&s->sim);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint32_t pwm_rd(struct stream *s, unsigned int reg)
+{
+    return s->simulated ? pwmsim_read(&s->sim, reg) : periph_rd(s->pwm, reg);
+}
+
+static void pwm_wr(struct stream *s, unsigned int reg, uint32_t val)
+{
+    if (s->simulated)
+        pwmsim_write(&s->sim, reg, val);
+    else
+        periph_wr(s->pwm, reg, val);
+}
+
+static uint32_t sta(struct stream *s)
+{
+    s->sta_reads++;
+    return pwm_rd(s, PWM_STA);
+}
+
+// let the FIFO drain for ns: sleep, or run the model
+static void drain_wait(struct stream *s, uint64_t ns)
+{
+    struct timespec ts;
+    uint64_t start;
+
+    if (s->simulated) {
+        pwmsim_run(&s->sim, ns > SIM_POLL_NS ? ns : SIM_POLL_NS);
+        return;
+    }
+    if (ns < s->late_ns + MIN_SLEEP_NS)
+        return;
+    ns -= s->late_ns;
+    start = now_ns(s);
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    nanosleep(&ts, NULL);
+    s->late_ns += ((double)(now_ns(s) - start) - ns - s->late_ns) / 8;
+    if (s->late_ns < 0)
+        s->late_ns = 0;
+    s->sleeps++;
+}
+
+static int input_open(struct input *in, const char *path, size_t size)
+{
+    memset(in, 0, sizeof(*in));
+    in->fd = strcmp(path, "-") ? open(path, O_RDONLY) : 0;
+    if (in->fd < 0)
+        return -1;
+    in->size = size & ~(size_t)3;
+    in->buf = malloc(in->size);
+    return in->buf ? 0 : -1;
+}
+
+// one read() once the buffer is half empty, so a pipe never stalls us long
+static int input_fill(struct input *in)
+{
+    size_t tail, space;
+    ssize_t n;
+
+    if (in->eof || in->count > in->size / 2)
+        return 0;
+    tail = (in->head + in->count) % in->size;
+    space = tail >= in->head ? in->size - tail : in->head - tail;
+    n = read(in->fd, in->buf + tail, space);
+    if (n < 0)
+        return errno == EINTR ? 0 : -1;
+    if (n == 0)
+        in->eof = 1;
+    in->count += n;
+    in->reads++;
+    return 0;
+}
+
+static inline unsigned int input_words(const struct input *in)
+{
+    return in->count / 4;
+}
+
+// words never straddle the end of the ring: head moves in steps of 4
+static inline uint32_t input_word(struct input *in)
+{
+    uint32_t word;
+
+    memcpy(&word, in->buf + in->head, 4);
+    in->head = (in->head + 4) % in->size;
+    in->count -= 4;
+    return word;
+}
+
+// top the FIFO off: a blind burst of what has surely drained, then one
+// word at a time until FULL1.  Returns the number of words written.
+static unsigned int refill(struct stream *s, struct input *in, unsigned int burst)
+{
+    unsigned int n = 0;
+
+    if (burst > input_words(in))
+        burst = input_words(in);
+    for (; n < burst; n++)
+        pwm_wr(s, PWM_FIF, input_word(in));
+    s->burst_words += burst;
+    while (input_words(in) && !(sta(s) & STA_FULL1)) {
+        pwm_wr(s, PWM_FIF, input_word(in));
+        n++;
+    }
+    s->words += n;
+    return n;
+}
+
+static void check_flags(struct stream *s, uint32_t status)
+{
+    uint32_t clear = status & (STA_GAPO1 | STA_WERR1);
+
+    if (status & STA_GAPO1)
+        s->gaps++;
+    if (status & STA_WERR1)
+        s->write_errors++;
+    if (clear)
+        pwm_wr(s, PWM_STA, clear);
+}
+
+static void stream(struct stream *s, struct input *in)
+{
+    while (running) {
+        uint64_t t, sleep_ns;
+        unsigned int burst, n;
+        uint32_t status;
+        int empty;
+
+        if (input_fill(in)) {
+            perror("Unable to read samples");
+            return;
+        }
+        if (!input_words(in)) {
+            if (in->eof)
+                return;
+            continue;
+        }
+
+        /* Sleep until the FIFO should be down to the low-water mark */
+        sleep_ns = (FIFO_DEPTH - s->low_water) / s->rate;
+        drain_wait(s, sleep_ns);
+
+        status = sta(s);
+        check_flags(s, status);
+        empty = !!(status & STA_EMPT1);
+        if (empty) {
+            s->underruns++;
+            if (s->low_water < FIFO_DEPTH - 2)
+                s->low_water++;
+        }
+
+        /* What drained since the last top-off, less a word for safety */
+        t = now_ns(s);
+        burst = (unsigned int)((t - s->full_ns) * s->rate + 0.5);
+        burst = burst > FIFO_DEPTH ? FIFO_DEPTH - 1 : burst ? burst - 1 : 0;
+        n = refill(s, in, burst);
+        s->refills++;
+
+        /* A topped-off FIFO says how much drained, an empty one only a bound */
+        if (!empty && input_words(in) && t > s->full_ns) {
+            s->win_words += n - s->win_words / 16;
+            s->win_ns += (t - s->full_ns) - s->win_ns / 16;
+            if (s->win_words >= FIFO_DEPTH)
+                s->rate = s->win_words / s->win_ns;
+        }
+        s->full_ns = now_ns(s);
+    }
+}
+
+static void report(struct stream *s, struct input *in, uint64_t elapsed_ns)
+{
+    struct rusage ru;
+    double cpu;
+
+    getrusage(RUSAGE_SELF, &ru);
+    cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+        ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+
+    printf("%llu words in %.3f s%s, %.0f words/s (drain rate %.0f words/s)\n",
+            (unsigned long long)s->words, elapsed_ns / 1e9, s->simulated ? " simulated" : "",
+            elapsed_ns ? s->words * 1e9 / elapsed_ns : 0, s->rate * 1e9);
+    printf("%llu refills, %.2f words each, %.0f%% written blind, %.2f STA reads per word\n",
+            (unsigned long long)s->refills,
+            s->refills ? (double)s->words / s->refills : 0,
+            s->words ? 100.0 * s->burst_words / s->words : 0,
+            s->words ? (double)s->sta_reads / s->words : 0);
+    printf("%llu underruns (EMPT1), %llu gaps (GAPO1), %llu write errors (WERR1), low water %u\n",
+            (unsigned long long)s->underruns, (unsigned long long)s->gaps,
+            (unsigned long long)s->write_errors, s->low_water);
+    printf("%llu reads of the input, %llu sleeps, oversleep %.1f us\n",
+            (unsigned long long)in->reads, (unsigned long long)s->sleeps, s->late_ns / 1000);
+    if (!s->simulated)
+        printf("CPU time %.3f s, %.1f%% of one core\n", cpu,
+                elapsed_ns ? 100.0 * cpu * 1e9 / elapsed_ns : 0);
+}
+
+int main(int argc, char **argv)
+{
+    struct clk_request clock = { .clock = CLK_PWM, .enable = 1 };
+    struct stream s;
+    struct input in;
+    struct sigaction sa;
+    volatile uint32_t *gpio;
+    double hz = 1000000;
+    size_t buf_size = 1 << 20;
+    uint32_t ctl = CTL_PWEN1 | CTL_MODE1 | CTL_USEF1;
+    uint64_t start;
+    int ch;
+
+    while ((ch = getopt(argc, argv, "f:b:r")) != -1) {
+        switch (ch) {
+        case 'f':
+            hz = atof(optarg);
+            break;
+
+        case 'b':
+            buf_size = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'r':
+            ctl |= CTL_RPTL1;
+            break;
+
+        default:
+            goto usage;
+        }
+    }
+    if (optind != argc - 1) {
+usage:
+        printf("Usage: %s [-f bit rate] [-b buffer bytes] [-r] file|-\n", argv[0]);
+        printf("\t-f  serializer bit rate in Hz (default 1000000)\n");
+        printf("\t-b  read buffer size (default 1 MiB)\n");
+        printf("\t-r  repeat the last word when the FIFO runs dry, instead of a gap\n");
+        return 1;
+    }
+    if (buf_size < 4096) {
+        fprintf(stderr, "Read buffer too small\n");
+        return 1;
+    }
+    if (input_open(&in, argv[optind], buf_size)) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if (clk_solve(hz, 0, &clock.setting, NULL)) {
+        fprintf(stderr, "No PWM clock for %g Hz\n", hz);
+        return 1;
+    }
+
+    memset(&s, 0, sizeof(s));
+    s.pwm = periph_map(PWM_OFFSET);
+    s.simulated = !pwmsim_init(&s.sim);
+    gpio = periph_map(GPIO_OFFSET);
+
+    // PWM1 on GPIO18
+    INP_GPIO(18);
+    SET_GPIO_ALT(18, 5);
+
+    // stop the channel before touching the clock
+    pwm_wr(&s, PWM_CTL, 0);
+    periph_wait(s.pwm, PWM_STA, STA_STA1, 0, PERIPH_SETTLE_NS);
+    if (clk_set(&clock, 1)) {
+        perror("Unable to set the PWM clock");
+        return 1;
+    }
+
+    // one FIFO word per 32 bit clocks, no DMA
+    pwm_wr(&s, PWM_RNG1, WORD_BITS);
+    pwm_wr(&s, PWM_DMAC, 0);
+    pwm_wr(&s, PWM_CTL, CTL_CLRF1);
+    pwm_wr(&s, PWM_STA, ~0);
+
+    // the expected rate is where the estimate starts
+    s.rate = clock.setting.hz / WORD_BITS / 1e9;
+    s.low_water = 2;
+
+    sa.sa_handler = stop;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    // fill the FIFO, then start the channel
+    if (input_fill(&in)) {
+        perror("Unable to read samples");
+        return 1;
+    }
+    refill(&s, &in, 0);
+    pwm_wr(&s, PWM_CTL, ctl);
+    start = s.full_ns = now_ns(&s);
+
+    stream(&s, &in);
+
+    // let the FIFO run out, then stop
+    while (running && !(sta(&s) & STA_EMPT1))
+        drain_wait(&s, FIFO_DEPTH / s.rate);
+    drain_wait(&s, 1 / s.rate);
+    pwm_wr(&s, PWM_CTL, 0);
+
+    report(&s, &in, now_ns(&s) - start);
+    return 0;
+}
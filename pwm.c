@@ -1,741 +1,541 @@
 // PWM example, based on code from http://elinux.org/RPi_Low-level_peripherals for the mmap part
 // and http://www.raspberrypi.org/phpBB3/viewtopic.php?t=8467&p=124620 for PWM initialization
 //
-// compile with "gcc pwm.c -o pwm", test with "./pwm" (needs to be root for /dev/mem access)
+// compile with "gcc pwm.c periph.c regs.c snapshot.c reglock.c -o pwm -lpthread -lrt", test with "./pwm" (needs to be root for /dev/mem access)
+//
+// The register names come from the file named by RPI_REGS, or regs.txt in
+// the current directory or next to the pwm binary, see regs.h.
 //
 // Frank Buss, 2012
 
-#define BCM2708_PERI_BASE	0x20000000
-#define GPIO_BASE		(BCM2708_PERI_BASE + 0x200000) /* GPIO controller */
-#define PWM_BASE		(BCM2708_PERI_BASE + 0x20C000) /* PWM controller */
-#define CLOCK_BASE		(BCM2708_PERI_BASE + 0x101000)
-
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <dirent.h>
-#include <fcntl.h>
-#include <assert.h>
-#include <sys/mman.h>
-#include <sys/types.h>
-#include <sys/stat.h>
 #include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/resource.h>
 
 #include <unistd.h>
 
-#define PAGE_SIZE (4*1024)
-#define BLOCK_SIZE (4*1024)
-
-struct bits {
-    int reserved:1;
-    int readable:1;
-    int writeable:1;
-    int sentinal:1;
-    unsigned long reset;
-    unsigned long start;
-    unsigned long stop;
-    char *description;
-    char *name;
-};
-
-struct reg {
-    char *description;
-    char *name;
-    unsigned long offset;
-    int sentinal:1;
-    struct bits fields[32];
-
-    /* Some registers have required values */
-    unsigned long required;
-};
-
-struct regs {
-    char *name;
-    char *description;
-    volatile unsigned long *mem;
-    struct reg regs[256];
-};
-
+#include "periph.h"
+#include "reglock.h"
+#include "regs.h"
+#include "snapshot.h"
 
+#define MAX_TXN_WRITES 64
 
-static struct regs clk_regs = {
-    .name = "CLK",
-    .description = "Clock registers",
-    .regs = {
-        {
-            .name = "PWM_DIV",
-            .description = "Divisor for PWM clock",
-            .offset = 0xa4,
-            .required = 0x5A000000,
-            .fields = {
-                {
-                    .name = "PASS",
-                    .description = "Broadcom clock password",
-                    .start = 24,
-                    .stop = 31,
-                    .readable = 1,
-                    .writeable = 1,
-                    .reset = 0x5a,
-                },
-                {
-                    .name = "DIV",
-                    .start = 12,
-                    .stop = 23,
-                    .description = "PWM divisor",
-                    .readable = 1,
-                    .writeable = 1,
-                },
-                {
-                    .name = "????",
-                    .start = 0,
-                    .stop = 11,
-                    .description = "No idea",
-                    .readable = 1,
-                    .writeable = 1,
-                },
-                { .sentinal = 1, },
-            },
-        },
-        {
-            .name = "PWM_CNTL",
-            .description = "Control for PWM clock",
-            .offset = 0xa0,
-            .required = 0x5A000000,
-            .fields = {
-                {
-                    .name = "PASS",
-                    .description = "Broadcom clock password",
-                    .start = 24,
-                    .stop = 31,
-                    .readable = 1,
-                    .writeable = 1,
-                    .reset = 0x5a,
-                },
-                {
-                    .name = "???2",
-                    .start = 5,
-                    .stop = 23,
-                    .description = "Dunno (2)",
-                    .readable = 1,
-                    .writeable = 1,
-                },
-                {
-                    .name = "SOURCE",
-                    .start = 4,
-                    .stop = 4,
-                    .description = "Source for this particular clock (1=oscillator)",
-                    .readable = 1,
-                    .writeable = 1,
-                },
-                {
-                    .name = "???1",
-                    .start = 1,
-                    .stop = 3,
-                    .description = "Dunno (1)",
-                    .readable = 1,
-                    .writeable = 1,
-                },
-                {
-                    .name = "ENABLE",
-                    .start = 0,
-                    .stop = 0,
-                    .description = "Enable this clock",
-                    .readable = 1,
-                    .writeable = 1,
-                },
-                { .sentinal = 1, },
-            },
-        },
-        { .sentinal = 1, },
-    },
-};
-
-static struct regs pwm_regs = {
-    .name = "PWM",
-    .description = "Pulse Width Modulation registers",
-    .regs = {
-        {
-            .description = "Defines various PWM control channels",
-            .name = "CTL",
-            .offset = 0x0,
-            .fields = {
-                {
-                    .reserved = 1,
-                    .start = 16,
-                    .stop = 31,
-                },
-                {
-                    .name = "MSEN2",
-                    .description = "Channel 2 M/S Enable (0: PWM algorithm used, 1: M/S transmission used)",
-                    .start = 15,
-                    .stop = 15,
-                    .readable = 1,
-                    .writeable = 1,
-                    .reset = 0,
-                },
-                {
-                    .reserved = 1,
-                    .start = 14,
-                    .stop = 14,
-                },
-                {
-                    .name = "USEF2",
-                    .start = 13,
-                    .stop = 13,
-                    .description = "Channel 2 Use Fifo (0: Data register is transmitted, 1: Fifo is used for transmission)",
-                    .readable = 1,
-                    .writeable = 1,
-                },
-                {
-                    .name = "POLA2",
-                    .start = 12,
-                    .stop = 12,
-                    .description = "Channel 2 Polarity (0: 0=low 1=high, 1: 1=low 0=high)",
-                    .readable = 1,
-                    .writeable = 1,
-                },
-                {
-                    .name = "SBIT2",
-                    .start = 11,
-                    .stop = 11,
-                    .description = "Channel 2 Silence Bit (Defines the state of the output when no transmission takes place)",
-                    .readable = 1,
-                    .writeable = 1,
-                },
-                {
-                    .name = "RPTL2",
-                    .start = 10,
-                    .stop = 10,
-                    .description = "Channel 2 Repeat Last Data (0: Transmission interrupts when FIFO is empty 1: Last data in FIFO is transmitted repeatedly until FIFO is not empty)",
-                    .readable = 1,
-                    .writeable = 1,
-                },
-                {
-                    .name = "MODE2",
-                    .start = 9,
-                    .stop = 9,
-                    .description = "Channel 2 Mode (0: PWM mode 1: Serialiser mode)",
-                    .readable = 1,
-                    .writeable = 1,
-                },
-                {
-                    .name = "PWEN2",
-                    .start = 8,
-                    .stop = 8,
-                    .description = "Channel 2 Enable (0: Channel is disabled 1: Channel is enabled)",
-                    .readable = 1,
-                    .writeable = 1,
-                },
-
-                {
-                    .name = "MSEN1",
-                    .description = "Channel 1 M/S Enable (0: PWM algorithm used, 1: M/S transmission used)",
-                    .start = 7,
-                    .stop = 7,
-                    .readable = 1,
-                    .writeable = 1,
-                    .reset = 0,
-                },
-                {
-                    .name = "CLRF1",
-                    .description = "Clear Fifo (1: Clears FIFO 0: Has no effect)",
-                    .start = 7,
-                    .stop = 7,
-                    .readable = 1,
-                    .writeable = 0,
-                },
-                {
-                    .name = "USEF1",
-                    .start = 5,
-                    .stop = 5,
-                    .description = "Channel 1 Use Fifo (0: Data register is transmitted, 1: Fifo is used for transmission)",
-                    .readable = 1,
-                    .writeable = 1,
-                },
-                {
-                    .name = "POLA1",
-                    .start = 4,
-                    .stop = 4,
-                    .description = "Channel 1 Polarity (0: 0=low 1=high, 1: 1=low 0=high)",
-                    .readable = 1,
-                    .writeable = 1,
-                },
-                {
-                    .name = "SBIT1",
-                    .start = 3,
-                    .stop = 3,
-                    .description = "Channel 1 Silence Bit (Defines the state of the output when no transmission takes place)",
-                    .readable = 1,
-                    .writeable = 1,
-                },
-                {
-                    .name = "RPTL1",
-                    .start = 2,
-                    .stop = 2,
-                    .description = "Channel 1 Repeat Last Data (0: Transmission interrupts when FIFO is empty 1: Last data in FIFO is transmitted repeatedly until FIFO is not empty)",
-                    .readable = 1,
-                    .writeable = 1,
-                },
-                {
-                    .name = "MODE1",
-                    .start = 1,
-                    .stop = 1,
-                    .description = "Channel 1 Mode (0: PWM mode 1: Serialiser mode)",
-                    .readable = 1,
-                    .writeable = 1,
-                },
-                {
-                    .name = "PWEN1",
-                    .start = 0,
-                    .stop = 0,
-                    .description = "Channel 1 Enable (0: Channel is disabled 1: Channel is enabled)",
-                    .readable = 1,
-                    .writeable = 1,
-                },
-                { .sentinal = 1, },
-            },
-        },
-        {
-            .description = "Displays PWM status",
-            .name = "STA",
-            .offset = 0x4,
-            .fields = {
-                {
-                    .reserved = 1,
-                    .start = 13,
-                    .stop = 31,
-                },
-                {
-                    .name = "STA4",
-                    .start = 12,
-                    .stop = 12,
-                    .description = "Channel 4 State",
-                    .readable = 1,
-                    .writeable = 1,
-                },
-                {
-                    .name = "STA3",
-                    .start = 11,
-                    .stop = 11,
-                    .description = "Channel 3 State",
-                    .readable = 1,
-                    .writeable = 1,
-                },
-                {
-                    .name = "STA2",
-                    .start = 10,
-                    .stop = 10,
-                    .description = "Channel 2 State",
-                    .readable = 1,
-                    .writeable = 1,
-                },
-                {
-                    .name = "STA1",
-                    .start = 9,
-                    .stop = 9,
-                    .description = "Channel 1 State",
-                    .readable = 1,
-                    .writeable = 1,
-                },
-                {
-                    .name = "BERR",
-                    .start = 8,
-                    .stop = 8,
-                    .description = "Bus Error Flag",
-                    .readable = 1,
-                    .writeable = 1,
-                },
-                {
-                    .name = "GAPO4",
-                    .start = 7,
-                    .stop = 7,
-                    .description = "Channel 4 Gap Occurred Flag",
-                    .readable = 1,
-                    .writeable = 1,
-                },
-                {
-                    .name = "GAPO3",
-                    .start = 6,
-                    .stop = 6,
-                    .description = "Channel 3 Gap Occurred Flag",
-                    .readable = 1,
-                    .writeable = 1,
-                },
-                {
-                    .name = "GAPO2",
-                    .start = 5,
-                    .stop = 5,
-                    .description = "Channel 2 Gap Occurred Flag",
-                    .readable = 1,
-                    .writeable = 1,
-                },
-                {
-                    .name = "GAPO1",
-                    .start = 4,
-                    .stop = 4,
-                    .description = "Channel 1 Gap Occurred Flag",
-                    .readable = 1,
-                    .writeable = 1,
-                },
-                {
-                    .name = "RERR1",
-                    .start = 3,
-                    .stop = 3,
-                    .description = "Fifo Read Error Flag",
-                    .readable = 1,
-                    .writeable = 1,
-                },
-                {
-                    .name = "WERR1",
-                    .start = 2,
-                    .stop = 2,
-                    .description = "Fifo Write Error Flag",
-                    .readable = 1,
-                    .writeable = 1,
-                },
-                {
-                    .name = "EMPT1",
-                    .start = 1,
-                    .stop = 1,
-                    .description = "Fifo Empty Flag",
-                    .readable = 1,
-                    .writeable = 1,
-                },
-                {
-                    .name = "FULL1",
-                    .start = 0,
-                    .stop = 0,
-                    .description = "Fifo Full Flag",
-                    .readable = 1,
-                    .writeable = 1,
-                },
-                { .sentinal = 1, },
-            },
-        },
-        {
-            .name = "DMAC",
-            .description = "Enables DMA transfer",
-            .offset = 0x8,
-            .fields = {
-                {
-                    .name = "ENAB",
-                    .start = 31,
-                    .stop = 31,
-                    .description = "DMA Enable (0: DMA disabled 1: DMA enabled)",
-                    .readable = 1,
-                    .writeable = 1,
-                },
-                {
-                    .reserved = 1,
-                    .start = 16,
-                    .stop = 30,
-                },
-                {
-                    .name = "PANIC",
-                    .start = 8,
-                    .stop = 15,
-                    .description = "DMA Threshold for PANIC signal",
-                    .readable = 1,
-                    .writeable = 1,
-                    .reset = 0x7,
-                },
-                {
-                    .name = "DREQ",
-                    .start = 0,
-                    .stop = 7,
-                    .description = "DMA Threshold for DREQ signal",
-                    .readable = 1,
-                    .writeable = 1,
-                    .reset = 0x7,
-                },
-                { .sentinal = 1, },
-            },
-        },
-        {
-            .name = "RNG1",
-            .description = "Channel 1 Range",
-            .offset = 0x10,
-            .fields = {
-                {
-                    .name = "RNG",
-                    .start = 0,
-                    .stop = 31,
-                    .description = "Channel 1 range",
-                    .readable = 1,
-                    .writeable = 1,
-                    .reset = 0x20,
-                },
-                { .sentinal = 1, },
-            },
-        },
-        {
-            .name = "DAT1",
-            .description = "Channel 1 Data",
-            .offset = 0x14,
-            .fields = {
-                {
-                    .name = "DAT",
-                    .start = 0,
-                    .stop = 31,
-                    .description = "Channel 1 data",
-                    .readable = 1,
-                    .writeable = 1,
-                },
-                { .sentinal = 1, },
-            },
-        },
-        {
-            .name = "FIF",
-            .description = "PWM fifo register",
-            .offset = 0x18,
-            .fields = {
-                {
-                    .name = "FIFO",
-                    .start = 0,
-                    .stop = 31,
-                    .description = "Channel FIFO input",
-                    .readable = 1,
-                    .writeable = 1,
-                },
-                { .sentinal = 1, },
-            },
-        },
-        {
-            .name = "RNG2",
-            .description = "Channel 2 Range",
-            .offset = 0x20,
-            .fields = {
-                {
-                    .name = "RNG",
-                    .start = 0,
-                    .stop = 31,
-                    .description = "Channel 2 range",
-                    .readable = 1,
-                    .writeable = 1,
-                    .reset = 0x20,
-                },
-                { .sentinal = 1, },
-            },
-        },
-        {
-            .name = "DAT2",
-            .description = "Channel 2 Data",
-            .offset = 0x24,
-            .fields = {
-                {
-                    .name = "DAT",
-                    .start = 0,
-                    .stop = 31,
-                    .description = "Channel 2 data",
-                    .readable = 1,
-                    .writeable = 1,
-                },
-                { .sentinal = 1, },
-            },
-        },
-        { .sentinal = 1, },
-    },
+/* One queued field write of a transaction */
+struct txn_write {
+    uint16_t reg;
+    uint16_t field;
+    uint32_t value;
 };
 
 struct context {
-    struct regs *gpio;
-    struct regs *pwm;
-    struct regs *clk;
+    const struct reg_map *map;
+    volatile uint32_t *gpio;
+    volatile uint32_t *mem[REG_MAX_BLOCKS];
+
+    int txn_mode;
+    int txn_len;
+    struct txn_write txn[MAX_TXN_WRITES];
 };
 
 
 // GPIO setup macros. Always use INP_GPIO(x) before using OUT_GPIO(x) or SET_GPIO_ALT(x,y)
-#define INP_GPIO(ctx, g) *(ctx->gpio+((g)/10)) &= ~(7<<(((g)%10)*3))
-#define OUT_GPIO(ctx, g) *(ctx->gpio+((g)/10)) |=  (1<<(((g)%10)*3))
-#define SET_GPIO_ALT(ctx, g, a) *(ctx->gpio+(((g)/10))) |= (((a)<=3?(a)+4:(a)==4?3:2)<<(((g)%10)*3))
+// The read-modify-writes lock the GPFSEL bank, see reglock.h
+#define INP_GPIO(ctx, g) reglock_rmw(ctx->gpio, (g)/10, 7<<(((g)%10)*3), 0)
+#define OUT_GPIO(ctx, g) reglock_rmw(ctx->gpio, (g)/10, 0, 1<<(((g)%10)*3))
+#define SET_GPIO_ALT(ctx, g, a) reglock_rmw(ctx->gpio, (g)/10, 0, ((a)<=3?(a)+4:(a)==4?3:2)<<(((g)%10)*3))
 
 #define GPIO_SET *(ctx->gpio+7)  // sets   bits which are 1 ignores bits which are 0
 #define GPIO_CLR *(ctx->gpio+10) // clears bits which are 1 ignores bits which are 0
 
-// map 4k register memory for direct access from user space and return a user space pointer to it
-static volatile unsigned long *map_register_memory(int base)
+// return the registers of a block, mapping them the first time they are used
+static volatile uint32_t *block_mem(struct context *ctx, unsigned int block_num)
 {
-	static int mem_fd = 0;
-	char *mem, *map;
-	
-	/* open /dev/mem */
-	if (!mem_fd) {
-		if ((mem_fd = open("/dev/mem", O_RDWR|O_SYNC) ) < 0) {
-			printf("can't open /dev/mem \n");
-			exit (-1);
-		}
-	}
-	
-	/* mmap register */
-	
-	// Allocate MAP block
-	if ((mem = malloc(BLOCK_SIZE + (PAGE_SIZE-1))) == NULL) {
-		printf("allocation error \n");
-		exit (-1);
-	}
-	
-	// Make sure pointer is on 4K boundary
-	if ((unsigned long)mem % PAGE_SIZE)
-		mem += PAGE_SIZE - ((unsigned long)mem % PAGE_SIZE);
-	
-	// Now map it
-	map = (char *)mmap(
-		(caddr_t)mem,
-		BLOCK_SIZE,
-		PROT_READ|PROT_WRITE,
-		MAP_SHARED|MAP_FIXED,
-		mem_fd,
-		base
-	);
-	
-	if ((long)map < 0) {
-		printf("mmap error %d\n", (int)map);
-		exit (-1);
-	}
-	
-	// Always use volatile pointer!
-	return (volatile unsigned long *)map;
+    if (!ctx->mem[block_num])
+        ctx->mem[block_num] = periph_map(ctx->map->blocks[block_num].offset);
+    return ctx->mem[block_num];
 }
 
-// set up a memory regions to access GPIO, PWM and the clock manager
-void map_registers(struct context *ctx)
+static int find_block(struct context *ctx, const char *name)
 {
-//	ctx->gpio = map_register_memory(GPIO_BASE);
-	ctx->pwm->mem = map_register_memory(PWM_BASE);
-	ctx->clk->mem = map_register_memory(CLOCK_BASE);
+    unsigned int block_num;
+    for (block_num=0; block_num<ctx->map->nblocks; block_num++)
+        if (!strcmp(reg_str(ctx->map, ctx->map->blocks[block_num].name), name))
+            return block_num;
+    return -1;
 }
 
 
-static int dump_regs(struct regs *regs) {
+static int dump_regs(struct context *ctx, int block_num, FILE *out) {
+    const struct reg_map *map = ctx->map;
+    const struct reg_block *block = &map->blocks[block_num];
+    volatile uint32_t *mem = block_mem(ctx, block_num);
     int reg_num;
     int field_num;
-    for (reg_num=0; !regs->regs[reg_num].sentinal; reg_num++) {
-        struct reg *reg = &regs->regs[reg_num];
-        unsigned long reg_val = regs->mem[reg->offset/sizeof(long)];
-
-
-        printf("%s.%s - %s\n", regs->name, reg->name, reg->description);
-        for (field_num=0; !reg->fields[field_num].sentinal; field_num++) {
-            struct bits *field = &reg->fields[field_num];
-            int field_val = (reg_val>>field->start) &
-                (((1<<(field->stop-field->start+1)))-1);
-            if (field->reserved)
-                printf("\t   (Bits %ld - %ld Reserved)\n", field->start, field->stop);
+    for (reg_num=block->first_reg; reg_num<block->first_reg+block->nregs; reg_num++) {
+        const struct reg_desc *reg = &map->regs[reg_num];
+        uint32_t reg_val = periph_rd(mem, reg->offset/4);
+
+
+        fprintf(out, "%s.%s - %s\n", reg_str(map, block->name),
+                reg_str(map, reg->name), reg_str(map, reg->description));
+        for (field_num=reg->first_field; field_num<reg->first_field+reg->nfields; field_num++) {
+            const struct reg_field *field = &map->fields[field_num];
+            uint32_t field_val = reg_field_get(field, reg_val);
+            if (field->flags & REG_F_RESERVED)
+                fprintf(out, "\t   (Bits %d - %d Reserved)\n", field->start, field->stop);
             else {
                 if (field_val > 256) {
-                    printf("\t%6s: 0x%08x    %s\n", field->name, field_val,
-                            field->description);
+                    fprintf(out, "\t%6s: 0x%08x    %s\n", reg_str(map, field->name),
+                            field_val, reg_str(map, field->description));
                 }
                 else {
-                    printf("\t%6s: %-10d    %s\n", field->name, field_val,
-                            field->description);
+                    fprintf(out, "\t%6s: %-10d    %s\n", reg_str(map, field->name),
+                            field_val, reg_str(map, field->description));
                 }
             }
         }
-        printf("\n");
+        fprintf(out, "\n");
     }
-    printf("\n");
+    fprintf(out, "\n");
     return 0;
 }
 
+// dump a block by name, a regs.txt doesn't have to describe it
+static int dump_named_regs(struct context *ctx, const char *name) {
+    int block_num = find_block(ctx, name);
+
+    if (block_num < 0) {
+        printf("No %s block in the register map\n", name);
+        errno = ENOENT;
+        return -1;
+    }
+    return dump_regs(ctx, block_num, stdout);
+}
+
 static int dump_pwm_regs(struct context *ctx) {
-    return dump_regs(ctx->pwm);
+    return dump_named_regs(ctx, "PWM");
 }
 
 static int dump_clk_regs(struct context *ctx) {
-    return dump_regs(ctx->clk);
+    return dump_named_regs(ctx, "CLK");
 }
 
 
-static int set_reg(struct context *ctx, char *desc) {
-    struct regs *regs = NULL;
-    if (!strncmp(desc, ctx->pwm->name, strlen(ctx->pwm->name)))
-        regs = ctx->pwm;
-    else if (!strncmp(desc, ctx->clk->name, strlen(ctx->clk->name)))
-        regs = ctx->clk;
-    else {
+// parse BLOCK.REG.FIELD=value, the name has to match exactly
+static int parse_field(struct context *ctx, const char *desc, struct reg_ref *ref,
+        unsigned long *newval) {
+    const char *value;
+
+    if ((value = strchr(desc, '=')) == NULL) {
+        printf("Missing value, expected BLOCK.REG.FIELD=value\n");
         errno = EINVAL;
-        printf("Unrecognized register block\n");
         return -1;
     }
 
-    int reg_num, field_num;
-    desc += strlen(regs->name)+1;
-
-    /* Look for the correct register */
-    for (reg_num=0; !regs->regs[reg_num].sentinal; reg_num++) {
-        struct reg *reg = &regs->regs[reg_num];
-        if (reg->name && !strncmp(desc, reg->name, strlen(reg->name))) {
-
-            /* Register found */
-            unsigned long reg_val = regs->mem[reg->offset/sizeof(long)];
-            desc += strlen(reg->name)+1;
-
-            /* Look for the correct field */
-            for (field_num=0; !reg->fields[field_num].sentinal; field_num++) {
-                struct bits *field = &reg->fields[field_num];
-                if (field->name && !strncmp(desc, field->name, strlen(field->name))) {
-                    /* Field found */
-                    unsigned long newval;
-                    desc += strlen(field->name)+1;
-                    newval = strtoul(desc, NULL, 0);
-
-                    /* Limit the new value to the correct size */
-                    int field_val = newval &
-                        (((1<<(field->stop-field->start+1)))-1);
-                    /* Move it to the correct bit offset */
-                    field_val <<= field->start;
-
-                    /* Clear out the old value */
-                    reg_val &=
-                        ~((((1<<(field->stop-field->start+1)))-1)<<field->start);
-
-                    reg_val |= field_val;
-                    reg_val |= reg->required;
-                    printf("Setting field %s.%s.%s to %ld\n",
-                            regs->name, reg->name, field->name, newval);
-                    regs->mem[reg->offset/sizeof(long)] = reg_val;
-                    return 0;
-                }
+    if (reg_lookup(ctx->map, desc, value - desc, ref) || ref->field < 0) {
+        printf("Unknown field %.*s\n", (int)(value - desc), desc);
+        errno = EINVAL;
+        return -1;
+    }
+
+    *newval = strtoul(value + 1, NULL, 0);
+    return 0;
+}
+
+static void print_field(struct context *ctx, int reg_num, int field_num, unsigned long newval) {
+    const struct reg_map *map = ctx->map;
+    const struct reg_desc *reg = &map->regs[reg_num];
+
+    printf("Setting field %s.%s.%s to %ld\n", reg_str(map, map->blocks[reg->block].name),
+            reg_str(map, reg->name), reg_str(map, map->fields[field_num].name), newval);
+}
+
+static int set_reg(struct context *ctx, char *desc) {
+    const struct reg_map *map = ctx->map;
+    const struct reg_desc *reg;
+    struct reg_ref ref;
+    volatile uint32_t *mem;
+    uint32_t reg_val;
+    unsigned long newval;
+    unsigned int slot;
+
+    if (parse_field(ctx, desc, &ref, &newval))
+        return -1;
+
+    reg = &map->regs[ref.reg];
+    mem = block_mem(ctx, ref.block);
+    slot = reglock_slot(mem, reg->offset/4);
+    if (reglock_acquire(slot))
+        return -1;
+    reg_val = periph_rd(mem, reg->offset/4);
+
+    /* Limit the new value to the correct size and merge it in */
+    reg_val = reg_field_put(&map->fields[ref.field], reg_val, newval);
+    reg_val |= reg->required;
+    periph_wr(mem, reg->offset/4, reg_val);
+    reglock_release(slot);
+    print_field(ctx, ref.reg, ref.field, newval);
+    return 0;
+}
+
+// queue a field write, to be applied by txn_commit()
+static int txn_add(struct context *ctx, char *desc) {
+    struct reg_ref ref;
+    unsigned long newval;
+
+    if (parse_field(ctx, desc, &ref, &newval))
+        return -1;
+
+    if (ctx->txn_len >= MAX_TXN_WRITES) {
+        printf("Too many writes in one transaction\n");
+        errno = E2BIG;
+        return -1;
+    }
+
+    ctx->txn[ctx->txn_len].reg = ref.reg;
+    ctx->txn[ctx->txn_len].field = ref.field;
+    ctx->txn[ctx->txn_len].value = newval;
+    ctx->txn_len++;
+    return 0;
+}
+
+/* Per-register state while committing a transaction */
+struct txn_reg {
+    uint16_t reg;
+    uint8_t touched;            /* has queued field writes */
+    uint8_t stopped;            /* gate fields were cleared for the commit */
+    uint32_t old_val;
+    uint32_t new_val;
+};
+
+static const struct reg_map *txn_sort_map;
+
+static int txn_reg_cmp(const void *a, const void *b) {
+    const struct reg_desc *ra = &txn_sort_map->regs[((const struct txn_reg *)a)->reg];
+    const struct reg_desc *rb = &txn_sort_map->regs[((const struct txn_reg *)b)->reg];
+
+    if (ra->block != rb->block)
+        return ra->block - rb->block;
+    if (ra->order != rb->order)
+        return ra->order - rb->order;
+    return ra - rb;
+}
+
+static struct txn_reg *txn_find(struct txn_reg *regs, int count, int reg_num) {
+    int i;
+    for (i=0; i<count; i++)
+        if (regs[i].reg == reg_num)
+            return &regs[i];
+    return NULL;
+}
+
+static uint32_t gate_mask(const struct reg_map *map, const struct reg_desc *reg) {
+    uint32_t mask = 0;
+    int field_num;
+    for (field_num=reg->first_field; field_num<reg->first_field+reg->nfields; field_num++)
+        if (map->fields[field_num].flags & REG_F_GATE)
+            mask |= reg_field_mask(&map->fields[field_num]) << map->fields[field_num].start;
+    return mask;
+}
+
+// Mask of the register's BUSY field, 0 if it has none
+static uint32_t busy_mask(const struct reg_map *map, const struct reg_desc *reg) {
+    int field_num;
+    for (field_num=reg->first_field; field_num<reg->first_field+reg->nfields; field_num++)
+        if (map->fields[field_num].name &&
+                !strcmp(reg_str(map, map->fields[field_num].name), "BUSY"))
+            return reg_field_mask(&map->fields[field_num]) << map->fields[field_num].start;
+    return 0;
+}
+
+// Lock every register of a commit, in slot order so that two commits
+// can't deadlock.  Registers may share a slot, it is only taken once.
+static int txn_lock(struct context *ctx, const struct txn_reg *regs, int count,
+        unsigned int *slots) {
+    int i;
+
+    for (i=0; i<count; i++) {
+        const struct reg_desc *reg = &ctx->map->regs[regs[i].reg];
+        slots[i] = reglock_slot(block_mem(ctx, reg->block), reg->offset/4);
+    }
+    return reglock_acquire_all(slots, count);
+}
+
+// Apply all queued writes.  Writes are grouped per register, so every
+// register is read once and written once, in block order and then by each
+// register's commit rank (e.g. PWM CTL and clock control go after the
+// ranges and divisors they enable).  A running clock whose divisor or
+// control changes is stopped first through its gate register.  Other
+// processes can't touch the registers from the first read to the last write.
+static int txn_commit(struct context *ctx) {
+    const struct reg_map *map = ctx->map;
+    struct txn_reg regs[MAX_TXN_WRITES * 2];
+    unsigned int slots[MAX_TXN_WRITES * 2];
+    int count = 0, nslots;
+    int i;
+
+    if (!ctx->txn_len)
+        return 0;
+
+    /* Group the queued writes by register */
+    for (i=0; i<ctx->txn_len; i++) {
+        struct txn_write *write = &ctx->txn[i];
+        const struct reg_desc *reg = &map->regs[write->reg];
+        struct txn_reg *treg = txn_find(regs, count, write->reg);
+
+        if (!treg) {
+            treg = &regs[count++];
+            memset(treg, 0, sizeof(*treg));
+            treg->reg = write->reg;
+        }
+        treg->touched = 1;
+
+        /* Gate registers take part even when they aren't written */
+        if (reg->gate != REG_GATE_NONE) {
+            int gate_num = map->blocks[reg->block].first_reg + reg->gate;
+            if (!txn_find(regs, count, gate_num)) {
+                memset(&regs[count], 0, sizeof(regs[count]));
+                regs[count++].reg = gate_num;
             }
-            printf("Unknown field\n");
-            errno = EINVAL;
-            return -1;
         }
     }
-    printf("Unknown register\n");
-    errno = EINVAL;
-    return -1;
+
+    txn_sort_map = map;
+    qsort(regs, count, sizeof(*regs), txn_reg_cmp);
+
+    nslots = txn_lock(ctx, regs, count, slots);
+    if (nslots < 0) {
+        ctx->txn_len = 0;
+        return -1;
+    }
+
+    /* One read per register */
+    for (i=0; i<count; i++) {
+        const struct reg_desc *reg = &map->regs[regs[i].reg];
+        regs[i].old_val = periph_rd(block_mem(ctx, reg->block), reg->offset/4);
+        regs[i].new_val = regs[i].old_val;
+    }
+
+    for (i=0; i<ctx->txn_len; i++) {
+        struct txn_write *write = &ctx->txn[i];
+        struct txn_reg *treg = txn_find(regs, count, write->reg);
+        treg->new_val = reg_field_put(&map->fields[write->field], treg->new_val, write->value);
+        print_field(ctx, write->reg, write->field, write->value);
+    }
+
+    /* Stop running gates whose registers are about to change */
+    for (i=0; i<count; i++) {
+        const struct reg_desc *reg = &map->regs[regs[i].reg];
+        struct txn_reg *gate;
+        uint32_t mask;
+
+        if (!regs[i].touched || regs[i].new_val == regs[i].old_val ||
+                reg->gate == REG_GATE_NONE)
+            continue;
+
+        gate = txn_find(regs, count, map->blocks[reg->block].first_reg + reg->gate);
+        mask = gate_mask(map, &map->regs[gate->reg]);
+        if (gate->stopped || !(gate->old_val & mask))
+            continue;
+
+        periph_wr(block_mem(ctx, reg->block), map->regs[gate->reg].offset/4,
+                (gate->old_val & ~mask) | map->regs[gate->reg].required);
+        gate->stopped = 1;
+    }
+
+    // a stopped clock needs some time before its divisor can be changed:
+    // wait for its BUSY flag to drop
+    for (i=0; i<count; i++) {
+        const struct reg_desc *reg = &map->regs[regs[i].reg];
+        uint32_t busy = busy_mask(map, reg);
+        if (regs[i].stopped && busy)
+            periph_wait(block_mem(ctx, reg->block), reg->offset/4, busy, 0, PERIPH_SETTLE_NS);
+    }
+
+    /* One write per register, in commit order.  A gate register whose
+       other fields change (a clock's SRC or MASH) gets them while still
+       stopped, and its gate bits in a second write. */
+    for (i=0; i<count; i++) {
+        const struct reg_desc *reg = &map->regs[regs[i].reg];
+        volatile uint32_t *mem = block_mem(ctx, reg->block);
+        uint32_t mask = gate_mask(map, reg);
+
+        if (!regs[i].touched && !regs[i].stopped)
+            continue;
+        if ((regs[i].new_val & mask) &&
+                (regs[i].new_val & ~mask) != (regs[i].old_val & ~mask))
+            periph_wr(mem, reg->offset/4, (regs[i].new_val & ~mask) | reg->required);
+        periph_wr(mem, reg->offset/4, regs[i].new_val | reg->required);
+    }
+    reglock_release_all(slots, nslots);
+
+    ctx->txn_len = 0;
+    return 0;
+}
+
+static int capture(struct context *ctx, struct snapshot *snap) {
+    unsigned int block_num;
+
+    for (block_num=0; block_num<ctx->map->nblocks; block_num++)
+        block_mem(ctx, block_num);
+    return snapshot_capture(snap, ctx->map, ctx->mem);
+}
+
+// capture all described blocks into a binary snapshot file
+static int save_snapshot(struct context *ctx, const char *path) {
+    struct snapshot snap;
+    int ret;
+
+    if (txn_commit(ctx) || capture(ctx, &snap))
+        return -1;
+    ret = snapshot_save(&snap, path);
+    snapshot_free(&snap);
+    return ret;
+}
+
+// compare "old" against the live registers, or "old,new" against each other
+static int diff_snapshots(struct context *ctx, char *arg) {
+    struct snapshot a, b;
+    char *second = strchr(arg, ',');
+    int ret;
+
+    if (second)
+        *second++ = '\0';
+
+    if (snapshot_load(&a, arg))
+        return -1;
+
+    if (txn_commit(ctx) || (second ? snapshot_load(&b, second) : capture(ctx, &b))) {
+        snapshot_free(&a);
+        return -1;
+    }
+
+    ret = snapshot_diff(&a, &b, ctx->map, stdout);
+    snapshot_free(&a);
+    snapshot_free(&b);
+    return ret;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// report the descriptor footprint and how long a full dump walk takes
+static int table_stats(struct context *ctx, int loops) {
+    const struct reg_map *map = ctx->map;
+    struct rusage usage;
+    unsigned int block_num;
+    uint64_t start, elapsed;
+    FILE *null;
+    int i;
+
+    printf("Descriptor tables: %u blocks x %zu + %u regs x %zu + %u fields x %zu"
+            " + %u bytes of strings = %zu bytes\n",
+            map->nblocks, sizeof(*map->blocks), map->nregs, sizeof(*map->regs),
+            map->nfields, sizeof(*map->fields), map->strings_size,
+            map->nblocks * sizeof(*map->blocks) + map->nregs * sizeof(*map->regs) +
+            map->nfields * sizeof(*map->fields) + map->strings_size);
+
+    if ((null = fopen("/dev/null", "w")) == NULL) {
+        perror("Unable to open /dev/null");
+        return -1;
+    }
+
+    start = now_ns();
+    for (i=0; i<loops; i++)
+        for (block_num=0; block_num<map->nblocks; block_num++)
+            dump_regs(ctx, block_num, null);
+    elapsed = now_ns() - start;
+    fclose(null);
+
+    getrusage(RUSAGE_SELF, &usage);
+    printf("Dump of all blocks: %.2f us (%d loops)\n", elapsed / 1000.0 / loops, loops);
+    printf("Max RSS: %ld KB\n", usage.ru_maxrss);
+    return 0;
 }
 
 int main(int argc, char **argv) { 
-    int ch;
+    int ch, status = 0;
+    long loops;
     struct context ctx;
 
-    ctx.pwm = &pwm_regs;
-    ctx.clk = &clk_regs;
-	map_registers(&ctx);
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.map = reg_map_load(NULL);
+    if (!ctx.map) {
+        perror("Unable to load the register map");
+        return 1;
+    }
 
-    while ((ch = getopt(argc, argv, "dw:")) != -1) {
+    while ((ch = getopt(argc, argv, "dtw:s:D:T:")) != -1) {
         switch (ch) {
         case 'd':
+            if (txn_commit(&ctx)) {
+                perror("Unable to commit the transaction");
+                status = 1;
+            }
             dump_pwm_regs(&ctx);
             dump_clk_regs(&ctx);
             break;
 
+        case 't':
+            ctx.txn_mode = 1;
+            break;
+
         case 'w':
-            if (set_reg(&ctx, optarg))
+            if (ctx.txn_mode ? txn_add(&ctx, optarg) : set_reg(&ctx, optarg)) {
                 perror("Unable to set register");
+                status = 1;
+            }
+            break;
+
+        case 's':
+            if (save_snapshot(&ctx, optarg)) {
+                perror("Unable to save snapshot");
+                status = 1;
+            }
+            break;
+
+        case 'D':
+            if (diff_snapshots(&ctx, optarg) < 0) {
+                perror("Unable to diff snapshots");
+                status = 1;
+            }
+            break;
+
+        case 'T':
+            loops = strtol(optarg, NULL, 0);
+            if (loops < 1 || loops > INT_MAX) {
+                fprintf(stderr, "Need a loop count of at least 1\n");
+                return 1;
+            }
+            table_stats(&ctx, loops);
             break;
 
         default:
-            printf("Usage: %s [-d]\n", argv[0]);
+            printf("Usage: %s [-d] [-t] [-w BLOCK.REG.FIELD=value] [-s snapshot]"
+                    " [-D old[,new]] [-T loops]\n", argv[0]);
+            printf("\t-t  collect the following -w writes into one transaction\n");
+            printf("\t-s  save a binary snapshot of all PWM, CLK and GPIO registers\n");
+            printf("\t-D  list the fields that changed since a snapshot, or between two\n");
         }
     }
 
+    if (txn_commit(&ctx)) {
+        perror("Unable to commit the transaction");
+        status = 1;
+    }
+
     argc += optind;
 	
 	//SET_GPIO_ALT((&ctx), 18, 0);
 
-	return 0;
+	return status;
 }
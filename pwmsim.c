@@ -0,0 +1,308 @@
+// Software model of the PWM block and its clock, see pwmsim.h
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "periph.h"
+#include "clkman.h"
+#include "pwmsim.h"
+
+/* CTL bits of one channel, shifted down by 8 for channel 2 */
+#define CTL_PWEN	(1 << 0)
+#define CTL_MODE	(1 << 1)    /* serializer */
+#define CTL_RPTL	(1 << 2)
+#define CTL_SBIT	(1 << 3)
+#define CTL_POLA	(1 << 4)
+#define CTL_USEF	(1 << 5)
+#define CTL_MSEN	(1 << 7)
+#define CTL_CLRF1	(1 << 6)    /* shared, channel 1 position only */
+
+/* STA bits */
+#define STA_FULL1	(1 << 0)
+#define STA_EMPT1	(1 << 1)
+#define STA_WERR1	(1 << 2)
+#define STA_RERR1	(1 << 3)
+#define STA_GAPO(c)	(1 << (4 + (c)))
+#define STA_BERR	(1 << 8)
+#define STA_STA(c)	(1 << (9 + (c)))
+#define STA_STICKY	(STA_WERR1 | STA_RERR1 | STA_GAPO(0) | STA_GAPO(1) | \
+        STA_GAPO(2) | STA_GAPO(3) | STA_BERR)
+
+#define DMAC_ENAB	(1U << 31)
+
+static const unsigned int rng_reg[PWMSIM_CHANNELS] = { PWMSIM_RNG1, PWMSIM_RNG2 };
+static const unsigned int dat_reg[PWMSIM_CHANNELS] = { PWMSIM_DAT1, PWMSIM_DAT2 };
+
+int pwmsim_init(struct pwmsim *sim)
+{
+    if (periph_backend() == PERIPH_DEVMEM || periph_backend() == PERIPH_GPIOMEM) {
+        errno = ENODEV;
+        return -1;
+    }
+    memset(sim, 0, sizeof(*sim));
+    sim->pwm = periph_map(PWM_OFFSET);
+    sim->clk = periph_map(CLOCK_OFFSET);
+    return 0;
+}
+
+static void update_sta(struct pwmsim *sim)
+{
+    uint32_t sta = sim->sticky;
+    int c;
+
+    if (!sim->fifo_count)
+        sta |= STA_EMPT1;
+    if (sim->fifo_count == PWMSIM_FIFO_DEPTH)
+        sta |= STA_FULL1;
+    for (c = 0; c < PWMSIM_CHANNELS; c++)
+        if ((sim->pwm[PWMSIM_CTL] >> (8 * c)) & CTL_PWEN && sim->clock_hz)
+            sta |= STA_STA(c);
+    sim->pwm[PWMSIM_STA] = sta;
+}
+
+static void fifo_clear(struct pwmsim *sim)
+{
+    sim->fifo_head = 0;
+    sim->fifo_count = 0;
+}
+
+static void fifo_push(struct pwmsim *sim, uint32_t word)
+{
+    if (sim->fifo_count == PWMSIM_FIFO_DEPTH) {
+        sim->overruns++;
+        sim->sticky |= STA_WERR1;
+        return;
+    }
+    sim->fifo[(sim->fifo_head + sim->fifo_count++) % PWMSIM_FIFO_DEPTH] = word;
+    sim->fifo_words++;
+}
+
+void pwmsim_write(struct pwmsim *sim, unsigned int reg, uint32_t val)
+{
+    switch (reg) {
+    case PWMSIM_FIF:
+        fifo_push(sim, val);
+        break;
+
+    case PWMSIM_STA:
+        sim->sticky &= ~(val & STA_STICKY);
+        break;
+
+    case PWMSIM_CTL:
+        if (val & CTL_CLRF1)
+            fifo_clear(sim);
+        sim->pwm[reg] = val & ~CTL_CLRF1;
+        break;
+
+    default:
+        sim->pwm[reg] = val;
+        break;
+    }
+    update_sta(sim);
+}
+
+uint32_t pwmsim_read(struct pwmsim *sim, unsigned int reg)
+{
+    if (reg == PWMSIM_FIF)
+        return 0;
+    if (reg == PWMSIM_STA)
+        update_sta(sim);
+    return sim->pwm[reg];
+}
+
+void pwmsim_fifo_sink(void *arg, uint32_t word)
+{
+    struct pwmsim *sim = arg;
+    fifo_push(sim, word);
+}
+
+// pick up what was written to memory directly: the clock and CLRF1
+static void sync_registers(struct pwmsim *sim)
+{
+    struct clk_setting s;
+    int enabled;
+
+    clk_get(CLK_PWM, &s, &enabled);
+    sim->clock_hz = enabled ? s.hz : 0;
+
+    if (sim->pwm[PWMSIM_CTL] & CTL_CLRF1) {
+        fifo_clear(sim);
+        sim->pwm[PWMSIM_CTL] &= ~CTL_CLRF1;
+    }
+}
+
+// keep the FIFO at the DREQ threshold while DMA is enabled
+static void dreq(struct pwmsim *sim)
+{
+    uint32_t dmac = sim->pwm[PWMSIM_DMAC];
+    unsigned int threshold = dmac & 0xff;
+
+    if (!(dmac & DMAC_ENAB) || !sim->dreq)
+        return;
+    if (!threshold)
+        threshold = 1;
+    if (threshold > PWMSIM_FIFO_DEPTH)
+        threshold = PWMSIM_FIFO_DEPTH;
+    while (sim->fifo_count < threshold)
+        if (!sim->dreq(sim->dreq_arg))
+            break;
+}
+
+static void load_period(struct pwmsim *sim, int c, uint32_t ctl)
+{
+    struct pwmsim_channel *ch = &sim->ch[c];
+
+    ch->loaded = 1;
+    ch->k = 0;
+    ch->gap = 0;
+    ch->word = 0;
+    ch->ctl = ctl;
+    ch->rng = sim->pwm[rng_reg[c]];
+    if (!ch->rng)
+        ch->rng = 1;
+
+    if (ctl & CTL_USEF) {
+        dreq(sim);
+        if (sim->fifo_count) {
+            ch->word = ch->last = sim->fifo[sim->fifo_head];
+            sim->fifo_head = (sim->fifo_head + 1) % PWMSIM_FIFO_DEPTH;
+            sim->fifo_count--;
+        } else if (ctl & CTL_RPTL) {
+            ch->word = ch->last;
+        } else {
+            ch->gap = 1;
+            ch->gaps++;
+            sim->sticky |= STA_GAPO(c);
+        }
+    } else {
+        ch->word = sim->pwm[dat_reg[c]];
+    }
+    ch->context = 0;
+}
+
+// output level of the next tick, before POLA
+static int tick_level(struct pwmsim_channel *ch)
+{
+    if (ch->ctl & CTL_MODE)
+        return ch->k < 32 ? (ch->word >> (31 - ch->k)) & 1 : 0;
+    if (ch->ctl & CTL_MSEN)
+        return ch->k < ch->word;
+    ch->context += ch->word;
+    if (ch->context >= ch->rng) {
+        ch->context -= ch->rng;
+        return 1;
+    }
+    return 0;
+}
+
+// move channel c up to its next output change before end; returns 1 and
+// the time and new level if there is one
+static int channel_scan(struct pwmsim *sim, int c, uint64_t end, uint64_t *t_ps, int *level)
+{
+    struct pwmsim_channel *ch = &sim->ch[c];
+    uint32_t ctl = (sim->pwm[PWMSIM_CTL] >> (8 * c)) & 0xff;
+    double tick_ps;
+
+    if (!(ctl & CTL_PWEN) || !sim->clock_hz) {
+        /* Stopped: the output goes to the silence bit */
+        ch->loaded = 0;
+        if (ch->t_ps < end)
+            ch->t_ps = end;
+        if (ch->level != !!(ctl & CTL_SBIT)) {
+            *t_ps = sim->t_ps;
+            *level = !!(ctl & CTL_SBIT);
+            return 1;
+        }
+        return 0;
+    }
+    if (ch->t_ps < sim->t_ps)
+        ch->t_ps = sim->t_ps;
+
+    tick_ps = 1e12 / sim->clock_hz;
+    for (;;) {
+        if (!ch->loaded) {
+            if (ch->t_ps >= end)
+                return 0;
+            load_period(sim, c, ctl);
+        }
+        while (ch->k < ch->rng) {
+            uint64_t t = ch->t_ps + (uint64_t)(ch->k * tick_ps + 0.5);
+            int lvl;
+
+            if (t >= end)
+                return 0;
+            if (ch->gap) {
+                /* nothing to send: silence bit for the whole period */
+                lvl = !!(ch->ctl & CTL_SBIT);
+                ch->k = ch->rng;
+            } else if ((ch->ctl & (CTL_MODE | CTL_MSEN)) == CTL_MSEN) {
+                /* M/S: high up to DAT, low after, no need to walk the ticks */
+                lvl = ch->k < ch->word;
+                ch->k = lvl ? (ch->word < ch->rng ? ch->word : ch->rng) : ch->rng;
+                lvl ^= !!(ch->ctl & CTL_POLA);
+            } else {
+                lvl = tick_level(ch) ^ !!(ch->ctl & CTL_POLA);
+                ch->k++;
+            }
+            if (lvl != ch->level) {
+                *t_ps = t;
+                *level = lvl;
+                return 1;
+            }
+        }
+        ch->t_ps += (uint64_t)(ch->rng * tick_ps + 0.5);
+        ch->periods++;
+        ch->loaded = 0;
+    }
+}
+
+static void set_level(struct pwmsim *sim, int c, uint64_t t_ps, int level, uint64_t *since)
+{
+    struct pwmsim_channel *ch = &sim->ch[c];
+
+    if (ch->level)
+        ch->high_ps += t_ps - since[c];
+    since[c] = t_ps;
+    ch->level = level;
+    ch->edges++;
+    if (sim->edge)
+        sim->edge(sim->edge_arg, c, t_ps / 1000, level);
+}
+
+void pwmsim_run(struct pwmsim *sim, uint64_t ns)
+{
+    uint64_t end = sim->t_ps + ns * 1000;
+    uint64_t since[PWMSIM_CHANNELS], next_t[PWMSIM_CHANNELS];
+    int next_level[PWMSIM_CHANNELS], valid[PWMSIM_CHANNELS] = { 0 };
+    int found[PWMSIM_CHANNELS];
+    int c, best;
+
+    sync_registers(sim);
+    for (c = 0; c < PWMSIM_CHANNELS; c++)
+        since[c] = sim->t_ps;
+
+    /* Channels advance in step: always the one with the earliest change */
+    for (;;) {
+        best = -1;
+        for (c = 0; c < PWMSIM_CHANNELS; c++) {
+            if (!valid[c]) {
+                found[c] = channel_scan(sim, c, end, &next_t[c], &next_level[c]);
+                valid[c] = 1;
+            }
+            if (found[c] && (best < 0 || next_t[c] < next_t[best]))
+                best = c;
+        }
+        if (best < 0)
+            break;
+        set_level(sim, best, next_t[best], next_level[best], since);
+        valid[best] = 0;
+    }
+
+    for (c = 0; c < PWMSIM_CHANNELS; c++)
+        if (sim->ch[c].level)
+            sim->ch[c].high_ps += end - since[c];
+    sim->t_ps = end;
+    update_sta(sim);
+}
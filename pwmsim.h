@@ -0,0 +1,96 @@
+// Software model of the PWM block and its clock
+//
+// Runs on the register memory of a simulated backend (RPI_PERIPH=anon or
+// file:PATH), so tools program it exactly as they program the hardware:
+// CTL, RNG1/2 and DAT1/2 are read from the PWM block, and the PWM clock
+// from CLK.PWM_CNTL/PWM_DIV.  Only the registers with side effects go
+// through pwmsim_write(): FIF pushes into the 8-word FIFO, writing 1s to
+// STA clears its sticky flags, and CLRF1 in CTL empties the FIFO (the
+// model also notices CLRF1 written straight to memory).
+//
+// pwmsim_run() advances simulated time one channel period at a time,
+// modelling serializer and M/S modes, the PWM algorithm, RPTL, SBIT, POLA
+// and FIFO gaps, and reports every output level change to a callback.
+// With DMAC.ENAB set it calls a DREQ callback whenever the FIFO drops below
+// the DREQ threshold, so a simulated DMA channel (dma_sim_run) is paced
+// the way the hardware paces it.  The clock is modelled at its average
+// frequency; MASH jitter is not.  Hours of output simulate in seconds.
+
+#ifndef PWMSIM_H
+#define PWMSIM_H
+
+#include <stdint.h>
+
+#define PWMSIM_CHANNELS		2
+#define PWMSIM_FIFO_DEPTH	8
+
+/* PWM block registers, word indexes */
+#define PWMSIM_CTL	0
+#define PWMSIM_STA	1
+#define PWMSIM_DMAC	2
+#define PWMSIM_RNG1	4
+#define PWMSIM_DAT1	5
+#define PWMSIM_FIF	6
+#define PWMSIM_RNG2	8
+#define PWMSIM_DAT2	9
+
+struct pwmsim_channel {
+    uint64_t t_ps;              /* start of the current or next period */
+    int level;                  /* output after POLA */
+    uint32_t last;              /* last word taken from the FIFO, for RPTL */
+    uint32_t context;           /* PWM algorithm accumulator */
+
+    /* the current period */
+    int loaded;
+    uint32_t ctl;               /* this channel's CTL bits when it started */
+    uint32_t word, rng;
+    uint32_t k;                 /* next clock tick */
+    int gap;                    /* the FIFO was empty: send SBIT */
+
+    /* statistics */
+    uint64_t periods;
+    uint64_t edges;
+    uint64_t high_ps;
+    uint64_t gaps;
+};
+
+struct pwmsim {
+    volatile uint32_t *pwm, *clk;
+
+    uint32_t fifo[PWMSIM_FIFO_DEPTH];
+    unsigned int fifo_head, fifo_count;
+    uint32_t sticky;            /* STA error and gap flags */
+
+    uint64_t t_ps;              /* simulated time, in picoseconds */
+    double clock_hz;            /* PWM clock, 0 while it is stopped */
+    struct pwmsim_channel ch[PWMSIM_CHANNELS];
+
+    void (*edge)(void *arg, int channel, uint64_t t_ns, int level);
+    void *edge_arg;
+    int (*dreq)(void *arg);     /* supply one FIFO word, 0 if none came */
+    void *dreq_arg;
+
+    uint64_t fifo_words;        /* words that entered the FIFO */
+    uint64_t overruns;          /* writes to a full FIFO */
+};
+
+// Attach the model to the PWM and clock blocks of the current backend.
+// Returns -1 with errno ENODEV when the backend is real hardware.
+int pwmsim_init(struct pwmsim *sim);
+
+// Register access with the side effects the hardware has
+void pwmsim_write(struct pwmsim *sim, unsigned int reg, uint32_t val);
+uint32_t pwmsim_read(struct pwmsim *sim, unsigned int reg);
+
+// Feed words into the FIFO, e.g. as a dma_sim_sink() for the FIF address
+void pwmsim_fifo_sink(void *arg, uint32_t word);
+
+// Advance simulated time by ns
+void pwmsim_run(struct pwmsim *sim, uint64_t ns);
+
+static inline uint64_t pwmsim_now_ns(const struct pwmsim *sim)
+{
+    return sim->t_ps / 1000;
+}
+
+#endif /* PWMSIM_H */
@@ -0,0 +1,271 @@
+// Cross-process register locks, see reglock.h
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <grp.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include <unistd.h>
+
+#include "periph.h"
+#include "reglock.h"
+
+#define REGLOCK_MAGIC	0x524c434b	/* "RLCK" */
+#define REGLOCK_VERSION	2
+
+/* Lock word: owner pid, plus this bit while someone sleeps on it */
+#define LOCK_WAITERS	0x80000000U
+
+/* Spin this many times before sleeping */
+#define SPIN_TRIES	100
+/* Sleep at most this long before checking the owner is alive */
+#define OWNER_CHECK_NS	10000000
+/* Give up on a live owner after this long; locks are held for microseconds */
+#define REGLOCK_TIMEOUT_NS	1000000000ULL
+
+struct reglock_slot {
+    uint32_t word;
+} __attribute__((aligned(64)));
+
+struct reglock_shm {
+    uint32_t magic;
+    uint32_t version;
+    struct reglock_slot slots[REGLOCK_SLOTS] __attribute__((aligned(64)));
+};
+
+static struct reglock_shm *table;
+static struct reglock_shm local;       /* when there's no shared memory */
+static struct reglock_stats stats;
+static uint32_t self;
+
+// a forked child owns locks under its own pid, not its parent's
+static void refresh_self(void)
+{
+    self = getpid();
+}
+
+// Whoever can write the table can hold every lock, so it belongs to root
+// (or whoever made it) and REGLOCK_GROUP, and nobody else may write it
+static int restrict_access(int fd)
+{
+    struct group *gr = getgrnam(REGLOCK_GROUP);
+    struct stat st;
+
+    if (fstat(fd, &st))
+        return -1;
+    if (geteuid() == 0 || st.st_uid == geteuid()) {
+        if (gr && fchown(fd, geteuid() == 0 ? 0 : (uid_t)-1, gr->gr_gid) == 0)
+            fchmod(fd, 0660);
+        else
+            fchmod(fd, 0600);
+        if (fstat(fd, &st))
+            return -1;
+    }
+    if (st.st_mode & S_IWOTH) {
+        errno = EPERM;
+        return -1;
+    }
+    return 0;
+}
+
+static struct reglock_shm *attach(void)
+{
+    struct reglock_shm *shm;
+    uint32_t magic = 0, version = 0;
+    int fd;
+
+    refresh_self();
+    pthread_atfork(NULL, NULL, refresh_self);
+    fd = shm_open(REGLOCK_SHM_NAME, O_RDWR|O_CREAT, 0600);
+    if (fd < 0)
+        goto local;
+    if (restrict_access(fd)) {
+        close(fd);
+        fprintf(stderr, "reglock: %s is open to other users, locks are process-local\n",
+                REGLOCK_SHM_NAME);
+        return &local;
+    }
+    if (ftruncate(fd, sizeof(*shm))) {
+        close(fd);
+        goto local;
+    }
+    shm = mmap(NULL, sizeof(*shm), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED)
+        goto local;
+
+    /* Zeroed is unlocked: whoever comes first only has to stamp it */
+    if (!__atomic_compare_exchange_n(&shm->magic, &magic, REGLOCK_MAGIC, 0,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) && magic != REGLOCK_MAGIC) {
+        munmap(shm, sizeof(*shm));
+        goto local;
+    }
+    /* Tools from before a layout change would lock other slots */
+    if (!__atomic_compare_exchange_n(&shm->version, &version, REGLOCK_VERSION, 0,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) && version != REGLOCK_VERSION) {
+        munmap(shm, sizeof(*shm));
+        fprintf(stderr, "reglock: %s has version %u, not %u, locks are process-local\n",
+                REGLOCK_SHM_NAME, version, REGLOCK_VERSION);
+        return &local;
+    }
+    stats.shared = 1;
+    return shm;
+
+local:
+    fprintf(stderr, "reglock: no shared memory (%s), locks are process-local\n",
+            strerror(errno));
+    return &local;
+}
+
+static inline uint32_t *lock_word(unsigned int slot)
+{
+    if (!table)
+        table = attach();
+    return &table->slots[slot % REGLOCK_SLOTS].word;
+}
+
+// FNV-1a over the register's byte offset in the window
+unsigned int reglock_slot(volatile uint32_t *blk, unsigned int reg)
+{
+    uint32_t offset = periph_offset(blk) + reg * 4, hash = 2166136261U;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        hash ^= (offset >> (i * 8)) & 0xff;
+        hash *= 16777619U;
+    }
+    return hash % REGLOCK_SLOTS;
+}
+
+static int owner_dead(uint32_t word)
+{
+    pid_t owner = word & ~LOCK_WAITERS;
+    return owner && kill(owner, 0) && errno == ESRCH;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int reglock_acquire(unsigned int slot)
+{
+    uint32_t *word = lock_word(slot);
+    uint32_t v = 0;
+    uint64_t start;
+    int i;
+
+    stats.locks++;
+    if (__atomic_compare_exchange_n(word, &v, self, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return 0;
+
+    stats.contended++;
+    for (i = 0; i < SPIN_TRIES; i++) {
+        v = 0;
+        if (__atomic_load_n(word, __ATOMIC_RELAXED) == 0 &&
+                __atomic_compare_exchange_n(word, &v, self, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return 0;
+    }
+
+    start = now_ns();
+    for (;;) {
+        struct timespec ts = { 0, OWNER_CHECK_NS };
+
+        v = __atomic_load_n(word, __ATOMIC_RELAXED);
+        if (v == 0) {
+            /* Others may still sleep on it: keep the waiters bit */
+            if (__atomic_compare_exchange_n(word, &v, self | LOCK_WAITERS, 0,
+                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                return 0;
+            continue;
+        }
+        if (!(v & LOCK_WAITERS) && !__atomic_compare_exchange_n(word, &v, v | LOCK_WAITERS,
+                    0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            continue;
+
+        stats.sleeps++;
+        if (syscall(SYS_futex, word, FUTEX_WAIT, v | LOCK_WAITERS, &ts, NULL, 0) &&
+                errno == ETIMEDOUT && owner_dead(v)) {
+            v |= LOCK_WAITERS;
+            if (__atomic_compare_exchange_n(word, &v, self | LOCK_WAITERS, 0,
+                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                stats.recovered++;
+                return 0;
+            }
+        }
+        /* A live owner that never lets go, or a pid someone wrote there */
+        if (now_ns() - start > REGLOCK_TIMEOUT_NS) {
+            stats.timeouts++;
+            fprintf(stderr, "reglock: slot %u held by pid %u for over %llu ms, giving up\n",
+                    slot % REGLOCK_SLOTS, v & ~LOCK_WAITERS,
+                    REGLOCK_TIMEOUT_NS / 1000000);
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+}
+
+void reglock_release(unsigned int slot)
+{
+    uint32_t *word = lock_word(slot);
+
+    if (__atomic_exchange_n(word, 0, __ATOMIC_RELEASE) & LOCK_WAITERS)
+        syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+static int slot_cmp(const void *a, const void *b)
+{
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+    return x < y ? -1 : x > y;
+}
+
+int reglock_acquire_all(unsigned int *slots, int n)
+{
+    int i, count = 0;
+
+    qsort(slots, n, sizeof(*slots), slot_cmp);
+    for (i = 0; i < n; i++)
+        if (!count || slots[i] != slots[count - 1])
+            slots[count++] = slots[i];
+    for (i = 0; i < count; i++)
+        if (reglock_acquire(slots[i])) {
+            reglock_release_all(slots, i);
+            return -1;
+        }
+    return count;
+}
+
+void reglock_release_all(const unsigned int *slots, int n)
+{
+    while (n--)
+        reglock_release(slots[n]);
+}
+
+int reglock_rmw(volatile uint32_t *blk, unsigned int reg, uint32_t mask, uint32_t value)
+{
+    unsigned int slot = reglock_slot(blk, reg);
+
+    if (reglock_acquire(slot))
+        return -1;
+    periph_wr(blk, reg, (periph_rd(blk, reg) & ~mask) | value);
+    reglock_release(slot);
+    return 0;
+}
+
+void reglock_get_stats(struct reglock_stats *s)
+{
+    if (!table)
+        table = attach();
+    *s = stats;
+}
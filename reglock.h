@@ -0,0 +1,71 @@
+// Cross-process locks for register read-modify-write
+//
+// GPFSEL banks, PWM CTL and the like pack several independent settings
+// into one register, so two processes changing different pins of the same
+// bank can silently undo each other's write.  These locks close that
+// window.  They live in a POSIX shared memory object, one futex word per
+// register, each on its own cache line: registers are locked by their
+// offset in the peripheral window, so every process and every backend
+// agrees on them, and writers of different registers never touch the same
+// line.  The object is created zeroed, which is the unlocked state, so
+// there is nothing to initialise.
+//
+// Uncontended, a lock is one compare-and-swap and an unlock one exchange,
+// with no system call: the pid is cached and refreshed in a forked child, so
+// the child is its own owner (link with -lpthread).  A waiter spins
+// briefly, then sleeps on the futex.  The lock word holds the owner's pid,
+// and a lock whose owner has died is taken over, so a killed tool can't
+// wedge the others.  A lock still held by a live process after a second
+// fails with ETIMEDOUT rather than hang.
+//
+// Anyone who can write the table can hold every lock, so it is open only to
+// its owner (root, normally) and the REGLOCK_GROUP group, and a table that
+// others may write is refused.
+//
+// A register's slot is a hash of its offset in the window, so registers at
+// the same offset in different blocks (GPFSEL0, PWM CTL, DMA CS) don't
+// share one.  Two registers only land on the same slot by chance, which
+// costs at most a short wait; none of the GPIO, PWM and clock registers do.
+// Code that holds more than one lock at a time must take them in ascending
+// slot order.
+//
+// Without /dev/shm the locks still work, but only within the process.
+
+#ifndef REGLOCK_H
+#define REGLOCK_H
+
+#include <stdint.h>
+
+#define REGLOCK_SHM_NAME	"/rpi-tools-reglock"
+#define REGLOCK_SLOTS		4096
+#define REGLOCK_GROUP		"gpio"
+
+struct reglock_stats {
+    uint64_t locks;
+    uint64_t contended;         /* had to wait */
+    uint64_t sleeps;            /* futex waits */
+    uint64_t recovered;         /* taken over from a dead owner */
+    uint64_t timeouts;          /* gave up on a live owner */
+    int shared;                 /* 0 when the locks are process-local */
+};
+
+// Slot of the register at word index reg of a block from periph_map()
+unsigned int reglock_slot(volatile uint32_t *blk, unsigned int reg);
+
+// 0, or -1 with errno ETIMEDOUT when the owner holds on for over a second
+int reglock_acquire(unsigned int slot);
+void reglock_release(unsigned int slot);
+
+// Lock n slots at once: sorts them, drops duplicates and takes them in
+// ascending order.  Returns how many are left in slots, for
+// reglock_release_all(), or -1 with none taken if one timed out.
+int reglock_acquire_all(unsigned int *slots, int n);
+void reglock_release_all(const unsigned int *slots, int n);
+
+// blk[reg] = (blk[reg] & ~mask) | value under the register's lock.
+// Returns 0, or -1 without writing when the lock timed out.
+int reglock_rmw(volatile uint32_t *blk, unsigned int reg, uint32_t mask, uint32_t value);
+
+void reglock_get_stats(struct reglock_stats *stats);
+
+#endif /* REGLOCK_H */
@@ -0,0 +1,803 @@
+// Register description loader, see regs.h
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <unistd.h>
+
+#include "regs.h"
+
+#define REG_FILE_MAGIC "RPIR"
+#define REG_FILE_VERSION 1
+
+#define REG_DEFAULT_PATH "regs.txt"
+
+#define REG_NAME_MAX 32
+#define REG_MAX_WORDS 16
+
+/* Compiled index: this header, then the hash index, blocks, registers,
+   fields and strings, each padded to a multiple of 4 bytes */
+struct reg_file_header {
+    char magic[4];
+    uint32_t version;
+    uint64_t source_size;       /* of the description it was compiled from */
+    int64_t source_mtime_ns;
+    uint32_t nblocks;
+    uint32_t nregs;
+    uint32_t nfields;
+    uint32_t strings_size;
+    uint32_t index_size;
+    uint32_t size;              /* of the whole file */
+};
+
+/* The description parsed so far */
+struct reg_compiler {
+    const char *path;
+    int line;
+
+    struct reg_block blocks[REG_MAX_BLOCKS];
+    unsigned int nblocks;
+
+    struct reg_desc *regs;
+    unsigned int nregs, regs_alloc;
+    char (*gates)[REG_NAME_MAX];        /* gate= name per register */
+    unsigned int gates_alloc;
+    int shared;                 /* the last register uses fields= */
+
+    struct reg_field *fields;
+    unsigned int nfields, fields_alloc;
+
+    char *strings;
+    unsigned int strings_size, strings_alloc;
+};
+
+// FNV-1a over a name
+static uint32_t name_hash(const char *name, size_t len)
+{
+    uint32_t hash = 2166136261U;
+    while (len--) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static uint32_t hash_append(uint32_t hash, const char *str)
+{
+    while (*str) {
+        hash ^= (unsigned char)*str++;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static uint32_t path_hash(const struct reg_map *map, const struct reg_desc *reg,
+        const struct reg_field *field)
+{
+    uint32_t hash = name_hash(NULL, 0);
+
+    hash = hash_append(hash, reg_str(map, map->blocks[reg->block].name));
+    hash = hash_append(hash, ".");
+    hash = hash_append(hash, reg_str(map, reg->name));
+    if (field) {
+        hash = hash_append(hash, ".");
+        hash = hash_append(hash, reg_str(map, field->name));
+    }
+    return hash;
+}
+
+// compare name against one segment of a path, returning what follows it
+static const char *match_segment(const char *name, const char *end, const char *seg)
+{
+    size_t len = strlen(seg);
+    if ((size_t)(end - name) < len || memcmp(name, seg, len))
+        return NULL;
+    return name + len;
+}
+
+static int path_equal(const struct reg_map *map, const struct reg_index_entry *entry,
+        const char *name, const char *end)
+{
+    const struct reg_desc *reg = &map->regs[entry->reg];
+
+    if (!(name = match_segment(name, end, reg_str(map, map->blocks[reg->block].name))) ||
+            !(name = match_segment(name, end, ".")) ||
+            !(name = match_segment(name, end, reg_str(map, reg->name))))
+        return 0;
+    if (entry->field != REG_INDEX_NONE) {
+        if (!(name = match_segment(name, end, ".")) ||
+                !(name = match_segment(name, end,
+                        reg_str(map, map->fields[entry->field].name))))
+            return 0;
+    }
+    return name == end;
+}
+
+static void index_insert(struct reg_index_entry *index, unsigned int mask,
+        uint32_t hash, unsigned int reg, unsigned int field)
+{
+    unsigned int slot = hash & mask;
+    while (index[slot].reg != REG_INDEX_NONE)
+        slot = (slot + 1) & mask;
+    index[slot].hash = hash;
+    index[slot].reg = reg;
+    index[slot].field = field;
+}
+
+static int parse_error(struct reg_compiler *c, const char *fmt, ...)
+{
+    va_list ap;
+
+    fprintf(stderr, "%s:%d: ", c->path, c->line);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    errno = EINVAL;
+    return -1;
+}
+
+static int grow(void **array, unsigned int *alloc, unsigned int need, size_t size)
+{
+    unsigned int n = *alloc ? *alloc : 64;
+    void *bigger;
+
+    if (need <= *alloc)
+        return 0;
+    while (n < need)
+        n *= 2;
+    if ((bigger = realloc(*array, (size_t)n * size)) == NULL)
+        return -1;
+    *array = bigger;
+    *alloc = n;
+    return 0;
+}
+
+// store a string once, however many entries use it
+static int intern(struct reg_compiler *c, const char *str, uint16_t *out)
+{
+    size_t len = strlen(str) + 1;
+    unsigned int off;
+
+    for (off = 0; off < c->strings_size; off += strlen(c->strings + off) + 1)
+        if (!strcmp(c->strings + off, str)) {
+            *out = off;
+            return 0;
+        }
+    if (c->strings_size + len > 0xffff)
+        return parse_error(c, "more than 64 KB of names and descriptions");
+    if (grow((void **)&c->strings, &c->strings_alloc, c->strings_size + len, 1))
+        return -1;
+    memcpy(c->strings + c->strings_size, str, len);
+    *out = c->strings_size;
+    c->strings_size += len;
+    return 0;
+}
+
+static const char *cstr(struct reg_compiler *c, uint16_t str)
+{
+    return c->strings + str;
+}
+
+static int parse_number(struct reg_compiler *c, const char *word, uint32_t *value)
+{
+    char *end;
+    unsigned long v;
+
+    errno = 0;
+    v = strtoul(word, &end, 0);
+    if (end == word || *end || errno || v > 0xffffffffUL)
+        return parse_error(c, "bad number \"%s\"", word);
+    *value = v;
+    return 0;
+}
+
+// split a line into words, keeping a "quoted description" apart; it has to
+// come last
+static int tokenize(struct reg_compiler *c, char *line, char **words, char **desc)
+{
+    int n = 0;
+
+    *desc = NULL;
+    for (;;) {
+        while (*line == ' ' || *line == '\t' || *line == '\n' || *line == '\r')
+            line++;
+        if (!*line || *line == '#')
+            return n;
+        if (*desc)
+            return parse_error(c, "the description has to come last");
+        if (*line == '"') {
+            *desc = ++line;
+            if ((line = strchr(line, '"')) == NULL)
+                return parse_error(c, "unterminated description");
+            *line++ = '\0';
+            continue;
+        }
+        if (n == REG_MAX_WORDS)
+            return parse_error(c, "too many words");
+        words[n++] = line;
+        while (*line && *line != ' ' && *line != '\t' && *line != '\n' && *line != '\r')
+            line++;
+        if (*line)
+            *line++ = '\0';
+    }
+}
+
+// the register being described must have fields by the time the next one starts
+static int finish_reg(struct reg_compiler *c)
+{
+    if (c->nregs && !c->regs[c->nregs - 1].nfields)
+        return parse_error(c, "register %s has no fields", cstr(c, c->regs[c->nregs - 1].name));
+    return 0;
+}
+
+// resolve the gate= names of the block that just ended
+static int finish_block(struct reg_compiler *c)
+{
+    struct reg_block *block;
+    unsigned int reg_num, gate_num, field_num;
+
+    if (finish_reg(c))
+        return -1;
+    if (!c->nblocks)
+        return 0;
+    block = &c->blocks[c->nblocks - 1];
+    block->nregs = c->nregs - block->first_reg;
+
+    for (reg_num = block->first_reg; reg_num < c->nregs; reg_num++) {
+        struct reg_desc *reg = &c->regs[reg_num];
+        const struct reg_desc *gate;
+
+        if (!c->gates[reg_num][0])
+            continue;
+        for (gate_num = block->first_reg; gate_num < c->nregs; gate_num++)
+            if (!strcmp(cstr(c, c->regs[gate_num].name), c->gates[reg_num]))
+                break;
+        if (gate_num == c->nregs)
+            return parse_error(c, "gate %s of %s.%s is not in the block", c->gates[reg_num],
+                    cstr(c, block->name), cstr(c, reg->name));
+        gate = &c->regs[gate_num];
+        for (field_num = gate->first_field; field_num < gate->first_field + gate->nfields;
+                field_num++)
+            if (c->fields[field_num].flags & REG_F_GATE)
+                break;
+        if (field_num == gate->first_field + gate->nfields)
+            return parse_error(c, "gate %s.%s has no gate field",
+                    cstr(c, block->name), cstr(c, gate->name));
+        reg->gate = gate_num - block->first_reg;
+    }
+    return 0;
+}
+
+// block NAME OFFSET "description"
+static int parse_block(struct reg_compiler *c, char **words, int n, const char *desc)
+{
+    struct reg_block *block;
+    unsigned int block_num;
+    uint32_t offset;
+
+    if (n != 3 || !desc)
+        return parse_error(c, "expected block NAME OFFSET \"description\"");
+    if (finish_block(c))
+        return -1;
+    if (c->nblocks == REG_MAX_BLOCKS)
+        return parse_error(c, "more than %d blocks", REG_MAX_BLOCKS);
+    for (block_num = 0; block_num < c->nblocks; block_num++)
+        if (!strcmp(cstr(c, c->blocks[block_num].name), words[1]))
+            return parse_error(c, "duplicate block %s", words[1]);
+    if (parse_number(c, words[2], &offset))
+        return -1;
+
+    block = &c->blocks[c->nblocks];
+    memset(block, 0, sizeof(*block));
+    if (intern(c, words[1], &block->name) || intern(c, desc, &block->description))
+        return -1;
+    block->offset = offset;
+    block->first_reg = c->nregs;
+    c->nblocks++;
+    return 0;
+}
+
+// reg NAME OFFSET [order=N] [gate=REG] [required=MASK] [fields=REG] "description"
+static int parse_reg(struct reg_compiler *c, char **words, int n, const char *desc)
+{
+    const struct reg_block *block;
+    struct reg_desc *reg;
+    unsigned int reg_num;
+    uint32_t offset, value;
+    int i;
+
+    if (!c->nblocks)
+        return parse_error(c, "reg outside a block");
+    block = &c->blocks[c->nblocks - 1];
+    if (n < 3 || !desc)
+        return parse_error(c, "expected reg NAME OFFSET [options] \"description\"");
+    if (finish_reg(c))
+        return -1;
+    if (strlen(words[1]) >= REG_NAME_MAX)
+        return parse_error(c, "register name %s is too long", words[1]);
+    if (parse_number(c, words[2], &offset))
+        return -1;
+    if ((offset & 3) || offset > 0xffff)
+        return parse_error(c, "bad register offset 0x%x", offset);
+    for (reg_num = block->first_reg; reg_num < c->nregs; reg_num++) {
+        if (!strcmp(cstr(c, c->regs[reg_num].name), words[1]))
+            return parse_error(c, "duplicate register %s.%s", cstr(c, block->name), words[1]);
+        if (c->regs[reg_num].offset == offset)
+            return parse_error(c, "%s.%s is at the same offset as %s", cstr(c, block->name),
+                    words[1], cstr(c, c->regs[reg_num].name));
+    }
+    if (c->nregs + 1 >= REG_INDEX_NONE)
+        return parse_error(c, "too many registers");
+    if (grow((void **)&c->regs, &c->regs_alloc, c->nregs + 1, sizeof(*c->regs)) ||
+            grow((void **)&c->gates, &c->gates_alloc, c->nregs + 1, sizeof(*c->gates)))
+        return -1;
+
+    reg = &c->regs[c->nregs];
+    memset(reg, 0, sizeof(*reg));
+    c->gates[c->nregs][0] = '\0';
+    if (intern(c, words[1], &reg->name) || intern(c, desc, &reg->description))
+        return -1;
+    reg->offset = offset;
+    reg->first_field = c->nfields;
+    reg->block = c->nblocks - 1;
+    reg->gate = REG_GATE_NONE;
+    c->shared = 0;
+
+    for (i = 3; i < n; i++) {
+        char *eq = strchr(words[i], '=');
+
+        if (!eq)
+            return parse_error(c, "expected option=value, not \"%s\"", words[i]);
+        *eq++ = '\0';
+        if (!strcmp(words[i], "gate")) {
+            if (strlen(eq) >= REG_NAME_MAX)
+                return parse_error(c, "gate name %s is too long", eq);
+            strcpy(c->gates[c->nregs], eq);
+        } else if (!strcmp(words[i], "fields")) {
+            for (reg_num = block->first_reg; reg_num < c->nregs; reg_num++)
+                if (!strcmp(cstr(c, c->regs[reg_num].name), eq))
+                    break;
+            if (reg_num == c->nregs)
+                return parse_error(c, "fields=%s: no earlier register of that name", eq);
+            reg->first_field = c->regs[reg_num].first_field;
+            reg->nfields = c->regs[reg_num].nfields;
+            c->shared = 1;
+        } else if (parse_number(c, eq, &value)) {
+            return -1;
+        } else if (!strcmp(words[i], "order")) {
+            if (value > 0xff)
+                return parse_error(c, "order %u is too large", value);
+            reg->order = value;
+        } else if (!strcmp(words[i], "required")) {
+            reg->required = value;
+        } else {
+            return parse_error(c, "unknown option %s", words[i]);
+        }
+    }
+    c->nregs++;
+    return 0;
+}
+
+static int parse_flags(struct reg_compiler *c, char *word, uint8_t *flags)
+{
+    char *flag;
+
+    *flags = 0;
+    for (flag = strtok(word, ","); flag; flag = strtok(NULL, ",")) {
+        if (!strcmp(flag, "r"))
+            *flags |= REG_F_READABLE;
+        else if (!strcmp(flag, "w"))
+            *flags |= REG_F_WRITEABLE;
+        else if (!strcmp(flag, "rw"))
+            *flags |= REG_F_RW;
+        else if (!strcmp(flag, "gate"))
+            *flags |= REG_F_GATE;
+        else
+            return parse_error(c, "unknown field flag %s", flag);
+    }
+    if (!(*flags & REG_F_RW))
+        return parse_error(c, "field must be r, w or rw");
+    return 0;
+}
+
+// field NAME HIGH[:LOW] FLAGS [reset=VALUE] "description", or field - HIGH[:LOW]
+static int parse_field(struct reg_compiler *c, char **words, int n, const char *desc)
+{
+    struct reg_desc *reg;
+    struct reg_field *field;
+    int reserved = n > 1 && !strcmp(words[1], "-");
+    unsigned int field_num;
+    uint32_t high, low, mask;
+    char *colon;
+
+    if (!c->nregs || c->regs[c->nregs - 1].block != c->nblocks - 1)
+        return parse_error(c, "field outside a register");
+    reg = &c->regs[c->nregs - 1];
+    if (c->shared)
+        return parse_error(c, "%s already shares its fields", cstr(c, reg->name));
+    if (reserved ? n != 3 || desc : n < 4 || n > 5 || !desc)
+        return parse_error(c, "expected field NAME HIGH[:LOW] FLAGS [reset=VALUE] \"description\""
+                " or field - HIGH[:LOW]");
+
+    if ((colon = strchr(words[2], ':')) != NULL)
+        *colon++ = '\0';
+    if (parse_number(c, words[2], &high) || parse_number(c, colon ? colon : words[2], &low))
+        return -1;
+    if (low > high || high > 31)
+        return parse_error(c, "bad bit range %u:%u", high, low);
+    mask = (high - low == 31 ? 0xffffffff : (1U << (high - low + 1)) - 1) << low;
+
+    for (field_num = reg->first_field; field_num < c->nfields; field_num++) {
+        const struct reg_field *other = &c->fields[field_num];
+
+        if (mask & (reg_field_mask(other) << other->start))
+            return parse_error(c, "%s.%s overlaps %s", cstr(c, reg->name),
+                    reserved ? "reserved bits" : words[1],
+                    other->name ? cstr(c, other->name) : "reserved bits");
+        if (!reserved && other->name && !strcmp(cstr(c, other->name), words[1]))
+            return parse_error(c, "duplicate field %s.%s", cstr(c, reg->name), words[1]);
+    }
+    if (reg->nfields == 0xff || c->nfields + 1 >= REG_INDEX_NONE)
+        return parse_error(c, "too many fields");
+    if (grow((void **)&c->fields, &c->fields_alloc, c->nfields + 1, sizeof(*c->fields)))
+        return -1;
+
+    field = &c->fields[c->nfields];
+    memset(field, 0, sizeof(*field));
+    field->start = low;
+    field->stop = high;
+    if (reserved) {
+        field->flags = REG_F_RESERVED;
+    } else {
+        if (intern(c, words[1], &field->name) || intern(c, desc, &field->description) ||
+                parse_flags(c, words[3], &field->flags))
+            return -1;
+        if (n == 5) {
+            if (strncmp(words[4], "reset=", 6))
+                return parse_error(c, "expected reset=VALUE, not \"%s\"", words[4]);
+            if (parse_number(c, words[4] + 6, &field->reset))
+                return -1;
+            if ((field->reset << low) & ~mask || field->reset > (mask >> low))
+                return parse_error(c, "reset value 0x%x does not fit %s", field->reset, words[1]);
+        }
+    }
+    c->nfields++;
+    reg->nfields++;
+    return 0;
+}
+
+static int parse_description(struct reg_compiler *c, FILE *f)
+{
+    char line[1024], *words[REG_MAX_WORDS], *desc;
+    uint16_t empty;
+    int n, err;
+
+    if (intern(c, "", &empty))
+        return -1;
+    while (fgets(line, sizeof(line), f)) {
+        c->line++;
+        if ((n = tokenize(c, line, words, &desc)) < 0)
+            return -1;
+        if (!n) {
+            if (desc)
+                return parse_error(c, "description without an entry");
+            continue;
+        }
+        if (!strcmp(words[0], "block"))
+            err = parse_block(c, words, n, desc);
+        else if (!strcmp(words[0], "reg"))
+            err = parse_reg(c, words, n, desc);
+        else if (!strcmp(words[0], "field"))
+            err = parse_field(c, words, n, desc);
+        else
+            err = parse_error(c, "unknown entry %s", words[0]);
+        if (err)
+            return -1;
+    }
+    if (!c->nblocks)
+        return parse_error(c, "no blocks");
+    return finish_block(c);
+}
+
+// point a map at the sections of a compiled index
+static void map_sections(struct reg_map *map, const struct reg_file_header *header)
+{
+    const char *p = (const char *)(header + 1);
+
+    map->index = (const struct reg_index_entry *)p;
+    map->index_mask = header->index_size - 1;
+    p += header->index_size * sizeof(*map->index);
+    map->blocks = (const struct reg_block *)p;
+    map->nblocks = header->nblocks;
+    p += header->nblocks * sizeof(*map->blocks);
+    map->regs = (const struct reg_desc *)p;
+    map->nregs = header->nregs;
+    p += header->nregs * sizeof(*map->regs);
+    map->fields = (const struct reg_field *)p;
+    map->nfields = header->nfields;
+    p += header->nfields * sizeof(*map->fields);
+    map->strings = p;
+    map->strings_size = header->strings_size;
+}
+
+static size_t file_size(const struct reg_file_header *header)
+{
+    return sizeof(*header) + header->index_size * sizeof(struct reg_index_entry) +
+        header->nblocks * sizeof(struct reg_block) + header->nregs * sizeof(struct reg_desc) +
+        header->nfields * sizeof(struct reg_field) + ((header->strings_size + 3) & ~3);
+}
+
+static int64_t mtime_ns(const struct stat *st)
+{
+    return (int64_t)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+// lay the parsed description out as an index file, hash index included
+static struct reg_file_header *build(struct reg_compiler *c, const struct stat *source)
+{
+    struct reg_file_header *header;
+    struct reg_index_entry *index;
+    struct reg_map map;
+    unsigned int entries = c->nregs, index_size = 16, reg_num, field_num;
+
+    /* Registers plus named fields, at most half full */
+    for (reg_num = 0; reg_num < c->nregs; reg_num++)
+        for (field_num = c->regs[reg_num].first_field;
+                field_num < c->regs[reg_num].first_field + c->regs[reg_num].nfields; field_num++)
+            entries += c->fields[field_num].name != 0;
+    while (index_size < 2 * entries)
+        index_size *= 2;
+
+    header = calloc(1, sizeof(*header) + index_size * sizeof(*index) +
+            c->nblocks * sizeof(*c->blocks) + c->nregs * sizeof(*c->regs) +
+            c->nfields * sizeof(*c->fields) + ((c->strings_size + 3) & ~3));
+    if (!header)
+        return NULL;
+    memcpy(header->magic, REG_FILE_MAGIC, 4);
+    header->version = REG_FILE_VERSION;
+    header->source_size = source->st_size;
+    header->source_mtime_ns = mtime_ns(source);
+    header->nblocks = c->nblocks;
+    header->nregs = c->nregs;
+    header->nfields = c->nfields;
+    header->strings_size = c->strings_size;
+    header->index_size = index_size;
+    header->size = file_size(header);
+
+    map_sections(&map, header);
+    memcpy((void *)map.blocks, c->blocks, c->nblocks * sizeof(*c->blocks));
+    memcpy((void *)map.regs, c->regs, c->nregs * sizeof(*c->regs));
+    memcpy((void *)map.fields, c->fields, c->nfields * sizeof(*c->fields));
+    memcpy((void *)map.strings, c->strings, c->strings_size);
+
+    index = (struct reg_index_entry *)map.index;
+    memset(index, 0xff, index_size * sizeof(*index));
+    for (reg_num = 0; reg_num < map.nregs; reg_num++) {
+        const struct reg_desc *reg = &map.regs[reg_num];
+
+        index_insert(index, map.index_mask, path_hash(&map, reg, NULL),
+                reg_num, REG_INDEX_NONE);
+        for (field_num = reg->first_field; field_num < reg->first_field + reg->nfields;
+                field_num++) {
+            const struct reg_field *field = &map.fields[field_num];
+            if (field->name)
+                index_insert(index, map.index_mask, path_hash(&map, reg, field),
+                        reg_num, field_num);
+        }
+    }
+    return header;
+}
+
+static struct reg_file_header *compile(const char *path, const struct stat *source)
+{
+    struct reg_compiler c;
+    struct reg_file_header *header = NULL;
+    FILE *f;
+
+    memset(&c, 0, sizeof(c));
+    c.path = path;
+    if ((f = fopen(path, "r")) == NULL)
+        return NULL;
+    if (!parse_description(&c, f))
+        header = build(&c, source);
+    fclose(f);
+    free(c.regs);
+    free(c.gates);
+    free(c.fields);
+    free(c.strings);
+    return header;
+}
+
+// write the index next to the description; a reader never sees half a file
+static void save(const char *bin, const struct reg_file_header *header)
+{
+    char tmp[PATH_MAX + 16];
+    FILE *f;
+    int err;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", bin, (int)getpid());
+    if ((f = fopen(tmp, "wb")) == NULL)
+        return;
+    err = fwrite(header, header->size, 1, f) != 1;
+    if (fclose(f) || err || rename(tmp, bin))
+        unlink(tmp);
+}
+
+static int str_ok(const struct reg_map *map, uint16_t str)
+{
+    return str < map->strings_size;
+}
+
+// check every count, offset and index in a compiled index against the
+// file, so a damaged or hand-made one can't send a lookup out of bounds
+static int check(const struct reg_file_header *header)
+{
+    struct reg_map map;
+    unsigned int i, empty = 0;
+
+    if (header->nblocks > REG_MAX_BLOCKS || header->nregs >= REG_INDEX_NONE ||
+            header->nfields >= REG_INDEX_NONE || header->strings_size > 0x10000 ||
+            !header->strings_size || header->index_size < 2 ||
+            header->index_size > 4 * REG_INDEX_NONE ||
+            header->index_size & (header->index_size - 1) ||
+            file_size(header) != header->size)
+        return -1;
+
+    map_sections(&map, header);
+    if (map.strings[map.strings_size - 1] != '\0')
+        return -1;
+    for (i = 0; i < map.nblocks; i++) {
+        const struct reg_block *block = &map.blocks[i];
+        if (!block->name || !str_ok(&map, block->name) || !str_ok(&map, block->description) ||
+                block->first_reg + block->nregs > map.nregs)
+            return -1;
+    }
+    for (i = 0; i < map.nregs; i++) {
+        const struct reg_desc *reg = &map.regs[i];
+        if (!reg->name || !str_ok(&map, reg->name) || !str_ok(&map, reg->description) ||
+                reg->block >= map.nblocks || i < map.blocks[reg->block].first_reg ||
+                i >= map.blocks[reg->block].first_reg + map.blocks[reg->block].nregs ||
+                reg->first_field + reg->nfields > map.nfields ||
+                (reg->gate != REG_GATE_NONE && reg->gate >= map.blocks[reg->block].nregs))
+            return -1;
+    }
+    for (i = 0; i < map.nfields; i++) {
+        const struct reg_field *field = &map.fields[i];
+        if (!str_ok(&map, field->name) || !str_ok(&map, field->description) ||
+                field->start > field->stop || field->stop > 31)
+            return -1;
+    }
+    for (i = 0; i <= map.index_mask; i++) {
+        const struct reg_index_entry *entry = &map.index[i];
+        if (entry->reg == REG_INDEX_NONE) {
+            empty++;
+            continue;
+        }
+        if (entry->reg >= map.nregs ||
+                (entry->field != REG_INDEX_NONE && entry->field >= map.nfields))
+            return -1;
+    }
+    /* A lookup probes until it finds an empty slot */
+    return empty ? 0 : -1;
+}
+
+// map a compiled index, NULL if there is none or it doesn't look right
+static const struct reg_file_header *load(const char *bin)
+{
+    const struct reg_file_header *header;
+    struct stat st;
+    void *mem;
+    int fd;
+
+    if ((fd = open(bin, O_RDONLY)) < 0)
+        return NULL;
+    if (fstat(fd, &st) || st.st_size < (off_t)sizeof(*header)) {
+        close(fd);
+        return NULL;
+    }
+    mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+        return NULL;
+
+    header = mem;
+    if (memcmp(header->magic, REG_FILE_MAGIC, 4) || header->version != REG_FILE_VERSION ||
+            header->size != st.st_size || check(header)) {
+        munmap(mem, st.st_size);
+        return NULL;
+    }
+    return header;
+}
+
+static int have_map(const char *path)
+{
+    char bin[PATH_MAX];
+
+    if (snprintf(bin, sizeof(bin), "%s.bin", path) >= (int)sizeof(bin))
+        return 0;
+    return !access(path, R_OK) || !access(bin, R_OK);
+}
+
+// regs.txt in the current directory, or else the one next to the program,
+// so the tools work from anywhere once built
+static const char *default_path(char *buf, size_t size)
+{
+    char *slash;
+    ssize_t len;
+
+    if (have_map(REG_DEFAULT_PATH))
+        return REG_DEFAULT_PATH;
+    len = readlink("/proc/self/exe", buf, size - 1);
+    if (len <= 0 || (size_t)len + sizeof(REG_DEFAULT_PATH) > size)
+        return REG_DEFAULT_PATH;
+    buf[len] = '\0';
+    if ((slash = strrchr(buf, '/')) == NULL)
+        return REG_DEFAULT_PATH;
+    strcpy(slash + 1, REG_DEFAULT_PATH);
+    return have_map(buf) ? buf : REG_DEFAULT_PATH;
+}
+
+const struct reg_map *reg_map_load(const char *path)
+{
+    const struct reg_file_header *header;
+    struct reg_map *map;
+    char bin[PATH_MAX], exe[PATH_MAX];
+    struct stat st;
+    int have_source;
+
+    if (!path && (path = getenv("RPI_REGS")) == NULL)
+        path = default_path(exe, sizeof(exe));
+    if (snprintf(bin, sizeof(bin), "%s.bin", path) >= (int)sizeof(bin)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+
+    /* Use the index if it was compiled from this description, or if the
+       description isn't around at all */
+    have_source = !stat(path, &st);
+    if ((header = load(bin)) != NULL && have_source &&
+            (header->source_size != (uint64_t)st.st_size ||
+             header->source_mtime_ns != mtime_ns(&st))) {
+        munmap((void *)header, header->size);
+        header = NULL;
+    }
+    if (!header) {
+        if (!have_source)
+            return NULL;
+        if ((header = compile(path, &st)) == NULL)
+            return NULL;
+        save(bin, header);
+    }
+
+    if ((map = calloc(1, sizeof(*map))) == NULL)
+        return NULL;
+    map_sections(map, header);
+    return map;
+}
+
+int reg_lookup(const struct reg_map *map, const char *name, size_t len,
+        struct reg_ref *ref)
+{
+    uint32_t hash = name_hash(name, len);
+    unsigned int slot = hash & map->index_mask;
+
+    for (; map->index[slot].reg != REG_INDEX_NONE; slot = (slot + 1) & map->index_mask) {
+        const struct reg_index_entry *entry = &map->index[slot];
+        if (entry->hash != hash || !path_equal(map, entry, name, name + len))
+            continue;
+        ref->reg = entry->reg;
+        ref->block = map->regs[entry->reg].block;
+        ref->field = entry->field == REG_INDEX_NONE ? -1 : entry->field;
+        return 0;
+    }
+    return -1;
+}
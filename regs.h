@@ -0,0 +1,130 @@
+// Register descriptor tables for the PWM, clock and GPIO blocks
+//
+// The descriptors are flat arrays with explicit counts: each block owns a
+// run of registers, each register a run of fields.  Names and descriptions
+// live in one string table and are referenced by 16-bit offset, with 0
+// meaning "no string".
+//
+// Fully qualified names (BLOCK.REG and BLOCK.REG.FIELD) are found through a
+// hash index over the tables, so a lookup is one hash and one compare no
+// matter how many registers are described, and only exact names match.
+//
+// The tables come from a text description (regs.txt documents the format).
+// It is checked for overlapping fields and duplicate names and compiled to
+// an index file holding the tables and the hash index exactly as they are
+// used, which later runs map read-only instead of parsing anything.
+
+#ifndef REGS_H
+#define REGS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define REG_MAX_BLOCKS	16
+
+#define REG_F_RESERVED	0x01
+#define REG_F_READABLE	0x02
+#define REG_F_WRITEABLE	0x04
+#define REG_F_RW	(REG_F_READABLE | REG_F_WRITEABLE)
+#define REG_F_GATE	0x08	/* must be cleared while gated registers change */
+
+#define REG_GATE_NONE	0xff
+
+struct reg_field {
+    uint16_t name;
+    uint16_t description;
+    uint8_t start;              /* lowest bit of the field */
+    uint8_t stop;               /* highest bit of the field */
+    uint8_t flags;              /* REG_F_* */
+    uint8_t pad;
+    uint32_t reset;
+};
+
+struct reg_desc {
+    uint16_t name;
+    uint16_t description;
+    uint16_t offset;            /* byte offset inside the block */
+    uint16_t first_field;       /* index into reg_map.fields */
+    uint8_t nfields;
+    uint8_t block;              /* index of the owning block */
+    uint8_t order;              /* commit rank inside the block, lowest first */
+    uint8_t gate;               /* block-relative index of the register whose
+                                   REG_F_GATE fields stop the hardware while
+                                   this one changes, or REG_GATE_NONE */
+    uint32_t required;          /* bits that must be set on every write */
+};
+
+struct reg_block {
+    uint16_t name;
+    uint16_t description;
+    uint32_t offset;            /* offset inside the peripheral window */
+    uint16_t first_reg;         /* index into reg_map.regs */
+    uint16_t nregs;
+};
+
+#define REG_INDEX_NONE	0xffff
+
+struct reg_index_entry {
+    uint32_t hash;
+    uint16_t reg;               /* REG_INDEX_NONE marks an empty slot */
+    uint16_t field;             /* REG_INDEX_NONE for a whole register */
+};
+
+struct reg_map {
+    const struct reg_block *blocks;
+    unsigned int nblocks;
+    const struct reg_desc *regs;
+    unsigned int nregs;
+    const struct reg_field *fields;
+    unsigned int nfields;
+    const char *strings;
+    unsigned int strings_size;
+    const struct reg_index_entry *index;
+    unsigned int index_mask;    /* index size - 1, a power of two */
+};
+
+/* Result of a name lookup */
+struct reg_ref {
+    int block;
+    int reg;
+    int field;                  /* -1 when the name was a register */
+};
+
+// Load the register map described by path, or when path is NULL by
+// $RPI_REGS, else regs.txt in the current directory, else regs.txt in the
+// directory of the running program.  The compiled index is kept in
+// path.bin and rebuilt whenever the description changes; without a
+// description an existing index is used as is, once its tables check out.
+// Returns NULL with errno set on failure, after printing where a
+// description is wrong.
+const struct reg_map *reg_map_load(const char *path);
+
+// Find a BLOCK.REG or BLOCK.REG.FIELD name of the given length.  Returns 0
+// and fills in ref on an exact match, -1 otherwise.
+int reg_lookup(const struct reg_map *map, const char *name, size_t len,
+        struct reg_ref *ref);
+
+static inline const char *reg_str(const struct reg_map *map, uint16_t str)
+{
+    return str ? map->strings + str : NULL;
+}
+
+static inline uint32_t reg_field_mask(const struct reg_field *field)
+{
+    unsigned int width = field->stop - field->start + 1;
+    return width >= 32 ? 0xffffffff : (1U << width) - 1;
+}
+
+static inline uint32_t reg_field_get(const struct reg_field *field, uint32_t val)
+{
+    return (val >> field->start) & reg_field_mask(field);
+}
+
+static inline uint32_t reg_field_put(const struct reg_field *field, uint32_t reg_val,
+        uint32_t val)
+{
+    uint32_t mask = reg_field_mask(field);
+    return (reg_val & ~(mask << field->start)) | ((val & mask) << field->start);
+}
+
+#endif /* REGS_H */
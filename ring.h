@@ -0,0 +1,89 @@
+// Lock-free single-producer/single-consumer ring of fixed-size records
+//
+// The ring is one contiguous allocation (header plus slots), holds no
+// pointers, and so also works when placed in memory shared between
+// processes.  The producer only writes head and the consumer only writes
+// tail, each on its own cache line; every index is free-running and
+// wrapped with a mask, so size must be a power of two.
+
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RING_CACHE_LINE 64
+
+struct ring {
+    uint32_t head;              /* next slot to fill, written by the producer */
+    uint32_t tail_cache;        /* producer's last view of tail */
+    char pad1[RING_CACHE_LINE - 2 * sizeof(uint32_t)];
+    uint32_t tail;              /* next slot to drain, written by the consumer */
+    uint32_t head_cache;        /* consumer's last view of head */
+    char pad2[RING_CACHE_LINE - 2 * sizeof(uint32_t)];
+    uint32_t size;              /* number of slots, a power of two */
+    uint32_t slot_size;         /* bytes per slot */
+    char pad3[RING_CACHE_LINE - 2 * sizeof(uint32_t)];
+    unsigned char slots[];
+};
+
+// Bytes needed for a ring of size slots of slot_size bytes each
+static inline size_t ring_bytes(uint32_t size, uint32_t slot_size)
+{
+    return sizeof(struct ring) + (size_t)size * slot_size;
+}
+
+static inline void ring_init(struct ring *ring, uint32_t size, uint32_t slot_size)
+{
+    ring->head = ring->tail_cache = 0;
+    ring->tail = ring->head_cache = 0;
+    ring->size = size;
+    ring->slot_size = slot_size;
+}
+
+// Producer: return the next free slot, or NULL if the ring is full
+static inline void *ring_reserve(struct ring *ring)
+{
+    uint32_t head = ring->head;
+
+    if (head - ring->tail_cache >= ring->size) {
+        ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (head - ring->tail_cache >= ring->size)
+            return NULL;
+    }
+    return ring->slots + (size_t)(head & (ring->size - 1)) * ring->slot_size;
+}
+
+// Producer: publish the slot returned by ring_reserve()
+static inline void ring_commit(struct ring *ring)
+{
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+// Consumer: return the oldest filled slot, or NULL if the ring is empty
+static inline const void *ring_peek(struct ring *ring)
+{
+    uint32_t tail = ring->tail;
+
+    if (tail == ring->head_cache) {
+        ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (tail == ring->head_cache)
+            return NULL;
+    }
+    return ring->slots + (size_t)(tail & (ring->size - 1)) * ring->slot_size;
+}
+
+// Consumer: hand the slot returned by ring_peek() back to the producer
+static inline void ring_release(struct ring *ring)
+{
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+// Number of filled slots, as seen by either side
+static inline uint32_t ring_count(struct ring *ring)
+{
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) -
+        __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+#endif /* RING_H */
@@ -1,110 +1,123 @@
 // PWM example, based on code from http://elinux.org/RPi_Low-level_peripherals for the mmap part
 // and http://www.raspberrypi.org/phpBB3/viewtopic.php?t=8467&p=124620 for PWM initialization
 //
-// compile with "gcc pwm.c -o pwm", test with "./pwm" (needs to be root for /dev/mem access)
+// compile with "gcc servo.c periph.c dma.c motion.c clkman.c pwmsim.c reglock.c -o servo -lpthread -lrt -lm", test with "./servo" (needs to be root for /dev/mem access)
+//
+// "./servo -d" feeds the PWM FIFO from a looping DMA control block instead
+// of the PWM_DAT1 register, so position updates are just memory writes.
+// It uses DMA channel 14 like multiservo and servod (-c to change it), and
+// stops the channel and frees its memory on Ctrl-C or SIGTERM.
+//
+// "./servo -m" runs the PWM in M/S mode from a 10 MHz clock instead of the
+// serializer: the pulse width is DAT1 in 0.1 us steps, 10000 positions
+// between 1 and 2 ms instead of 17.  Works with -d too.
+//
+// On a simulated backend (RPI_PERIPH=anon or file:PATH) the PWM model in
+// pwmsim.c plays the pin, and every position prints the pulse it measured.
+//
+// Moves between positions follow a trapezoidal (or with -s, S-curve)
+// velocity profile limited by -v percent/s and -a percent/s^2, updated once
+// per 20 ms PWM frame at absolute deadlines.
 //
 // Frank Buss, 2012
 
-#define BCM2708_PERI_BASE	0x20000000
-#define GPIO_BASE		(BCM2708_PERI_BASE + 0x200000) /* GPIO controller */
-#define PWM_BASE		(BCM2708_PERI_BASE + 0x20C000) /* PWM controller */
-#define CLOCK_BASE		(BCM2708_PERI_BASE + 0x101000)
-
 #define	PWM_CTL  0
+#define	PWM_STA  1
+#define	PWM_DMAC 2
 #define	PWM_RNG1 4
 #define	PWM_DAT1 5
-
-#define	PWMCLK_CNTL 40
-#define	PWMCLK_DIV  41
+#define	PWM_FIF  6
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <dirent.h>
-#include <fcntl.h>
-#include <assert.h>
-#include <sys/mman.h>
-#include <sys/types.h>
-#include <sys/stat.h>
+#include <stdint.h>
+#include <signal.h>
 
 #include <unistd.h>
 
-#define PAGE_SIZE (4*1024)
-#define BLOCK_SIZE (4*1024)
+#include "periph.h"
+#include "reglock.h"
+#include "dma.h"
+#include "motion.h"
+#include "clkman.h"
+#include "pwmsim.h"
 
 // I/O access
-volatile unsigned *gpio;
-volatile unsigned *pwm;
-volatile unsigned *clk;
+volatile uint32_t *gpio;
+volatile uint32_t *pwm;
+
+// DMA mode: one control block that loops over a 20 ms frame of FIFO words
+#define FRAME_WORDS 10  // 320 bits at 16 kHz
+#define DMA_CHANNEL 14
+
+int useDma;
+int dmaChannelNum = DMA_CHANNEL;
+struct dma_mem dmaMem;
+struct dma_channel dmaChannel;
+volatile uint32_t *frame;
+int frameWords = FRAME_WORDS;
+
+// M/S mode: PLLD (500 MHz) / 50 = 10 MHz, integer divisor so there is no
+// jitter, RNG1 = 20 ms of that clock and DAT1 = pulse width in clock cycles
+#define MS_CLOCK_DIV 50
+#define MS_TICKS_PER_US 10
+#define MS_RANGE (20000 * MS_TICKS_PER_US)
+
+int useMs;
+
+// trajectory: one update per PWM frame, hold each position for a second
+#define FRAME_NS 20000000
+#define HOLD_FRAMES 50
 
 // GPIO setup macros. Always use INP_GPIO(x) before using OUT_GPIO(x) or SET_GPIO_ALT(x,y)
-#define INP_GPIO(g) *(gpio+((g)/10)) &= ~(7<<(((g)%10)*3))
-#define OUT_GPIO(g) *(gpio+((g)/10)) |=  (1<<(((g)%10)*3))
-#define SET_GPIO_ALT(g,a) *(gpio+(((g)/10))) |= (((a)<=3?(a)+4:(a)==4?3:2)<<(((g)%10)*3))
+// The read-modify-writes lock the GPFSEL bank, see reglock.h
+#define INP_GPIO(g) reglock_rmw(gpio, (g)/10, 7<<(((g)%10)*3), 0)
+#define OUT_GPIO(g) reglock_rmw(gpio, (g)/10, 0, 1<<(((g)%10)*3))
+#define SET_GPIO_ALT(g,a) reglock_rmw(gpio, (g)/10, 0, ((a)<=3?(a)+4:(a)==4?3:2)<<(((g)%10)*3))
 
 #define GPIO_SET *(gpio+7)  // sets   bits which are 1 ignores bits which are 0
 #define GPIO_CLR *(gpio+10) // clears bits which are 1 ignores bits which are 0
 
-// map 4k register memory for direct access from user space and return a user space pointer to it
-volatile unsigned *mapRegisterMemory(int base)
+// set up a memory regions to access GPIO and PWM
+void setupRegisterMemoryMappings()
 {
-	static int mem_fd = 0;
-	char *mem, *map;
-	
-	/* open /dev/mem */
-	if (!mem_fd) {
-		if ((mem_fd = open("/dev/mem", O_RDWR|O_SYNC) ) < 0) {
-			printf("can't open /dev/mem \n");
-			exit (-1);
-		}
-	}
-	
-	/* mmap register */
-	
-	// Allocate MAP block
-	if ((mem = malloc(BLOCK_SIZE + (PAGE_SIZE-1))) == NULL) {
-		printf("allocation error \n");
-		exit (-1);
-	}
-	
-	// Make sure pointer is on 4K boundary
-	if ((unsigned long)mem % PAGE_SIZE)
-		mem += PAGE_SIZE - ((unsigned long)mem % PAGE_SIZE);
-	
-	// Now map it
-	map = (char *)mmap(
-		(caddr_t)mem,
-		BLOCK_SIZE,
-		PROT_READ|PROT_WRITE,
-		MAP_SHARED|MAP_FIXED,
-		mem_fd,
-		base
-	);
-	
-	if ((long)map < 0) {
-		printf("mmap error %d\n", (int)map);
-		exit (-1);
-	}
-	
-	// Always use volatile pointer!
-	return (volatile unsigned *)map;
+	gpio = periph_map(GPIO_OFFSET);
+	pwm = periph_map(PWM_OFFSET);
 }
 
-// set up a memory regions to access GPIO, PWM and the clock manager
-void setupRegisterMemoryMappings()
+#define MAX 100
+
+// M/S mode: set the pulse width in microseconds, 0.1 us resolution
+void setServoUs(double us)
 {
-	gpio = mapRegisterMemory(GPIO_BASE);
-	pwm = mapRegisterMemory(PWM_BASE);
-	clk = mapRegisterMemory(CLOCK_BASE);
+	uint32_t ticks;
+
+	if (us < 0) us = 0;
+	if (us > MS_RANGE / MS_TICKS_PER_US) us = MS_RANGE / MS_TICKS_PER_US;
+	ticks = (uint32_t) (us * MS_TICKS_PER_US + 0.5);
+	if (useDma)
+		frame[0] = ticks;
+	else
+		periph_wr(pwm, PWM_DAT1, ticks);
 }
 
-#define MAX 100
+// M/S mode: position in percent, fractions allowed: 0 % = 1 ms, 100 % = 2 ms
+void setServoPercent(double percent)
+{
+	setServoUs(1000 + 1000 * percent / MAX);
+}
 
 void setServo(int percent)
 {
 	int bitCount;
 	unsigned int bits = 0;
 
+	if (useMs) {
+		setServoPercent(percent);
+		return;
+	}
+
 	// 32 bits = 2 milliseconds
 	bitCount = 16 + 16 * percent / MAX;
 	if (bitCount > 32) bitCount = 32;
@@ -115,69 +128,253 @@ void setServo(int percent)
 		bits |= 1;
 		bitCount--;
 	}
-	*(pwm + PWM_DAT1) = bits;
+	if (useDma)
+		frame[0] = bits;
+	else
+		periph_wr(pwm, PWM_DAT1, bits);
+}
+
+// any mode: position in percent, rounded to whole percent unless in M/S mode
+void setServoPosition(double percent)
+{
+	if (useMs)
+		setServoPercent(percent);
+	else
+		setServo((int) (percent + 0.5));
+}
+
+// build the DMA control block: copy the frame to the PWM FIFO, paced by the
+// PWM DREQ, then start over with the same block
+struct dma_cb *buildServoDma(struct dma_mem *mem)
+{
+	struct dma_cb *cb = mem->virt;
+
+	frame = (volatile uint32_t *)(cb + 1);
+	memset((void *)frame, 0, frameWords * sizeof(*frame));
+
+	cb->ti = DMA_TI_DEST_DREQ | DMA_TI_PERMAP(DMA_DREQ_PWM) | DMA_TI_SRC_INC |
+		DMA_TI_WAIT_RESP | DMA_TI_NO_WIDE_BURSTS;
+	cb->source_ad = dma_bus_addr(mem, (void *)frame);
+	cb->dest_ad = PERIPH_BUS_ADDR(PWM_OFFSET, PWM_FIF);
+	cb->txfr_len = frameWords * sizeof(*frame);
+	cb->stride = 0;
+	cb->nextconbk = dma_bus_addr(mem, cb);
+	return cb;
+}
+
+// simulated backends: the PWM model stands in for a scope on GPIO18
+struct pwmsim pwmSim;
+int simulated;
+
+volatile sig_atomic_t running = 1;
+
+void stop(int sig)
+{
+	running = 0;
+}
+
+// DREQ from the model: let the simulated DMA channel move one word
+int simDreq(void *arg)
+{
+	return dma_sim_run(&dmaChannel, 1);
+}
+
+// simulated backends: catch the model up with the frame clock and report
+// the pulse the pin sent in the last frame
+uint64_t simFrames;
+void simFrame(uint64_t frames)
+{
+	uint64_t highPs;
+
+	// at least one frame, so there is always a pulse to report
+	do {
+		highPs = pwmSim.ch[0].high_ps;
+		pwmsim_run(&pwmSim, FRAME_NS);
+	} while (++simFrames < frames);
+	printf("simulated frame: %.1f us pulse\n", (pwmSim.ch[0].high_ps - highPs) / 1e6);
 }
 
 // init hardware
 void initHardware()
 {
+	struct clk_request clock = { .clock = CLK_PWM, .enable = 1 };
+
 	// mmap register space
 	setupRegisterMemoryMappings();
+	simulated = !pwmsim_init(&pwmSim);
 	
 	// set PWM alternate function for GPIO18
 	SET_GPIO_ALT(18, 5);
 
-	// stop clock and waiting for busy flag doesn't work, so kill clock
-	*(clk + PWMCLK_CNTL) = 0x5A000000 | (1 << 5);
-	usleep(10);  
-
-	// set frequency
-	// DIVI is the integer part of the divisor
-	// the fractional part (DIVF) drops clock cycles to get the output frequency, bad for servo motors
-	// 320 bits for one cycle of 20 milliseconds = 62.5 us per bit = 16 kHz
-	int idiv = (int) (19200000.0f / 16000.0f);
-	if (idiv < 1 || idiv > 0x1000) {
-		printf("idiv out of range: %x\n", idiv);
+	if (useMs) {
+		// 10 MHz from PLLD
+		clock.setting.src = CLK_SRC_PLLD;
+		clock.setting.divi = MS_CLOCK_DIV;
+	} else {
+		// set frequency
+		// DIVI is the integer part of the divisor
+		// the fractional part (DIVF) drops clock cycles to get the output frequency, bad for servo motors
+		// 320 bits for one cycle of 20 milliseconds = 62.5 us per bit = 16 kHz
+		clock.setting.src = CLK_SRC_OSC;
+		clock.setting.divi = (int) (19200000.0f / 16000.0f);
+	}
+
+	// stops the clock, waits for BUSY to drop, sets the divisor and enables it
+	if (clk_set(&clock, 1)) {
+		perror("Unable to set the PWM clock");
 		exit(-1);
 	}
-	*(clk + PWMCLK_DIV)  = 0x5A000000 | (idiv<<12);
-	
-	// source=osc and enable clock
-	*(clk + PWMCLK_CNTL) = 0x5A000011;
 
 	// disable PWM
-	*(pwm + PWM_CTL) = 0;
+	periph_wr(pwm, PWM_CTL, 0);
 	
-	// needs some time until the PWM module gets disabled, without the delay the PWM module crashs
-	usleep(10);  
+	// needs some time until the PWM module gets disabled, without the delay the PWM module crashs;
+	// wait until STA1/STA2 say both channels have stopped
+	periph_wait(pwm, PWM_STA, 3 << 9, 0, PERIPH_SETTLE_NS);
 	
+	if (useDma) {
+		struct dma_cb *cb;
+
+		// in M/S mode one FIFO word is a whole 20 ms frame
+		if (useMs)
+			frameWords = 1;
+		// open the channel first, the memory outlives the process
+		if (dma_channel_open(&dmaChannel, dmaChannelNum) ||
+				dma_mem_alloc(&dmaMem, sizeof(*cb) + frameWords * sizeof(uint32_t))) {
+			perror("can't set up DMA");
+			exit(-1);
+		}
+		cb = buildServoDma(&dmaMem);
+		setServo(0);
+
+		// one FIFO word per serializer or M/S cycle
+		periph_wr(pwm, PWM_RNG1, useMs ? MS_RANGE : 32);
+
+		// clear the FIFO, then let it request data via DREQ
+		periph_wr(pwm, PWM_CTL, 1 << 6);
+		periph_wr(pwm, PWM_DMAC, (1U << 31) | (7 << 8) | 7);
+
+		dma_start(&dmaChannel, dma_bus_addr(&dmaMem, cb));
+		if (simulated) {
+			dma_sim_sink(PERIPH_BUS_ADDR(PWM_OFFSET, PWM_FIF), pwmsim_fifo_sink, &pwmSim);
+			pwmSim.dreq = simDreq;
+		}
+
+		// start PWM1 in serializer or M/S mode, fed from the FIFO
+		periph_wr(pwm, PWM_CTL, (1 << 5) | (useMs ? (1 << 7) | 1 : 3));
+		return;
+	}
+
+	if (useMs) {
+		// 20 ms period, init with 1 millisecond
+		periph_wr(pwm, PWM_RNG1, MS_RANGE);
+		setServo(0);
+
+		// start PWM1 in M/S mode
+		periph_wr(pwm, PWM_CTL, (1 << 7) | 1);
+		return;
+	}
+
 	// filled with 0 for 20 milliseconds = 320 bits
-	*(pwm + PWM_RNG1) = 320;
+	periph_wr(pwm, PWM_RNG1, 320);
 	
 	// 32 bits = 2 milliseconds, init with 1 millisecond
 	setServo(0);
 	
 	// start PWM1 in serializer mode
-	*(pwm + PWM_CTL) = 3;
+	periph_wr(pwm, PWM_CTL, 3);
+}
+
+// DMA mode: stop the channel feeding the FIFO and give back its memory,
+// the VideoCore allocation outlives the process otherwise
+void releaseHardware()
+{
+	if (!useDma)
+		return;
+	periph_wr(pwm, PWM_DMAC, 0);
+	dma_stop(&dmaChannel);
+	periph_wr(pwm, PWM_CTL, 0);
+	dma_mem_free(&dmaMem);
 }
 
 int main(int argc, char **argv)
 { 
+	static const int positions[] = { 0, 25, 50, 75, 100 };
+	enum motion_profile profile = MOTION_TRAPEZOID;
+	double vmax = 200, amax = 800;
+	struct motion motion;
+	struct frame_clock fc;
+	uint64_t misses = 0;
+	int ch, i, hold;
+
+	while ((ch = getopt(argc, argv, "dc:msv:a:")) != -1) {
+		switch (ch) {
+		case 'd':
+			useDma = 1;
+			break;
+
+		case 'c':
+			dmaChannelNum = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'm':
+			useMs = 1;
+			break;
+
+		case 's':
+			profile = MOTION_SCURVE;
+			break;
+
+		case 'v':
+			vmax = atof(optarg);
+			break;
+
+		case 'a':
+			amax = atof(optarg);
+			break;
+
+		default:
+			printf("Usage: %s [-d] [-c dma_channel] [-m] [-s] [-v percent/s] [-a percent/s^2]\n", argv[0]);
+			printf("\t-d  feed the PWM FIFO by DMA\n");
+			printf("\t-c  DMA channel for -d (default %d)\n", DMA_CHANNEL);
+			printf("\t-m  M/S mode, 0.1 us pulse resolution\n");
+			printf("\t-s  S-curve instead of trapezoidal moves\n");
+			printf("\t-v  maximum velocity (default %g, 0 = jump)\n", vmax);
+			printf("\t-a  maximum acceleration (default %g)\n", amax);
+			return 1;
+		}
+	}
+
+	signal(SIGINT, stop);
+	signal(SIGTERM, stop);
+
 	// init PWM module for GPIO pin 18 with 50 Hz frequency
 	initHardware();
 	
 	// servo test, position in percent: 0 % = 1 ms, 100 % = 2 ms
-	while (1) {
-		setServo(0);
-		sleep(1);
-		setServo(25);
-		sleep(1);
-		setServo(50);
-		sleep(1);
-		setServo(75);
-		sleep(1);
-		setServo(100);
-		sleep(1);
+	motion_init(&motion, profile, vmax, amax, FRAME_NS / 1e9, 0);
+	frame_clock_start(&fc, FRAME_NS);
+	while (running) {
+		for (i = 0; running && i < sizeof(positions) / sizeof(*positions); i++) {
+			motion_move(&motion, positions[i]);
+			while (running && !motion_done(&motion)) {
+				// compute first, so the write lands right after the deadline
+				double pos = motion_step(&motion);
+				frame_clock_wait(&fc);
+				setServoPosition(pos);
+			}
+			if (simulated)
+				simFrame(fc.frames);
+			if (fc.misses != misses) {
+				printf("%llu deadline misses in %llu frames, worst %.1f us late\n",
+					(unsigned long long) fc.misses, (unsigned long long) fc.frames,
+					fc.worst_late_ns / 1000.0);
+				misses = fc.misses;
+			}
+			for (hold = 0; running && hold < HOLD_FRAMES; hold++)
+				frame_clock_wait(&fc);
+		}
 	}
+	releaseHardware();
 	return 0;
 }
@@ -0,0 +1,80 @@
+// Send servo positions to servod
+//
+// compile with "gcc servoctl.c -o servoctl -lrt",
+// test with "./servoctl 4=1000 17=2000" while servod runs (as root, or as a
+// member of the group servod gives the shared memory to, see servod.c)
+//
+// All pins given are stored first and then published with one doorbell, so
+// they change in the same frame.  "-s" prints the daemon's targets and how
+// long commands took from the doorbell to the registers.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include <unistd.h>
+
+#include "servod.h"
+
+static void print_status(const struct servod_shm *shm)
+{
+    int pin;
+
+    printf("servod pid %u, %u us ticks, %llu updates, latency last %.1f us, worst %.1f us\n",
+            shm->pid, shm->tick_us, (unsigned long long)shm->updates,
+            shm->last_latency_ns / 1000.0, shm->max_latency_ns / 1000.0);
+    for (pin = 0; pin < SERVOD_PINS; pin++)
+        if (shm->pins & (1U << pin))
+            printf("GPIO%d: %u us\n", pin, shm->target_us[pin]);
+}
+
+int main(int argc, char **argv)
+{
+    struct servod_shm *shm;
+    int status = 0, stored = 0;
+    int ch, i;
+
+    while ((ch = getopt(argc, argv, "s")) != -1) {
+        switch (ch) {
+        case 's':
+            status = 1;
+            break;
+
+        default:
+            printf("Usage: %s [-s] pin=us...\n", argv[0]);
+            return 1;
+        }
+    }
+
+    shm = servod_attach();
+    if (!shm) {
+        perror("servod not running");
+        return 1;
+    }
+
+    for (i = optind; i < argc; i++) {
+        char *end;
+        int pin = strtol(argv[i], &end, 0);
+
+        if (*end != '=') {
+            fprintf(stderr, "Expected pin=microseconds, got \"%s\"\n", argv[i]);
+            return 1;
+        }
+        if (pin < 0 || pin >= SERVOD_PINS || !(shm->pins & (1U << pin))) {
+            fprintf(stderr, "GPIO%d isn't driven by servod\n", pin);
+            return 1;
+        }
+        servod_store(shm, pin, strtoul(end + 1, NULL, 0));
+        stored++;
+    }
+    if (stored)
+        servod_ring(shm);
+
+    if (status) {
+        if (stored)
+            usleep(1000);   /* let the daemon get to it */
+        print_status(shm);
+    }
+    return 0;
+}
@@ -0,0 +1,235 @@
+// Resident servo daemon
+//
+// compile with "gcc servod.c dmaservo.c clkman.c dma.c periph.c reglock.c -o servod -lpthread -lrt -lm",
+// run with "./servod 4=1500 17=1500 &" (needs to be root for /dev/mem access)
+//
+// Sets up the clock, PWM and DMA once (see dmaservo.h) and then sleeps on a
+// futex in shared memory (see servod.h).  Clients such as servoctl write
+// target pulse widths into per-pin slots and ring the doorbell; the daemon
+// wakes, patches the mask words of the pins that changed and goes back to
+// sleep, so a command reaches the registers within microseconds and the
+// output never glitches from reinitialisation.  SIGINT or SIGTERM stops the
+// pulses and removes the shared memory.
+//
+// Whoever can write the shared memory can move the servos, so it is only
+// open to root and to one group, "gpio" unless -g names another.  Let a
+// user run servoctl with "usermod -aG gpio USER" (and a fresh login).
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <grp.h>
+#include <sys/stat.h>
+
+#include <unistd.h>
+
+#include "periph.h"
+#include "dma.h"
+#include "dmaservo.h"
+#include "servod.h"
+
+#define SERVOD_GROUP "gpio"
+
+static struct dmaservo ds;
+static struct servod_shm *shm;
+static volatile sig_atomic_t running = 1;
+
+static void stop(int sig)
+{
+    running = 0;
+}
+
+// is the object a running daemon's?  Only looks, so it can be asked before
+// anything about the object changes
+static int daemon_running(int fd)
+{
+    const struct servod_shm *s;
+    struct stat st;
+    int running;
+
+    if (fstat(fd, &st) || st.st_size < (off_t)sizeof(*s))
+        return 0;
+    s = mmap(NULL, sizeof(*s), PROT_READ, MAP_SHARED, fd, 0);
+    if (s == MAP_FAILED)
+        return 0;
+    running = s->magic == SERVOD_MAGIC && s->pid && kill(s->pid, 0) == 0;
+    munmap((void *)s, sizeof(*s));
+    return running;
+}
+
+// create the shared memory, refusing to if another daemon still owns it.
+// Clients in group get write access; without it only root does.
+static struct servod_shm *create_shm(uint32_t pins, unsigned int tick_us, const char *group)
+{
+    struct servod_shm *s;
+    struct group *gr = getgrnam(group);
+    int fd = shm_open(SERVOD_SHM_NAME, O_RDWR|O_CREAT, 0600);
+
+    if (fd < 0)
+        return NULL;
+    /* a running daemon's object keeps its owner, group and mode */
+    if (daemon_running(fd)) {
+        close(fd);
+        errno = EBUSY;
+        return NULL;
+    }
+    /* an object left by an older servod may still be open to everyone */
+    if (gr && fchown(fd, -1, gr->gr_gid) == 0) {
+        fchmod(fd, 0660);
+    } else {
+        fprintf(stderr, "No group %s, servoctl needs to be root\n", group);
+        fchmod(fd, 0600);
+    }
+    if (ftruncate(fd, sizeof(*s))) {
+        close(fd);
+        return NULL;
+    }
+    s = mmap(NULL, sizeof(*s), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (s == MAP_FAILED)
+        return NULL;
+
+    memset(s, 0, sizeof(*s));
+    s->version = SERVOD_VERSION;
+    s->pins = pins;
+    s->tick_us = tick_us;
+    s->pid = getpid();
+    __atomic_store_n(&s->magic, SERVOD_MAGIC, __ATOMIC_RELEASE);
+    return s;
+}
+
+// apply every slot that differs from what the DMA list produces
+static unsigned int apply_targets(uint32_t applied[], int verbose)
+{
+    unsigned int changed = 0;
+    int pin;
+
+    for (pin = 0; pin < SERVOD_PINS; pin++) {
+        uint32_t us;
+
+        if (!(ds.pins & (1U << pin)))
+            continue;
+        us = __atomic_load_n(&shm->target_us[pin], __ATOMIC_RELAXED);
+        if (us == applied[pin])
+            continue;
+        if (dmaservo_set_us(&ds, pin, us)) {
+            if (verbose)
+                fprintf(stderr, "Can't set GPIO%d to %u us\n", pin, us);
+            /* put the slot back, so it doesn't look applied to clients */
+            __atomic_store_n(&shm->target_us[pin], applied[pin], __ATOMIC_RELAXED);
+            continue;
+        }
+        applied[pin] = us;
+        changed++;
+    }
+    return changed;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int tick_us = 10;
+    int channel = 14, verbose = 0;
+    const char *group = SERVOD_GROUP;
+    uint32_t pins = 0, seen;
+    uint32_t applied[SERVOD_PINS];
+    struct sigaction sa;
+    struct timespec timeout = { 1, 0 };
+    int ch, i;
+
+    while ((ch = getopt(argc, argv, "t:c:g:v")) != -1) {
+        switch (ch) {
+        case 't':
+            tick_us = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'c':
+            channel = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'g':
+            group = optarg;
+            break;
+
+        case 'v':
+            verbose = 1;
+            break;
+
+        default:
+            printf("Usage: %s [-t tick_us] [-c dma_channel] [-g group] [-v] pin[=us]...\n", argv[0]);
+            return 1;
+        }
+    }
+
+    for (i = optind; i < argc; i++) {
+        int pin = strtol(argv[i], NULL, 0);
+        if (pin < 0 || pin >= SERVOD_PINS) {
+            fprintf(stderr, "Pin %d out of range, only GPIO0-31 can be driven\n", pin);
+            return 1;
+        }
+        pins |= 1U << pin;
+    }
+    if (!pins) {
+        fprintf(stderr, "No pins given\n");
+        return 1;
+    }
+
+    shm = create_shm(pins, tick_us, group);
+    if (!shm) {
+        perror(errno == EBUSY ? "servod already running" : "Unable to create shared memory");
+        return 1;
+    }
+
+    if (dmaservo_init(&ds, channel, tick_us, pins)) {
+        perror("Unable to start DMA");
+        shm_unlink(SERVOD_SHM_NAME);
+        return 1;
+    }
+
+    /* Keep wakeups free of page faults */
+    mlockall(MCL_CURRENT|MCL_FUTURE);
+
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;            /* no SA_RESTART: interrupt the futex wait */
+    sa.sa_handler = stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    memset(applied, 0, sizeof(applied));
+    for (i = optind; i < argc; i++) {
+        char *eq = strchr(argv[i], '=');
+        if (eq)
+            shm->target_us[strtol(argv[i], NULL, 0)] = strtoul(eq + 1, NULL, 0);
+    }
+    apply_targets(applied, verbose);
+
+    seen = __atomic_load_n(&shm->doorbell, __ATOMIC_ACQUIRE);
+    while (running) {
+        uint32_t bell;
+        uint64_t latency;
+        unsigned int changed;
+
+        syscall(SYS_futex, &shm->doorbell, FUTEX_WAIT, seen, &timeout, NULL, 0);
+        bell = __atomic_load_n(&shm->doorbell, __ATOMIC_ACQUIRE);
+        if (bell == seen)
+            continue;
+        seen = bell;
+
+        changed = apply_targets(applied, verbose);
+        if (!changed)
+            continue;
+        latency = servod_now_ns() - __atomic_load_n(&shm->stamp_ns, __ATOMIC_RELAXED);
+        shm->updates += changed;
+        shm->last_latency_ns = latency;
+        if (latency > shm->max_latency_ns)
+            shm->max_latency_ns = latency;
+        if (verbose)
+            printf("%u pins updated, %.1f us after the doorbell\n", changed, latency / 1000.0);
+    }
+
+    dmaservo_stop(&ds);
+    shm->magic = 0;
+    shm_unlink(SERVOD_SHM_NAME);
+    return 0;
+}
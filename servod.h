@@ -0,0 +1,88 @@
+// Shared-memory interface of the servo daemon
+//
+// servod owns the hardware (see dmaservo.h) and maps a small POSIX shared
+// memory object.  It holds one latest-value slot per GPIO, the target pulse
+// width in microseconds.  A client stores the targets it wants, stamps the
+// time and increments the doorbell, then wakes the daemon with a futex.
+// The daemon applies every slot that changed, which only patches DMA mask
+// words, so nothing is remapped or reinitialised per command.
+//
+// Slots rather than a queue: only the newest target of a servo matters, a
+// busy client can't overrun anything, and any number of clients may write
+// (a single-producer ring would need one per client).
+
+#ifndef SERVOD_H
+#define SERVOD_H
+
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include <unistd.h>
+
+#define SERVOD_SHM_NAME	"/rpi-servod"
+#define SERVOD_MAGIC	0x53525644	/* "SRVD" */
+#define SERVOD_VERSION	1
+#define SERVOD_PINS	32
+
+struct servod_shm {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t pins;              /* pins the daemon drives */
+    uint32_t tick_us;           /* pulse width resolution */
+    uint32_t doorbell;          /* futex word, incremented by clients */
+    uint32_t pid;               /* daemon */
+    uint64_t stamp_ns;          /* CLOCK_MONOTONIC of the last doorbell */
+
+    /* written by the daemon */
+    uint64_t updates;           /* slot changes applied */
+    uint64_t last_latency_ns;   /* doorbell to registers, last and worst */
+    uint64_t max_latency_ns;
+
+    uint32_t target_us[SERVOD_PINS];    /* latest-value slots, 0 = off */
+};
+
+static inline uint64_t servod_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Map the daemon's shared memory, NULL (errno set) if it isn't running
+static inline struct servod_shm *servod_attach(void)
+{
+    struct servod_shm *shm;
+    int fd = shm_open(SERVOD_SHM_NAME, O_RDWR, 0);
+
+    if (fd < 0)
+        return NULL;
+    shm = mmap(NULL, sizeof(*shm), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED)
+        return NULL;
+    if (shm->magic != SERVOD_MAGIC || shm->version != SERVOD_VERSION) {
+        munmap(shm, sizeof(*shm));
+        return NULL;
+    }
+    return shm;
+}
+
+// Store a target without waking the daemon, to batch several pins
+static inline void servod_store(struct servod_shm *shm, int pin, uint32_t us)
+{
+    __atomic_store_n(&shm->target_us[pin], us, __ATOMIC_RELAXED);
+}
+
+// Publish the stored targets and wake the daemon
+static inline void servod_ring(struct servod_shm *shm)
+{
+    __atomic_store_n(&shm->stamp_ns, servod_now_ns(), __ATOMIC_RELAXED);
+    __atomic_add_fetch(&shm->doorbell, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &shm->doorbell, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+#endif /* SERVOD_H */
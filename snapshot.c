@@ -0,0 +1,203 @@
+// Binary register snapshots, see snapshot.h
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#include "periph.h"
+#include "regs.h"
+#include "snapshot.h"
+
+static int word_cmp(const void *a, const void *b)
+{
+    uint32_t aa = ((const struct snapshot_word *)a)->addr;
+    uint32_t ba = ((const struct snapshot_word *)b)->addr;
+    return aa < ba ? -1 : aa > ba;
+}
+
+int snapshot_capture(struct snapshot *snap, const struct reg_map *map,
+        volatile uint32_t *const mem[])
+{
+    struct timespec ts;
+    unsigned int block_num, reg_num, count = 0;
+
+    snap->words = malloc(map->nregs * sizeof(*snap->words));
+    if (!snap->words)
+        return -1;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    for (block_num = 0; block_num < map->nblocks; block_num++) {
+        const struct reg_block *block = &map->blocks[block_num];
+        for (reg_num = block->first_reg; reg_num < block->first_reg + block->nregs;
+                reg_num++) {
+            const struct reg_desc *reg = &map->regs[reg_num];
+            snap->words[count].addr = block->offset + reg->offset;
+            snap->words[count].value = periph_rd(mem[block_num], reg->offset/4);
+            count++;
+        }
+    }
+    qsort(snap->words, count, sizeof(*snap->words), word_cmp);
+
+    memcpy(snap->header.magic, SNAPSHOT_MAGIC, sizeof(snap->header.magic));
+    snap->header.version = SNAPSHOT_VERSION;
+    snap->header.count = count;
+    snap->header.timestamp_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    return 0;
+}
+
+int snapshot_save(const struct snapshot *snap, const char *path)
+{
+    FILE *fp = fopen(path, "wb");
+    int ret = 0;
+
+    if (!fp)
+        return -1;
+    if (fwrite(&snap->header, sizeof(snap->header), 1, fp) != 1 ||
+            fwrite(snap->words, sizeof(*snap->words), snap->header.count, fp)
+            != snap->header.count)
+        ret = -1;
+    if (fclose(fp))
+        ret = -1;
+    return ret;
+}
+
+int snapshot_load(struct snapshot *snap, const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+
+    if (!fp)
+        return -1;
+
+    snap->words = NULL;
+    if (fread(&snap->header, sizeof(snap->header), 1, fp) != 1 ||
+            memcmp(snap->header.magic, SNAPSHOT_MAGIC, sizeof(snap->header.magic)) ||
+            snap->header.version != SNAPSHOT_VERSION)
+        goto bad;
+
+    snap->words = malloc(snap->header.count * sizeof(*snap->words));
+    if (!snap->words ||
+            fread(snap->words, sizeof(*snap->words), snap->header.count, fp)
+            != snap->header.count)
+        goto bad;
+
+    fclose(fp);
+    return 0;
+
+bad:
+    free(snap->words);
+    snap->words = NULL;
+    fclose(fp);
+    errno = EINVAL;
+    return -1;
+}
+
+void snapshot_free(struct snapshot *snap)
+{
+    free(snap->words);
+    snap->words = NULL;
+}
+
+static const struct reg_desc *find_reg(const struct reg_map *map, uint32_t addr,
+        const struct reg_block **blockp)
+{
+    unsigned int block_num, reg_num;
+
+    for (block_num = 0; block_num < map->nblocks; block_num++) {
+        const struct reg_block *block = &map->blocks[block_num];
+        if (addr < block->offset || addr >= block->offset + PERIPH_BLOCK_SIZE)
+            continue;
+        for (reg_num = block->first_reg; reg_num < block->first_reg + block->nregs;
+                reg_num++) {
+            if (block->offset + map->regs[reg_num].offset == addr) {
+                *blockp = block;
+                return &map->regs[reg_num];
+            }
+        }
+    }
+    return NULL;
+}
+
+static int diff_word(const struct reg_map *map, uint32_t addr, uint32_t old_val,
+        uint32_t new_val, FILE *out)
+{
+    const struct reg_block *block;
+    const struct reg_desc *reg = find_reg(map, addr, &block);
+    int field_num, changes = 0;
+
+    if (!reg) {
+        fprintf(out, "0x%06x 0x%08x 0x%08x\n", addr, old_val, new_val);
+        return 1;
+    }
+
+    for (field_num = reg->first_field; field_num < reg->first_field + reg->nfields;
+            field_num++) {
+        const struct reg_field *field = &map->fields[field_num];
+        uint32_t old_field = reg_field_get(field, old_val);
+        uint32_t new_field = reg_field_get(field, new_val);
+
+        if (old_field == new_field || (field->flags & REG_F_RESERVED))
+            continue;
+        fprintf(out, "%s.%s.%s %u %u\n", reg_str(map, block->name),
+                reg_str(map, reg->name), reg_str(map, field->name), old_field, new_field);
+        changes++;
+    }
+
+    /* Only reserved bits changed */
+    if (!changes) {
+        fprintf(out, "%s.%s 0x%08x 0x%08x\n", reg_str(map, block->name),
+                reg_str(map, reg->name), old_val, new_val);
+        changes++;
+    }
+    return changes;
+}
+
+// a register only one snapshot has, printed with "-" for the missing value
+static int diff_missing(const struct reg_map *map, const struct snapshot_word *old_word,
+        const struct snapshot_word *new_word, FILE *out)
+{
+    const struct snapshot_word *word = old_word ? old_word : new_word;
+    const struct reg_block *block;
+    const struct reg_desc *reg = find_reg(map, word->addr, &block);
+    char old_str[11] = "-", new_str[11] = "-";
+
+    if (old_word)
+        snprintf(old_str, sizeof(old_str), "0x%08x", old_word->value);
+    if (new_word)
+        snprintf(new_str, sizeof(new_str), "0x%08x", new_word->value);
+
+    if (reg)
+        fprintf(out, "%s.%s %s %s\n", reg_str(map, block->name),
+                reg_str(map, reg->name), old_str, new_str);
+    else
+        fprintf(out, "0x%06x %s %s\n", word->addr, old_str, new_str);
+    return 1;
+}
+
+int snapshot_diff(const struct snapshot *a, const struct snapshot *b,
+        const struct reg_map *map, FILE *out)
+{
+    unsigned int i = 0, j = 0;
+    int changes = 0;
+
+    /* Both are sorted by address, so walk them side by side */
+    while (i < a->header.count || j < b->header.count) {
+        const struct snapshot_word *wa = i < a->header.count ? &a->words[i] : NULL;
+        const struct snapshot_word *wb = j < b->header.count ? &b->words[j] : NULL;
+
+        if (!wb || (wa && wa->addr < wb->addr)) {
+            changes += diff_missing(map, wa, NULL, out);
+            i++;
+        } else if (!wa || wa->addr > wb->addr) {
+            changes += diff_missing(map, NULL, wb, out);
+            j++;
+        } else {
+            if (wa->value != wb->value)
+                changes += diff_word(map, wa->addr, wa->value, wb->value, out);
+            i++;
+            j++;
+        }
+    }
+    return changes;
+}
@@ -0,0 +1,51 @@
+// Binary register snapshots
+//
+// A snapshot holds the raw value of every described register, keyed by its
+// offset in the peripheral window, so two snapshots taken with different
+// register maps can still be compared.  On disk it is a 16 byte header
+// followed by (address, value) pairs sorted by address, in host byte order.
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "regs.h"
+
+#define SNAPSHOT_MAGIC		"RPIS"
+#define SNAPSHOT_VERSION	1
+
+struct snapshot_header {
+    char magic[4];
+    uint16_t version;
+    uint16_t count;             /* number of words that follow */
+    uint64_t timestamp_ns;      /* CLOCK_REALTIME at capture */
+};
+
+struct snapshot_word {
+    uint32_t addr;              /* offset in the peripheral window */
+    uint32_t value;
+};
+
+struct snapshot {
+    struct snapshot_header header;
+    struct snapshot_word *words;
+};
+
+// Read every register of every block in map.  mem[] holds the mapped
+// registers of each block, in the same order as map->blocks.
+int snapshot_capture(struct snapshot *snap, const struct reg_map *map,
+        volatile uint32_t *const mem[]);
+
+int snapshot_save(const struct snapshot *snap, const char *path);
+int snapshot_load(struct snapshot *snap, const char *path);
+void snapshot_free(struct snapshot *snap);
+
+// Print one "BLOCK.REG.FIELD old new" line for every field that differs
+// between two snapshots, and return how many there were.  A register only
+// one of them holds is printed as "BLOCK.REG old -" or "BLOCK.REG - new".
+int snapshot_diff(const struct snapshot *a, const struct snapshot *b,
+        const struct reg_map *map, FILE *out);
+
+#endif /* SNAPSHOT_H */
@@ -0,0 +1,346 @@
+// GPIO bit-bang waveform player
+//
+// Replays a precomputed stream of (set mask, clear mask, delay) records to
+// GPSET0/GPCLR0 from a busy-wait loop, for serial protocols the PWM block
+// can't produce.  Record n is applied at the start time plus the delays of
+// all records before it, so lateness on one edge doesn't shift the rest.
+// The loop is calibrated at startup: it leaves the spin early by the time a
+// clock read and register write take, so writes land on their deadline.
+// Pins must already be outputs (for example "./af 4=o 17=o").
+//
+// compile with "gcc -O2 wave.c periph.c -o wave",
+// test with "./wave stream.txt" (needs to be root for /dev/mem access)
+//
+// A stream is either text, one "set clear delay_ns" line per record (masks
+// of GPIO0-31, # starts a comment), or binary: "RPIV", a uint32 record
+// count, then uint32 set, clear and delay_ns per record, all in host byte
+// order.  Binary streams are mmap'd and played in place; "-o file" compiles
+// a text stream to binary.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <unistd.h>
+
+#include "periph.h"
+
+#define WAVE_MAGIC "RPIV"
+
+#define GPIO_SET0 7
+#define GPIO_CLR0 10
+
+/* Edge error histogram: 50 ns buckets up to 200 us, the last one open */
+#define ERR_BUCKET_NS 50
+#define ERR_BUCKETS 4000
+
+#define CALIBRATE_LOOPS 10000
+
+struct wave_header {
+    char magic[4];
+    uint32_t count;
+};
+
+struct wave_record {
+    uint32_t set;
+    uint32_t clr;
+    uint32_t delay_ns;          /* until the next record */
+};
+
+struct wave {
+    struct wave_header *header;
+    struct wave_record *records;
+    size_t map_size;            /* nonzero when mmap'd */
+};
+
+struct wave_stats {
+    uint64_t edges;
+    uint64_t late_sum_ns;
+    int64_t min_ns, max_ns;     /* early is negative */
+    uint32_t hist[ERR_BUCKETS];
+};
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int load_binary(struct wave *w, int fd, const char *path)
+{
+    struct stat st;
+    void *map;
+
+    if (fstat(fd, &st) || st.st_size < (off_t)sizeof(struct wave_header)) {
+        fprintf(stderr, "%s: truncated stream\n", path);
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE|MAP_POPULATE, fd, 0);
+    if (map == MAP_FAILED) {
+        perror(path);
+        return -1;
+    }
+    w->header = map;
+    w->records = (struct wave_record *)(w->header + 1);
+    w->map_size = st.st_size;
+    /* Divide rather than multiply: a huge count must not wrap on 32-bit */
+    if (w->header->count > (w->map_size - sizeof(struct wave_header)) /
+            sizeof(struct wave_record)) {
+        fprintf(stderr, "%s: truncated stream\n", path);
+        munmap(map, w->map_size);
+        w->header = NULL;
+        w->map_size = 0;
+        return -1;
+    }
+    return 0;
+}
+
+static int load_text(struct wave *w, FILE *f, const char *path)
+{
+    size_t alloc = 1024, count = 0;
+    char line[256];
+    int lineno = 0;
+
+    w->header = malloc(sizeof(*w->header) + alloc * sizeof(struct wave_record));
+    if (!w->header)
+        return -1;
+
+    while (fgets(line, sizeof(line), f)) {
+        struct wave_record *rec;
+        char *p = line, *end;
+
+        lineno++;
+        if ((end = strchr(p, '#')) != NULL)
+            *end = '\0';
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (!*p || *p == '\n')
+            continue;
+
+        if (count == alloc) {
+            void *bigger = realloc(w->header, sizeof(*w->header) +
+                    2 * alloc * sizeof(struct wave_record));
+            if (!bigger)
+                return -1;
+            w->header = bigger;
+            alloc *= 2;
+        }
+        rec = (struct wave_record *)(w->header + 1) + count;
+        rec->set = strtoul(p, &end, 0);
+        if (end != p)
+            rec->clr = strtoul(p = end, &end, 0);
+        if (end != p)
+            rec->delay_ns = strtoul(p = end, &end, 0);
+        if (end == p) {
+            fprintf(stderr, "%s:%d: expected \"set clear delay_ns\"\n", path, lineno);
+            return -1;
+        }
+        count++;
+    }
+
+    memcpy(w->header->magic, WAVE_MAGIC, 4);
+    w->header->count = count;
+    w->records = (struct wave_record *)(w->header + 1);
+    return 0;
+}
+
+static int load_wave(struct wave *w, const char *path)
+{
+    char magic[4];
+    FILE *f;
+    int err;
+
+    memset(w, 0, sizeof(*w));
+    if ((f = fopen(path, "r")) == NULL) {
+        perror(path);
+        return -1;
+    }
+    if (fread(magic, 4, 1, f) == 1 && !memcmp(magic, WAVE_MAGIC, 4))
+        err = load_binary(w, fileno(f), path);
+    else {
+        rewind(f);
+        err = load_text(w, f, path);
+    }
+    fclose(f);
+    return err;
+}
+
+static int save_wave(const struct wave *w, const char *path)
+{
+    FILE *f = fopen(path, "wb");
+    int err = 0;
+
+    if (!f)
+        return -1;
+    if (fwrite(w->header, sizeof(*w->header), 1, f) != 1 ||
+            fwrite(w->records, sizeof(*w->records), w->header->count, f) != w->header->count)
+        err = -1;
+    if (fclose(f))
+        err = -1;
+    return err;
+}
+
+// how long after leaving the spin a write has landed: one clock read and
+// one register write; writing 0 to GPSET0 changes nothing
+static uint64_t calibrate(volatile uint32_t *gpio)
+{
+    uint64_t start = now_ns();
+    int i;
+
+    for (i = 0; i < CALIBRATE_LOOPS; i++) {
+        (void)now_ns();
+        periph_wr(gpio, GPIO_SET0, 0);
+    }
+    return (now_ns() - start) / CALIBRATE_LOOPS;
+}
+
+static void record_error(struct wave_stats *st, int64_t err)
+{
+    int64_t bucket = err / ERR_BUCKET_NS;
+
+    if (err < st->min_ns)
+        st->min_ns = err;
+    if (err > st->max_ns)
+        st->max_ns = err;
+    if (bucket < 0)
+        bucket = 0;
+    if (bucket >= ERR_BUCKETS)
+        bucket = ERR_BUCKETS - 1;
+    st->hist[bucket]++;
+    st->late_sum_ns += err > 0 ? err : 0;
+    st->edges++;
+}
+
+static int64_t percentile(const struct wave_stats *st, double p)
+{
+    uint64_t want = (uint64_t)(st->edges * p), seen = 0;
+    int i;
+
+    for (i = 0; i < ERR_BUCKETS; i++) {
+        seen += st->hist[i];
+        if (seen > want)
+            return i < ERR_BUCKETS - 1 ? (int64_t)(i + 1) * ERR_BUCKET_NS : st->max_ns;
+    }
+    return st->max_ns;
+}
+
+// the playback loop: no allocation, no system calls besides the vDSO clock
+static uint64_t play(volatile uint32_t *gpio, const struct wave *w, unsigned int repeat,
+        uint64_t lead, struct wave_stats *st)
+{
+    const struct wave_record *rec, *end = w->records + w->header->count;
+    uint64_t start = now_ns() + 10000, deadline = start;
+    unsigned int r;
+
+    for (r = 0; r < repeat; r++) {
+        for (rec = w->records; rec < end; rec++) {
+            while (now_ns() + lead < deadline)
+                ;
+            if (rec->set)
+                periph_wr(gpio, GPIO_SET0, rec->set);
+            if (rec->clr)
+                periph_wr(gpio, GPIO_CLR0, rec->clr);
+            record_error(st, (int64_t)(now_ns() - deadline));
+            deadline += rec->delay_ns;
+        }
+    }
+    return deadline - start;
+}
+
+int main(int argc, char **argv)
+{
+    struct wave w;
+    struct wave_stats *st;
+    volatile uint32_t *gpio;
+    const char *out = NULL;
+    unsigned int repeat = 1;
+    uint64_t lead, start, elapsed, planned, toggles = 0;
+    int cpu = -1;
+    uint32_t i;
+    int ch;
+
+    while ((ch = getopt(argc, argv, "r:p:o:")) != -1) {
+        switch (ch) {
+        case 'r':
+            repeat = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'p':
+            cpu = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'o':
+            out = optarg;
+            break;
+
+        default:
+            printf("Usage: %s [-r repeat] [-p cpu] [-o compiled] stream\n", argv[0]);
+            printf("\t-r  play the stream this many times\n");
+            printf("\t-p  pin the player to this CPU\n");
+            printf("\t-o  write the stream in binary form and exit\n");
+            return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "No stream given\n");
+        return 1;
+    }
+
+    if (load_wave(&w, argv[optind]))
+        return 1;
+    if (out) {
+        if (save_wave(&w, out)) {
+            perror(out);
+            return 1;
+        }
+        printf("%u records written to %s\n", w.header->count, out);
+        return 0;
+    }
+    if (!w.header->count || !repeat)
+        return 0;
+
+    for (i = 0; i < w.header->count; i++)
+        toggles += __builtin_popcount(w.records[i].set) + __builtin_popcount(w.records[i].clr);
+    toggles *= repeat;
+
+    st = calloc(1, sizeof(*st));
+    if (!st) {
+        perror("Unable to allocate statistics");
+        return 1;
+    }
+    st->min_ns = INT64_MAX;
+    st->max_ns = INT64_MIN;
+
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set))
+            perror("Unable to pin player");
+    }
+    mlockall(MCL_CURRENT|MCL_FUTURE);
+
+    gpio = periph_map(GPIO_OFFSET);
+    lead = calibrate(gpio);
+
+    start = now_ns();
+    planned = play(gpio, &w, repeat, lead, st);
+    elapsed = now_ns() - start;
+
+    printf("%llu records in %.3f ms (%.3f ms planned): %.0f records/s, %.0f toggles/s\n",
+            (unsigned long long)st->edges, elapsed / 1e6, planned / 1e6,
+            st->edges * 1e9 / elapsed, toggles * 1e9 / elapsed);
+    printf("edge error: min %lld ns, mean late %.0f ns, p99 %lld ns, max %lld ns (lead %llu ns)\n",
+            (long long)st->min_ns, (double)st->late_sum_ns / st->edges,
+            (long long)percentile(st, 0.99), (long long)st->max_ns,
+            (unsigned long long)lead);
+    return 0;
+}